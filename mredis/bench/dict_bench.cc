@@ -0,0 +1,243 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "mredis/src/dict.h"
+#include "mredis/src/flat_dict.h"
+#include "mredis/src/string.h"
+#include "mredis/src/zmalloc.h"
+
+namespace {
+  const int kLookups = 5000000;
+
+  // Keys are looked up in random order, so most lookups miss the cache.
+  template <typename TDictionary>
+  double LookupNanoseconds(TDictionary& dict, const std::vector<long>& keys) {
+    long sum = 0;
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < kLookups; ++i) {
+      long* value = dict.Fetch(keys[i % keys.size()]);
+      if (value != nullptr) sum += *value;
+    }
+    std::chrono::duration<double, std::nano> diff =
+        std::chrono::high_resolution_clock::now() - start;
+    if (sum == 42) std::printf(" ");
+    return diff.count() / kLookups;
+  }
+
+  // Same as LookupNanoseconds, batch keys per MultiFetch.
+  template <typename TDictionary>
+  double MultiLookupNanoseconds(TDictionary& dict, const std::vector<long>& keys, size_t batch) {
+    long sum = 0;
+    std::vector<long*> values(batch);
+    auto start = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i + batch <= kLookups; i += batch) {
+      dict.MultiFetch(&keys[i % (keys.size() - batch + 1)], batch, values.data());
+      for (size_t j = 0; j < batch; ++j) {
+        if (values[j] != nullptr) sum += *values[j];
+      }
+    }
+    std::chrono::duration<double, std::nano> diff =
+        std::chrono::high_resolution_clock::now() - start;
+    if (sum == 42) std::printf(" ");
+    return diff.count() / kLookups;
+  }
+
+  // Random keys, std::hash<long> is the identity so sequential keys would
+  // never collide in Dictionary.
+  std::vector<long> RandomKeys(long count) {
+    std::vector<long> keys;
+    for (long i = 0; i < count; ++i) {
+      keys.push_back((static_cast<long>(std::rand()) << 31) ^ std::rand());
+    }
+    return keys;
+  }
+
+  template <typename TDictionary, typename THasher>
+  void Run(const char* name, const std::vector<long>& inserted, THasher hash) {
+    TDictionary dict(hash);
+    for (size_t i = 0; i < inserted.size(); ++i) {
+      dict.Insert(inserted[i], i);
+    }
+    dict.RehashMilliseconds(1000);
+    std::vector<long> keys;
+    for (size_t i = 0; i < inserted.size(); ++i) {
+      keys.push_back(inserted[std::rand() % inserted.size()]);
+    }
+    long count = inserted.size();
+    std::printf("%16s %10ld %12.1f\n", name, count, LookupNanoseconds(dict, keys));
+  }
+
+  // Fetch against MultiFetch with batches of 4 to 64 keys.
+  void RunMultiFetch(const std::vector<long>& inserted) {
+    std::hash<long> hash;
+    mredis::Dictionary<long, long> dict(hash);
+    for (size_t i = 0; i < inserted.size(); ++i) {
+      dict.Insert(inserted[i], i);
+    }
+    while (dict.RehashMilliseconds(100) > 0) {}
+    std::vector<long> keys;
+    for (size_t i = 0; i < inserted.size(); ++i) {
+      keys.push_back(inserted[std::rand() % inserted.size()]);
+    }
+    std::printf("%16s %10zu %12.1f\n", "Fetch", keys.size(), LookupNanoseconds(dict, keys));
+    for (size_t batch = 4; batch <= 64; batch *= 4) {
+      std::string name = "MultiFetch/" + std::to_string(batch);
+      std::printf("%16s %10zu %12.1f\n", name.c_str(), keys.size(),
+                  MultiLookupNanoseconds(dict, keys, batch));
+    }
+  }
+
+  const int kHasherRounds = 50;
+
+  // Insert every key, fetch each 4 times and erase it, with string keys
+  // hashed through TDictionary's hasher. Keys fit in the cache, so the
+  // cost of hashing shows up.
+  template <typename TDictionary>
+  void RunHasher(const char* name, const std::vector<std::string>& keys) {
+    TDictionary dict;
+    long sum = 0;
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int round = 0; round < kHasherRounds; ++round) {
+      for (size_t i = 0; i < keys.size(); ++i) {
+        dict.Insert(keys[i], i);
+      }
+      for (int fetch = 0; fetch < 4; ++fetch) {
+        for (size_t i = 0; i < keys.size(); ++i) {
+          sum += *dict.Fetch(keys[(i * 7919) % keys.size()]);
+        }
+      }
+      for (size_t i = 0; i < keys.size(); ++i) {
+        dict.Erase(keys[i]);
+      }
+    }
+    std::chrono::duration<double> diff =
+        std::chrono::high_resolution_clock::now() - start;
+    if (sum == 42) std::printf(" ");
+    double ops = 6.0 * keys.size() * kHasherRounds;
+    std::printf("%16s %10zu %12.0f\n", name, keys.size(), ops / diff.count());
+  }
+
+  // Milliseconds to rehash count keys into a table 8 times larger.
+  void RunRehash(const std::vector<long>& keys, int threads) {
+    std::hash<long> hash;
+    mredis::Dictionary<long, long> dict(hash);
+    for (size_t i = 0; i < keys.size(); ++i) {
+      dict.Insert(keys[i], i);
+    }
+    while (dict.RehashMilliseconds(100) > 0) {}
+    dict.Expand(keys.size() * 8);
+
+    auto start = std::chrono::high_resolution_clock::now();
+    while (dict.RehashParallel(1000, threads) > 0) {}
+    std::chrono::duration<double, std::milli> diff =
+        std::chrono::high_resolution_clock::now() - start;
+    std::printf("%16d %10zu %12.1f\n", threads, keys.size(), diff.count());
+  }
+
+  // Milliseconds to load count keys by Insert, DictBulkLoader::Add and
+  // DictBulkLoader::AddBatch with threads threads.
+  void RunLoad(const std::vector<long>& keys, int threads) {
+    std::hash<long> hash;
+    using TDictionary = mredis::Dictionary<long, long>;
+    std::vector<std::pair<long, long>> items;
+    for (size_t i = 0; i < keys.size(); ++i) items.push_back(std::make_pair(keys[i], i));
+
+    double ms[3];
+    for (int mode = 0; mode < 3; ++mode) {
+      TDictionary dict(hash);
+      std::vector<std::pair<long, long>> batch = items;
+      auto start = std::chrono::high_resolution_clock::now();
+      if (mode == 0) {
+        for (auto& item : batch) dict.Insert(item.first, item.second);
+      }
+      else {
+        mredis::DictBulkLoader<long, long, mredis::ZmallocAllocator,
+                               std::function<size_t(const long&)>> loader(&dict, batch.size());
+        if (mode == 1) {
+          for (auto& item : batch) loader.Add(item.first, item.second);
+        }
+        else {
+          loader.AddBatch(batch.data(), batch.size(), threads);
+        }
+      }
+      std::chrono::duration<double, std::milli> diff =
+          std::chrono::high_resolution_clock::now() - start;
+      ms[mode] = diff.count();
+    }
+    std::printf("%16d %10zu %12.1f %12.1f %12.1f\n", threads, keys.size(), ms[0], ms[1], ms[2]);
+  }
+
+  // Bytes zmalloc holds per key of a Dictionary<String, long> with count
+  // keys of len bytes, entries, buckets and heap buffers included.
+  void RunStringMemory(size_t len, long count) {
+    using TDictionary = mredis::Dictionary<mredis::String, long, mredis::ZmallocAllocator,
+                                           mredis::MurmurHasher>;
+    size_t used = mredis::zmalloc_used_memory();
+    TDictionary dict;
+    for (long i = 0; i < count; ++i) {
+      std::string key = std::to_string(i);
+      key.resize(len, ':');
+      dict.Insert(mredis::String(key.data(), key.size()), i);
+    }
+    while (dict.RehashMilliseconds(100) > 0) {}
+    double bytes = static_cast<double>(mredis::zmalloc_used_memory() - used) / count;
+    std::printf("%16zu %10ld %12.1f\n", len, count, bytes);
+  }
+
+  struct FunctionHasher : std::function<size_t(const std::string&)> {
+    FunctionHasher() : std::function<size_t(const std::string&)>(mredis::MurmurHasher()) {}
+  };
+}
+
+// Usage: dict_bench [max_keys]
+int main(int argc, char **argv) {
+  long max_keys = argc > 1 ? std::atol(argv[1]) : 4000000;
+
+  std::printf("%16s %10s %12s\n", "dict", "keys", "ns/lookup");
+  for (long n = 1000; n <= max_keys; n *= 4) {
+    std::vector<long> keys = RandomKeys(n);
+    std::hash<long> hash;
+    Run<mredis::Dictionary<long, long>>("Dictionary", keys, hash);
+    Run<mredis::FlatDictionary<long, long>>("FlatDictionary", keys, hash);
+    using mredis::IntHasher;
+    Run<mredis::Dictionary<long, long, mredis::ZmallocAllocator, IntHasher>>("Dict/IntHasher", keys, IntHasher());
+    Run<mredis::IntDictionary<long>>("IntDictionary", keys, IntHasher());
+  }
+
+  std::printf("\n%16s %10s %12s\n", "batch", "keys", "ns/key");
+  for (long n = 16000; n <= max_keys; n *= 8) {
+    RunMultiFetch(RandomKeys(n));
+  }
+
+  std::printf("\n%16s %10s %12s\n", "hasher", "keys", "ops/sec");
+  std::vector<std::string> keys;
+  for (int i = 0; i < 10000; ++i) {
+    keys.push_back("user:session:" + std::to_string(std::rand()));
+  }
+  using mredis::Dictionary;
+  using mredis::ZmallocAllocator;
+  RunHasher<Dictionary<std::string, long, ZmallocAllocator, FunctionHasher>>("std::function", keys);
+  RunHasher<Dictionary<std::string, long, ZmallocAllocator, mredis::MurmurHasher>>("MurmurHasher", keys);
+  RunHasher<Dictionary<std::string, long, ZmallocAllocator, mredis::Murmur64Hasher>>("Murmur64Hasher", keys);
+
+  std::printf("\n%16s %10s %12s\n", "String key len", "keys", "bytes/key");
+  for (size_t len : {8, 24, 31, 32, 64, 256}) {
+    RunStringMemory(len, 1000000);
+  }
+
+  std::printf("\n%16s %10s %12s\n", "rehash threads", "keys", "ms");
+  std::vector<long> rehash_keys = RandomKeys(max_keys);
+  for (int threads = 1; threads <= 4; threads *= 2) {
+    RunRehash(rehash_keys, threads);
+  }
+
+  std::printf("\n%16s %10s %12s %12s %12s\n", "load threads", "keys", "Insert ms", "Add ms", "AddBatch ms");
+  for (int threads = 1; threads <= 4; threads *= 2) {
+    RunLoad(rehash_keys, threads);
+  }
+  return 0;
+}
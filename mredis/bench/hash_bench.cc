@@ -0,0 +1,90 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "mredis/src/dict.h"
+#include "mredis/src/hash.h"
+
+namespace {
+  const size_t kTotalBytes = 64 << 20;
+
+  // Share of keys (in 1/100) by length range, roughly what we store:
+  // mostly short "type:id" keys, a few long ones.
+  struct LengthRange {
+    size_t min;
+    size_t max;
+    int percent;
+  };
+  const LengthRange kKeyLengths[] = {
+    {8, 16, 40},
+    {17, 32, 35},
+    {33, 64, 15},
+    {65, 256, 8},
+    {257, 4096, 2},
+  };
+
+  std::vector<std::string> MakeKeys(size_t min, size_t max, size_t count) {
+    std::vector<std::string> keys;
+    for (size_t i = 0; i < count; ++i) {
+      std::string key(min + std::rand() % (max - min + 1), ' ');
+      for (auto& c : key) c = 'a' + std::rand() % 26;
+      keys.push_back(key);
+    }
+    return keys;
+  }
+
+  std::vector<std::string> MakeDistributedKeys(size_t count) {
+    std::vector<std::string> keys;
+    for (const auto& range : kKeyLengths) {
+      std::vector<std::string> part = MakeKeys(range.min, range.max, count * range.percent / 100);
+      keys.insert(keys.end(), part.begin(), part.end());
+    }
+    return keys;
+  }
+
+  template <typename THash>
+  double HashNanoseconds(const std::vector<std::string>& keys, THash hash) {
+    size_t bytes = 0;
+    for (const auto& key : keys) bytes += key.size();
+    size_t rounds = kTotalBytes / bytes + 1;
+    uint64_t sum = 0;
+    auto start = std::chrono::high_resolution_clock::now();
+    for (size_t round = 0; round < rounds; ++round) {
+      for (const auto& key : keys) sum += hash(key);
+    }
+    std::chrono::duration<double, std::nano> diff =
+        std::chrono::high_resolution_clock::now() - start;
+    if (sum == 42) std::printf(" ");
+    return diff.count() / (rounds * keys.size());
+  }
+
+  void Run(const char* name, const std::vector<std::string>& keys) {
+    using namespace mredis;
+    std::printf("%12s %12.1f %12.1f %12.1f %12.1f %12.1f\n", name,
+        HashNanoseconds(keys, [](const std::string& k) {
+          return MurmurHash2(k.data(), k.size()); }),
+        HashNanoseconds(keys, [](const std::string& k) {
+          return MurmurHash64A(k.data(), k.size()); }),
+        HashNanoseconds(keys, [](const std::string& k) {
+          return SipHash(k.data(), k.size(), HashKey()); }),
+        HashNanoseconds(keys, [](const std::string& k) {
+          return SipHash13(k.data(), k.size(), HashKey()); }),
+        HashNanoseconds(keys, [](const std::string& k) {
+          return FastHash(k.data(), k.size(), HashSeed()); }));
+  }
+}
+
+// Usage: hash_bench
+// ns per key of each hash function, by key length.
+int main() {
+  std::printf("%12s %12s %12s %12s %12s %12s\n",
+              "key length", "Murmur2", "Murmur64A", "SipHash24", "SipHash13", "FastHash");
+  Run("mixed", MakeDistributedKeys(10000));
+  size_t lengths[] = {8, 16, 32, 64, 256, 1024, 4096};
+  for (size_t length : lengths) {
+    Run(std::to_string(length).c_str(), MakeKeys(length, length, 1000));
+  }
+  return 0;
+}
@@ -0,0 +1,48 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+#include "mredis/src/zmalloc.h"
+
+namespace {
+  const int kRounds = 200;
+  const int kBatch = 1000;
+
+  // Every thread repeatedly allocates a batch of small objects and frees
+  // them again, which is the pattern of short lived keys and values.
+  void AllocFree() {
+    std::vector<void*> ptrs(kBatch);
+    for (int round = 0; round < kRounds; ++round) {
+      for (int i = 0; i < kBatch; ++i) {
+        ptrs[i] = mredis::zmalloc(24 + (i & 3) * 8);
+      }
+      for (int i = 0; i < kBatch; ++i) {
+        mredis::zfree(ptrs[i]);
+      }
+    }
+  }
+}
+
+// Usage: zmalloc_bench [max_threads]
+int main(int argc, char **argv) {
+  int max_threads = argc > 1 ? std::atoi(argv[1]) : 8;
+  mredis::zmalloc_enable_thread_safeness();
+
+  std::printf("%8s %16s\n", "threads", "alloc+free/sec");
+  for (int n = 1; n <= max_threads; n *= 2) {
+    auto start = std::chrono::high_resolution_clock::now();
+    std::vector<std::thread> threads;
+    for (int i = 0; i < n; ++i) {
+      threads.emplace_back(AllocFree);
+    }
+    for (auto& thread : threads) thread.join();
+    std::chrono::duration<double> diff =
+        std::chrono::high_resolution_clock::now() - start;
+
+    double ops = static_cast<double>(n) * kRounds * kBatch;
+    std::printf("%8d %16.0f\n", n, ops / diff.count());
+  }
+  return 0;
+}
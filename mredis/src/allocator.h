@@ -0,0 +1,39 @@
+#ifndef MREDIS_SRC_ALLOCATOR_H_
+#define MREDIS_SRC_ALLOCATOR_H_
+
+#include <cstddef>
+
+#include "mredis/src/zmalloc.h"
+
+/* Allocator policy of the containers, passed as their last template
+ * parameter. All members are static, so a container pays nothing for it.
+ * An allocator must provide the members of ZmallocAllocator:
+ *
+ *   Allocate/Deallocate       entries and nodes, freed with their size.
+ *   AllocateTable/...Table    zero filled arrays like hash table buckets.
+ *   Size/TableSize            bytes really taken, for MemoryUsage().
+ *   DefragHint/...NoCache     active defrag, see zmalloc_defrag_hint().
+ *   Defrag                    move a plain block, nullptr if not moved.
+ *
+ * The default one counts every byte in zmalloc_used_memory(), which is
+ * what maxmemory relies on.
+ */
+namespace mredis {
+
+struct ZmallocAllocator {
+  static void* Allocate(size_t size) { return zmalloc(size); }
+  static void Deallocate(void* ptr, size_t size) { zfree(ptr, size); }
+  static void* AllocateTable(size_t size) { return zcalloc_huge(size); }
+  static void DeallocateTable(void* ptr, size_t size) { zfree_huge(ptr, size); }
+  static size_t Size(void* ptr) { return zmalloc_size(ptr); }
+  static size_t TableSize(void* ptr, size_t size) { return zmalloc_huge_size(ptr, size); }
+
+  static bool DefragHint(void* ptr) { return zmalloc_defrag_hint(ptr); }
+  static void* AllocateNoCache(size_t size) { return zmalloc_no_tcache(size); }
+  static void DeallocateNoCache(void* ptr) { zfree_no_tcache(ptr); }
+  static void* Defrag(void* ptr) { return zmalloc_defrag(ptr); }
+};
+
+}
+
+#endif
@@ -0,0 +1,225 @@
+#ifndef MREDIS_SRC_CONCURRENT_DICT_H_
+#define MREDIS_SRC_CONCURRENT_DICT_H_
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <pthread.h>
+
+#include "mredis/src/dict.h"
+#include "mredis/src/zmalloc.h"
+
+/* A Dictionary usable from many threads at once.
+ *
+ * Dictionary itself has no synchronization, even Fetch does a rehash step.
+ * Here the keyspace is split into shards by hash, each one a Dictionary
+ * behind its own reader-writer lock: readers of a shard go through
+ * Dictionary::Peek, which doesn't rehash, under the shared lock, writers
+ * take the exclusive one and do the incremental rehash of their shard as
+ * usual. Threads touching different shards never wait for each other.
+ *
+ * Values are copied out under the lock, pointers into a shard would be
+ * dangling as soon as another thread erases the key.
+ */
+namespace {
+  const int kConcurrentDictShards = 16;
+}
+
+namespace mredis {
+
+// std::shared_mutex is C++17, this is the same over pthreads. lock() and
+// unlock() make it usable with std::lock_guard.
+class RWLock {
+ public:
+  RWLock() {
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+    // glibc prefers readers by default, a steady stream of them would
+    // starve writers.
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+    pthread_rwlock_init(&lock_, &attr);
+    pthread_rwlockattr_destroy(&attr);
+  }
+  ~RWLock() { pthread_rwlock_destroy(&lock_); }
+  RWLock(const RWLock&) = delete;
+  RWLock& operator=(const RWLock&) = delete;
+
+  inline void lock() { pthread_rwlock_wrlock(&lock_); }
+  inline void unlock() { pthread_rwlock_unlock(&lock_); }
+  inline void lock_shared() { pthread_rwlock_rdlock(&lock_); }
+  inline void unlock_shared() { pthread_rwlock_unlock(&lock_); }
+
+ private:
+  pthread_rwlock_t lock_;
+};
+
+class ReadGuard {
+ public:
+  explicit ReadGuard(RWLock& lock) : lock_(lock) { lock_.lock_shared(); }
+  ~ReadGuard() { lock_.unlock_shared(); }
+  ReadGuard(const ReadGuard&) = delete;
+  ReadGuard& operator=(const ReadGuard&) = delete;
+
+ private:
+  RWLock& lock_;
+};
+
+/* shards is rounded up to a power of 2. The hash of a key is computed
+ * twice, once to pick the shard and once by its Dictionary.
+ */
+template<typename TKey, typename TValue, typename TAllocator = ZmallocAllocator,
+         typename THasher = std::function<size_t(const TKey&)>>
+class ConcurrentDictionary {
+ public:
+  using TDictionary = Dictionary<TKey, TValue, TAllocator, THasher>;
+
+  template<typename H = THasher, typename = EnableIfDefaultHasher<H>>
+  ConcurrentDictionary() : ConcurrentDictionary(THasher()) {}
+  ConcurrentDictionary(THasher hash_func, int shards = kConcurrentDictShards);
+  inline size_t Shards() const { return shard_mask_ + 1; }
+  size_t Size() const;
+  bool Insert(const TKey& key, TValue value);
+  bool Erase(const TKey& key);
+  bool Fetch(const TKey& key, TValue* value) const;
+  bool Update(const TKey& key, const std::function<void(TValue&)>& update);
+  void SetResizePolicy(const DictResizePolicy& policy);
+  size_t RehashMilliseconds(int ms);
+  size_t Scan(size_t cursor, std::function<void(const TKey&, TValue&)> callback);
+
+ private:
+  struct Shard {
+    // The hasher is set by the constructor of ConcurrentDictionary.
+    Shard() : dict(THasher()) {}
+    mutable RWLock lock;
+    TDictionary dict;
+    // Keep the lock of the next shard off the cache line of this one.
+    char padding[64];
+  };
+
+  inline Shard& ShardOf(const TKey& key) const {
+    // Dictionary takes the bucket from the low bits of the hash, picking
+    // the shard by them too would leave most buckets of a shard unused.
+    uint64_t mixed = FibonacciMix(hash_func_(key));
+    return shards_[static_cast<size_t>(mixed >> 32) & shard_mask_];
+  }
+
+  THasher hash_func_;
+  size_t shard_mask_;
+  size_t shard_bits_;
+  std::unique_ptr<Shard[]> shards_;
+};
+
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+ConcurrentDictionary<TKey, TValue, TAllocator, THasher>::ConcurrentDictionary(THasher hash_func, int shards)
+    : hash_func_(hash_func), shard_bits_(0) {
+  while ((1 << shard_bits_) < shards) shard_bits_++;
+  shard_mask_ = (static_cast<size_t>(1) << shard_bits_) - 1;
+  shards_.reset(new Shard[shard_mask_ + 1]);
+  for (size_t i = 0; i <= shard_mask_; ++i) {
+    shards_[i].dict = TDictionary(hash_func);
+  }
+  // Shards allocate on whatever thread writes to them.
+  zmalloc_enable_thread_safeness();
+}
+
+// Sum of the shard sizes, exact only if no thread is writing.
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+size_t ConcurrentDictionary<TKey, TValue, TAllocator, THasher>::Size() const {
+  size_t size = 0;
+  for (size_t i = 0; i <= shard_mask_; ++i) {
+    ReadGuard guard(shards_[i].lock);
+    size += shards_[i].dict.Size();
+  }
+  return size;
+}
+
+// Return false if key already exists.
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+bool ConcurrentDictionary<TKey, TValue, TAllocator, THasher>::Insert(const TKey& key, TValue value) {
+  Shard& shard = ShardOf(key);
+  std::lock_guard<RWLock> guard(shard.lock);
+  return shard.dict.Insert(key, std::move(value));
+}
+
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+bool ConcurrentDictionary<TKey, TValue, TAllocator, THasher>::Erase(const TKey& key) {
+  Shard& shard = ShardOf(key);
+  std::lock_guard<RWLock> guard(shard.lock);
+  return shard.dict.Erase(key);
+}
+
+// Copy the value of key to value. Return false if key is not found.
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+bool ConcurrentDictionary<TKey, TValue, TAllocator, THasher>::Fetch(const TKey& key, TValue* value) const {
+  Shard& shard = ShardOf(key);
+  ReadGuard guard(shard.lock);
+  const TValue* found = shard.dict.Peek(key);
+  if (found == nullptr) return false;
+  *value = *found;
+  return true;
+}
+
+/* Call update on the value of key under the lock of its shard, for read
+ * modify write like INCR. update must not use this dictionary.
+ * Return false if key is not found.
+ */
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+bool ConcurrentDictionary<TKey, TValue, TAllocator, THasher>::Update(const TKey& key, const std::function<void(TValue&)>& update) {
+  Shard& shard = ShardOf(key);
+  std::lock_guard<RWLock> guard(shard.lock);
+  TValue* value = shard.dict.Fetch(key);
+  if (value == nullptr) return false;
+  update(*value);
+  return true;
+}
+
+// Set the resize policy of every shard.
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+void ConcurrentDictionary<TKey, TValue, TAllocator, THasher>::SetResizePolicy(const DictResizePolicy& policy) {
+  for (size_t i = 0; i <= shard_mask_; ++i) {
+    std::lock_guard<RWLock> guard(shards_[i].lock);
+    shards_[i].dict.SetResizePolicy(policy);
+  }
+}
+
+/* Rehash every shard for about ms milliseconds, like serverCron does for
+ * each database. A shard is locked only while it's rehashed, so no writer
+ * waits more than ms. Return the rounds done.
+ */
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+size_t ConcurrentDictionary<TKey, TValue, TAllocator, THasher>::RehashMilliseconds(int ms) {
+  size_t rounds = 0;
+  for (size_t i = 0; i <= shard_mask_; ++i) {
+    std::lock_guard<RWLock> guard(shards_[i].lock);
+    rounds += shards_[i].dict.RehashMilliseconds(ms);
+  }
+  return rounds;
+}
+
+/* Scan the shards one after another with Dictionary::Scan. The shard is
+ * kept in the low bits of the cursor and the cursor of its Dictionary in
+ * the rest, so the guarantees of Dictionary::Scan hold across calls even
+ * if shards resize in between. callback runs under the lock of the shard
+ * and must not use this dictionary.
+ */
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+size_t ConcurrentDictionary<TKey, TValue, TAllocator, THasher>::Scan(size_t cursor, std::function<void(const TKey&, TValue&)> callback) {
+  size_t index = cursor & shard_mask_;
+  Shard& shard = shards_[index];
+  size_t next;
+  {
+    // Dictionary::Scan blocks rehash by the iterator count, which is not
+    // atomic, so readers are kept out too.
+    std::lock_guard<RWLock> guard(shard.lock);
+    next = shard.dict.Scan(cursor >> shard_bits_, callback);
+  }
+  if (next != 0) return (next << shard_bits_) | index;
+  return index == shard_mask_ ? 0 : index + 1;
+}
+
+}
+
+#endif
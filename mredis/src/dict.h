@@ -12,16 +12,51 @@
 #include <vector>
 #include <utility>
 #include <limits>
+#include <new>
+
+#include "mredis/src/allocator.h"
+#include "mredis/src/hash.h"
+#include "mredis/src/object_traits.h"
+#include "mredis/src/parallel.h"
 
 namespace {
   const size_t kTableInitSize = 4;
   const size_t kLongMax = std::numeric_limits<long>::max();
-  const size_t kCanResizeRatio = 1;
-  const size_t kForceResizeRatio = 5;
-  bool can_resize = true;
-  uint32_t hash_seed = 5381;
+  // Defaults of DictResizePolicy.
+  const double kCanResizeRatio = 1.0;
+  const double kForceResizeRatio = 5.0;
+  const size_t kGrowthFactor = 2;
+  const size_t kMinFillPercent = 10;
+  // Buckets split among the threads in one round of parallel rehash.
+  const size_t kParallelRehashBuckets = 1 << 16;
+  // Keys whose cache misses overlap in one round of MultiFetch.
+  const size_t kMultiFetchBatch = 16;
+  // Fewer items than this are bulk loaded on the calling thread only.
+  const size_t kBulkLoadParallelItems = 1 << 14;
+  // Chain length FetchRandom samples every key of exactly uniformly.
+  const size_t kFetchRandomChain = 4;
+  // Random buckets MemoryUsage draws per sample before it gives up.
+  const size_t kMemoryUsageDraws = 10;
+
+  // Reverse the bits of v, used by Dictionary::Scan.
+  inline size_t ReverseBits(size_t v) {
+    size_t s = sizeof(v) * 8;
+    size_t mask = ~static_cast<size_t>(0);
+    while ((s >>= 1) > 0) {
+      mask ^= mask << s;
+      v = ((v >> s) & mask) | ((v << s) & ~mask);
+    }
+    return v;
+  }
 
-  size_t NextPower(size_t size) {
+  // Random index in [0, n). std::rand alone has 31 bits, too few for big
+  // tables.
+  inline size_t RandomIndex(size_t n) {
+    uint64_t r = (static_cast<uint64_t>(std::rand()) << 31) ^ std::rand();
+    return static_cast<size_t>(r % n);
+  }
+
+  inline size_t NextPower(size_t size) {
     if (size >= kLongMax) return kLongMax;
 
     size_t power = kTableInitSize;
@@ -34,24 +69,93 @@ namespace {
 
 namespace mredis {
 
-template<typename TKey, typename TValue>
+// Settings shared by all dictionaries. Kept in function local statics so
+// every translation unit including this header sees the same ones.
+inline uint32_t& DictHashSeed() {
+  static uint32_t hash_seed = 5381;
+  return hash_seed;
+}
+
+/* When a dictionary grows and shrinks, set per dictionary. The table
+ * grows to used * growth_factor buckets once used / size reaches
+ * max_load, and shrinks to fit used once it's below min_fill_percent
+ * percent full. While can_resize is false, e.g. when a forked child shares
+ * the pages of the table, it grows only at force_ratio and never shrinks.
+ * The load factors are fractional, e.g. 0.5 keeps most chains at one
+ * entry for more memory, and must be above 0.
+ */
+struct DictResizePolicy {
+  DictResizePolicy()
+      : max_load(kCanResizeRatio), force_ratio(kForceResizeRatio),
+        growth_factor(kGrowthFactor), min_fill_percent(kMinFillPercent),
+        can_resize(true) {}
+  double max_load;
+  double force_ratio;
+  size_t growth_factor;
+  // 0 never shrinks by itself.
+  size_t min_fill_percent;
+  bool can_resize;
+
+  inline bool NeedGrow(size_t used, size_t size) const {
+    double ratio = static_cast<double>(used) / size;
+    return ratio >= max_load && (can_resize || ratio >= force_ratio);
+  }
+  // The fewest buckets which keep used keys under max_load.
+  inline size_t FitSize(size_t used) const {
+    return static_cast<size_t>(used / max_load) + 1;
+  }
+  // Buckets to grow to, at least enough to bring the load under max_load
+  // when growth_factor alone would not.
+  inline size_t GrowSize(size_t used) const {
+    size_t size = used * growth_factor;
+    size_t fit = FitSize(used);
+    return size > fit ? size : fit;
+  }
+  // Buckets to shrink to, so the next insert doesn't grow the table back.
+  inline size_t ShrinkSize(size_t used) const {
+    size_t size = FitSize(used);
+    return size < kTableInitSize ? kTableInitSize : size;
+  }
+  inline bool NeedShrink(size_t used, size_t size) const {
+    return can_resize && size > kTableInitSize && used * 100 < size * min_fill_percent;
+  }
+};
+
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
 class DIterator;
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+class DictBulkLoader;
 
 /* TKey must support the hash function which passed in.
  * TValue must have default constructor and copy assignment operator.
+ * Entries and bucket arrays are allocated by TAllocator, see allocator.h.
+ * THasher is called as hash_func(key) and returns size_t. The default
+ * std::function takes any hash function but costs an indirect call per
+ * hash, pass a hash policy like MurmurHasher below to get it inlined.
  */
-template<typename TKey, typename TValue>
+template<typename TKey, typename TValue, typename TAllocator = ZmallocAllocator,
+         typename THasher = std::function<size_t(const TKey&)>>
 class Dictionary {
  private:
-  friend class DIterator<TKey, TValue>;
+  friend class DIterator<TKey, TValue, TAllocator, THasher>;
+  friend class DictBulkLoader<TKey, TValue, TAllocator, THasher>;
   struct DictEntry {
    public:
     TKey key;
     TValue value;
    private:
-    friend class Dictionary<TKey, TValue>;
-    friend class DIterator<TKey, TValue>;
+    // Key and value are constructed in place from what the caller passed.
+    template<typename K, typename... Args>
+    explicit DictEntry(K&& k, Args&&... args)
+        : key(std::forward<K>(k)), value(std::forward<Args>(args)...) {}
+
+    friend class Dictionary<TKey, TValue, TAllocator, THasher>;
+    friend class DIterator<TKey, TValue, TAllocator, THasher>;
+    friend class DictBulkLoader<TKey, TValue, TAllocator, THasher>;
     DictEntry* next;
+    // hash_func_(key), so lookups skip entries of other hashes without
+    // comparing keys and rehash never calls hash_func_ again.
+    size_t hash;
   };
   
   struct DictTable {
@@ -72,29 +176,55 @@ class Dictionary {
   DictTable dict_[2];
   long rehashidx_;
   int iterator_count_;
+  DictResizePolicy policy_;
 
-  std::function<size_t(const TKey& key)> hash_func_;
+  THasher hash_func_;
 
  public:
-  using Iterator = DIterator<TKey, TValue>;
-  Dictionary(std::function<size_t(const TKey&)> hash_func) 
+  using Iterator = DIterator<TKey, TValue, TAllocator, THasher>;
+  template<typename H = THasher, typename = EnableIfDefaultHasher<H>>
+  Dictionary() : Dictionary(THasher()) {}
+  Dictionary(THasher hash_func)
       : rehashidx_(-1), iterator_count_(0), hash_func_(hash_func) {
     dict_[0].Reset();
     dict_[1].Reset();
   }
+  Dictionary(Dictionary&& other);
+  Dictionary& operator=(Dictionary&& rhs);
   ~Dictionary();
-  inline size_t Size() { return dict_[0].used + dict_[1].used; }
+  inline size_t Size() const { return dict_[0].used + dict_[1].used; }
   inline size_t Capacity() { return IsRehashing() ? dict_[1].size : dict_[0].size; }
+  inline const DictResizePolicy& ResizePolicy() const { return policy_; }
+  inline void SetResizePolicy(const DictResizePolicy& policy) { policy_ = policy; }
+  inline void EnableResize() { policy_.can_resize = true; }
+  inline void DisableResize() { policy_.can_resize = false; }
   bool Expand(size_t size);
   bool Shrink();
   bool Insert(const TKey& key, TValue value);
+  bool Insert(TKey&& key, TValue value);
+  template<typename... Args>
+  std::pair<TValue*, bool> TryEmplace(const TKey& key, Args&&... args);
+  template<typename... Args>
+  std::pair<TValue*, bool> TryEmplace(TKey&& key, Args&&... args);
+  template<typename V>
+  bool InsertOrAssign(const TKey& key, V&& value);
+  template<typename V>
+  bool InsertOrAssign(TKey&& key, V&& value);
   bool Replace(const TKey& key, TValue value);
   bool Erase(const TKey& key);
+  DictEntry* Unlink(const TKey& key);
+  void FreeUnlinkedEntry(DictEntry* entry);
   TValue* Fetch(const TKey& key);
+  const TValue* Peek(const TKey& key) const;
+  void MultiFetch(const TKey* keys, size_t count, TValue** values);
   TKey* FetchRandom();
   std::vector<std::pair<TKey*, TValue*>> FetchSome(int count);
   void Clear();
   size_t RehashMilliseconds(int ms);
+  size_t RehashParallel(int ms, int threads);
+  size_t Defrag(size_t cursor, int ms);
+  size_t Scan(size_t cursor, std::function<void(const TKey&, TValue&)> callback);
+  size_t MemoryUsage(size_t samples = 5) const;
   Iterator SafeBegin();
   Iterator SafeEnd();
   Iterator Begin();
@@ -104,19 +234,41 @@ class Dictionary {
  private:
   void Clear(DictTable& dict);
   bool ExpandIfNeed();
-  DictEntry* InsertRaw(const TKey& key);
+  bool ShrinkIfNeed();
+  template<typename K, typename... Args>
+  std::pair<DictEntry*, bool> EmplaceRaw(K&& key, Args&&... args);
   DictEntry* ReplaceRaw(const TKey& key);
-  inline bool IsRehashing() { return rehashidx_ != -1; }
+  inline bool IsRehashing() const { return rehashidx_ != -1; }
   void RehashStep();
   int RehashNStep(int n);
-  int KeyIndex(const TKey& key);
+  size_t RehashBucket(size_t index);
+  void FinishRehash();
+  int KeyIndex(const TKey& key, size_t hash, DictEntry** existing = nullptr);
   DictEntry* Find(const TKey& key);
+  void DefragBucket(DictEntry** link);
+  void ScanBucket(DictEntry* entry, const std::function<void(const TKey&, TValue&)>& callback);
+
+  template<typename K, typename... Args>
+  inline DictEntry* NewEntry(K&& key, Args&&... args) {
+    return new (TAllocator::Allocate(sizeof(DictEntry)))
+        DictEntry(std::forward<K>(key), std::forward<Args>(args)...);
+  }
+  inline void FreeEntry(DictEntry* entry) {
+    entry->~DictEntry();
+    TAllocator::Deallocate(entry, sizeof(DictEntry));
+  }
+  inline DictEntry** NewTable(size_t size) {
+    return static_cast<DictEntry**>(TAllocator::AllocateTable(size * sizeof(DictEntry*)));
+  }
+  inline void FreeTable(DictTable& dict) {
+    TAllocator::DeallocateTable(dict.table, dict.size * sizeof(DictEntry*));
+  }
 };
 
-template <typename TKey, typename TValue>
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
 class DIterator {
  private:
-  using TDictionary = Dictionary<TKey, TValue>;
+  using TDictionary = Dictionary<TKey, TValue, TAllocator, THasher>;
   TDictionary* dictionary_;
   int dict_index_;
   int64_t index_;
@@ -182,11 +334,11 @@ class DIterator {
     return temp;
   }
 
-  bool operator==(const DIterator<TKey, TValue>& rhs) const {
+  bool operator==(const DIterator<TKey, TValue, TAllocator, THasher>& rhs) const {
     return dictionary_ == rhs.dictionary_ && entry_ == rhs.entry_;
   }
 
-  bool operator!=(const DIterator<TKey, TValue>& rhs) const {
+  bool operator!=(const DIterator<TKey, TValue, TAllocator, THasher>& rhs) const {
     return !((*this) == rhs);
   }
 
@@ -200,31 +352,152 @@ class DIterator {
   
 };
 
-template<typename TKey, typename TValue>
-Dictionary<TKey, TValue>::~Dictionary() {
+/* Fill a dictionary with many keys at once, like when a snapshot is loaded.
+ * The table is sized once for expected more keys when the loader is
+ * created, and keys are then linked straight into their buckets: no
+ * duplicate check, no ExpandIfNeed and no rehash step. The caller
+ * guarantees keys are unique and not in the dictionary yet.
+ * Loading more than expected is allowed but not checked: the table isn't
+ * grown while loading, so chains get longer, e.g. twice expected keys
+ * doubles the average chain and slows lookups till the next Insert grows
+ * the dictionary as usual.
+ */
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+class DictBulkLoader {
+ private:
+  using TDictionary = Dictionary<TKey, TValue, TAllocator, THasher>;
+  using DictEntry = typename TDictionary::DictEntry;
+  using DictTable = typename TDictionary::DictTable;
+  TDictionary* dictionary_;
+
+  // Keys go to the table new keys go to, even if someone started a rehash.
+  DictTable& Target() {
+    return dictionary_->IsRehashing() ? dictionary_->dict_[1] : dictionary_->dict_[0];
+  }
+
+  void Link(DictTable& dict, DictEntry* entry) {
+    DictEntry*& bucket = dict.table[entry->hash & dict.sizemask];
+    entry->next = bucket;
+    bucket = entry;
+  }
+
+ public:
+  /* A rehash in progress is finished first, then the table is expanded
+   * to hold expected more keys and rehashed right away, so no rehash is
+   * left for the load. There must be no safe iterator on dictionary.
+   */
+  DictBulkLoader(TDictionary* dictionary, size_t expected) : dictionary_(dictionary) {
+    while (dictionary_->RehashNStep(100)) {}
+    size_t size = dictionary_->Size() + expected;
+    // A new dictionary has no table yet, keys need one even if none is
+    // expected.
+    if (size < kTableInitSize) size = kTableInitSize;
+    if (size > dictionary_->Capacity() && dictionary_->Expand(size)) {
+      while (dictionary_->RehashNStep(100)) {}
+    }
+  }
+
+  void Add(TKey key, TValue value) {
+    size_t hash = dictionary_->hash_func_(key);
+    DictEntry* entry = dictionary_->NewEntry(std::move(key), std::move(value));
+    entry->hash = hash;
+    DictTable& dict = Target();
+    Link(dict, entry);
+    dict.used++;
+  }
+
+  /* Add count items, which are moved from, using threads threads. Keys
+   * are hashed and their entries allocated by slices of items at the same
+   * time, then every thread links the entries of its own range of
+   * buckets, so no bucket is written by two threads.
+   */
+  void AddBatch(std::pair<TKey, TValue>* items, size_t count, int threads) {
+    if (threads <= 1 || count < kBulkLoadParallelItems) {
+      for (size_t i = 0; i < count; ++i) {
+        Add(std::move(items[i].first), std::move(items[i].second));
+      }
+      return;
+    }
+
+    // Entries are allocated on the worker threads.
+    zmalloc_enable_thread_safeness();
+    DictTable& dict = Target();
+    size_t parts = threads;
+    std::vector<std::vector<DictEntry*>> slices(parts * parts);
+    size_t range = (count + parts - 1) / parts;
+    ParallelRun(threads, [this, items, count, parts, range, &dict, &slices](int task) {
+      size_t from = task * range;
+      size_t to = from + range < count ? from + range : count;
+      for (size_t i = from; i < to; ++i) {
+        size_t hash = dictionary_->hash_func_(items[i].first);
+        DictEntry* entry = dictionary_->NewEntry(std::move(items[i].first),
+                                                 std::move(items[i].second));
+        entry->hash = hash;
+        size_t part = (hash & dict.sizemask) * parts / dict.size;
+        slices[task * parts + part].push_back(entry);
+      }
+    });
+    ParallelRun(threads, [this, parts, &dict, &slices](int part) {
+      for (size_t task = 0; task < parts; ++task) {
+        for (DictEntry* entry : slices[task * parts + part]) Link(dict, entry);
+      }
+    });
+    dict.used += count;
+  }
+};
+
+// The tables are stolen, other is left empty but still usable.
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+Dictionary<TKey, TValue, TAllocator, THasher>::Dictionary(Dictionary&& other)
+    : rehashidx_(other.rehashidx_), iterator_count_(0),
+      policy_(other.policy_), hash_func_(other.hash_func_) {
+  dict_[0] = other.dict_[0];
+  dict_[1] = other.dict_[1];
+  other.dict_[0].Reset();
+  other.dict_[1].Reset();
+  other.rehashidx_ = -1;
+}
+
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+Dictionary<TKey, TValue, TAllocator, THasher>& Dictionary<TKey, TValue, TAllocator, THasher>::operator=(Dictionary&& rhs) {
+  if (this == &rhs) return *this;
+  Clear();
+  dict_[0] = rhs.dict_[0];
+  dict_[1] = rhs.dict_[1];
+  rehashidx_ = rhs.rehashidx_;
+  policy_ = rhs.policy_;
+  hash_func_ = rhs.hash_func_;
+  rhs.dict_[0].Reset();
+  rhs.dict_[1].Reset();
+  rhs.rehashidx_ = -1;
+  return *this;
+}
+
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+Dictionary<TKey, TValue, TAllocator, THasher>::~Dictionary() {
   Clear(dict_[0]);
   Clear(dict_[1]);
 }
 
-template<typename TKey, typename TValue>
-void Dictionary<TKey, TValue>::Clear(DictTable& dict)  {
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+void Dictionary<TKey, TValue, TAllocator, THasher>::Clear(DictTable& dict)  {
   for (size_t i = 0; i < dict.size && dict.used > 0; ++i) {
     DictEntry* entry = dict.table[i];
     while (entry) {
       DictEntry* next = entry->next;
-      delete entry;
+      FreeEntry(entry);
       dict.used--;
       entry = next;
     }
   }
-  delete[] dict.table;
+  FreeTable(dict);
   dict.Reset();
 }
 
 // Expand the hash table to given size.
 // Return true if expand success, false if nothing happen.
-template<typename TKey, typename TValue>
-bool Dictionary<TKey, TValue>::Expand(size_t size) {
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+bool Dictionary<TKey, TValue, TAllocator, THasher>::Expand(size_t size) {
   if (IsRehashing() || dict_[0].used > size) return false;
 
   size_t realsize = NextPower(size);
@@ -234,9 +507,7 @@ bool Dictionary<TKey, TValue>::Expand(size_t size) {
   dict.size = realsize;
   dict.sizemask = realsize - 1;
   dict.used = 0;
-  // Must add (), else the DictEntry* is not set to nullptr.
-  // See: https://www.cnblogs.com/haoyijing/p/5815035.html
-  dict.table = new DictEntry*[realsize]();
+  dict.table = NewTable(realsize);
   
   // No need to rehash if dict_[0] is empty.
   if (dict_[0].table == nullptr) {
@@ -250,82 +521,129 @@ bool Dictionary<TKey, TValue>::Expand(size_t size) {
   return true;
 }
 
-template<typename TKey, typename TValue>
-bool Dictionary<TKey, TValue>::ExpandIfNeed() {
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+bool Dictionary<TKey, TValue, TAllocator, THasher>::ExpandIfNeed() {
   if (IsRehashing()) return true;
   
   // If table is empty, expand to init size.
   if (dict_[0].size == 0) return Expand(kTableInitSize);
   
-  // Expand to 2*used size.
-  size_t ratio = dict_[0].used / dict_[0].size;
-  if (ratio >= kCanResizeRatio && 
-      (can_resize || ratio >= kForceResizeRatio)) {
-    return Expand(dict_[0].used * 2);
+  if (policy_.NeedGrow(dict_[0].used, dict_[0].size)) {
+    return Expand(policy_.GrowSize(dict_[0].used));
   }
   return true;
 }
 
+// Called after a key is erased, so a table which was once large gives
+// its buckets back.
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+bool Dictionary<TKey, TValue, TAllocator, THasher>::ShrinkIfNeed() {
+  if (IsRehashing() || !policy_.NeedShrink(dict_[0].used, dict_[0].size)) return false;
+  return Shrink();
+}
+
 /*
  * Return true if Shrink success, false if nothing happened.
  */
-template<typename TKey, typename TValue>
-bool Dictionary<TKey, TValue>::Shrink() {
-  if (IsRehashing() || can_resize) return false;
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+bool Dictionary<TKey, TValue, TAllocator, THasher>::Shrink() {
+  if (IsRehashing() || !policy_.can_resize) return false;
 
-  size_t size = dict_[0].used;
-  if (size < kTableInitSize) size = kTableInitSize;
-  return Expand(size);
+  return Expand(policy_.ShrinkSize(dict_[0].used));
 }
 
 /* Return true if successfully add key, value to dictionary.
  * Return false if key already exists.
  */
-template<typename TKey, typename TValue>
-bool Dictionary<TKey, TValue>::Insert(const TKey& key, TValue value) {
-  DictEntry* entry = InsertRaw(key);
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+bool Dictionary<TKey, TValue, TAllocator, THasher>::Insert(const TKey& key, TValue value) {
+  return EmplaceRaw(key, std::move(value)).second;
+}
 
-  if (!entry) return false;
-  entry->value = value;
-  return true;
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+bool Dictionary<TKey, TValue, TAllocator, THasher>::Insert(TKey&& key, TValue value) {
+  return EmplaceRaw(std::move(key), std::move(value)).second;
 }
 
-/* Return a DictEntry of given key.
- * Return nullptr if key already exists.
+/* Construct the value from args in place if key doesn't exist, nothing is
+ * constructed or moved from if it does.
+ * Return the value of key and true if it's inserted.
  */
-template<typename TKey, typename TValue>
-typename Dictionary<TKey, TValue>::DictEntry* Dictionary<TKey, TValue>::InsertRaw(const TKey& key) {
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+template<typename... Args>
+std::pair<TValue*, bool> Dictionary<TKey, TValue, TAllocator, THasher>::TryEmplace(const TKey& key, Args&&... args) {
+  auto result = EmplaceRaw(key, std::forward<Args>(args)...);
+  return std::make_pair(&result.first->value, result.second);
+}
+
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+template<typename... Args>
+std::pair<TValue*, bool> Dictionary<TKey, TValue, TAllocator, THasher>::TryEmplace(TKey&& key, Args&&... args) {
+  auto result = EmplaceRaw(std::move(key), std::forward<Args>(args)...);
+  return std::make_pair(&result.first->value, result.second);
+}
+
+/* Insert key or assign value to the value it has, with one lookup.
+ * Return true if we add a new entry.
+ */
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+template<typename V>
+bool Dictionary<TKey, TValue, TAllocator, THasher>::InsertOrAssign(const TKey& key, V&& value) {
+  auto result = EmplaceRaw(key, std::forward<V>(value));
+  if (!result.second) result.first->value = std::forward<V>(value);
+  return result.second;
+}
+
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+template<typename V>
+bool Dictionary<TKey, TValue, TAllocator, THasher>::InsertOrAssign(TKey&& key, V&& value) {
+  auto result = EmplaceRaw(std::move(key), std::forward<V>(value));
+  if (!result.second) result.first->value = std::forward<V>(value);
+  return result.second;
+}
+
+/* Add a DictEntry of key constructed from key and args, which are only
+ * used if key doesn't exist yet.
+ * Return the entry of key and true if it's added, the existing entry and
+ * false if key already exists.
+ */
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+template<typename K, typename... Args>
+std::pair<typename Dictionary<TKey, TValue, TAllocator, THasher>::DictEntry*, bool> Dictionary<TKey, TValue, TAllocator, THasher>::EmplaceRaw(K&& key, Args&&... args) {
   // Do one increment rehash step.
   if (IsRehashing()) RehashStep();
   
-  int index = KeyIndex(key);
-  if (index == -1) return nullptr;
+  size_t hash = hash_func_(key);
+  DictEntry* existing = nullptr;
+  int index = KeyIndex(key, hash, &existing);
+  if (index == -1) return std::make_pair(existing, false);
   
   // Allocate and add a new DictEntry to table.
   DictTable* dict = IsRehashing() ? &dict_[1] : &dict_[0];
-  DictEntry* entry = new DictEntry;
+  DictEntry* entry = NewEntry(std::forward<K>(key), std::forward<Args>(args)...);
+  entry->hash = hash;
   entry->next = dict->table[index];
   dict->table[index] = entry;
   dict->used++;
-  
-  entry->key = key;
-  return entry;
+  return std::make_pair(entry, true);
 }
 
 /* Return the bucket index of the key.
- * Return -1 if key already exists.
+ * Return -1 if key already exists, and set existing to its entry.
  */
-template<typename TKey, typename TValue>
-int Dictionary<TKey, TValue>::KeyIndex(const TKey& key) {
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+int Dictionary<TKey, TValue, TAllocator, THasher>::KeyIndex(const TKey& key, size_t hash, DictEntry** existing) {
   ExpandIfNeed();
   
-  size_t hash = hash_func_(key);
   size_t index;
   for (int i = 0; i <= 1; ++i) {
     index = hash & dict_[i].sizemask;
     DictEntry* entry = dict_[i].table[index];
     while (entry != nullptr) {
-      if (entry->key == key) return -1;
+      if (entry->hash == hash && entry->key == key) {
+        if (existing != nullptr) *existing = entry;
+        return -1;
+      }
       entry = entry->next;
     }
     if (!IsRehashing()) break;
@@ -333,8 +651,8 @@ int Dictionary<TKey, TValue>::KeyIndex(const TKey& key) {
   return static_cast<int>(index);
 }
 
-template<typename TKey, typename TValue>
-void Dictionary<TKey, TValue>::RehashStep() {
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+void Dictionary<TKey, TValue, TAllocator, THasher>::RehashStep() {
   // Make sure no iterator is iterating the dictionary.
   if (iterator_count_ == 0) {
     RehashNStep(1);
@@ -343,8 +661,8 @@ void Dictionary<TKey, TValue>::RehashStep() {
 
 // Return 1 if rehash is still in progress.
 // Return 0 if rehash is done.
-template<typename TKey, typename TValue>
-int Dictionary<TKey, TValue>::RehashNStep(int n) {
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+int Dictionary<TKey, TValue, TAllocator, THasher>::RehashNStep(int n) {
   if (!IsRehashing()) return 0;
   
   // RehashNStep stop after visist empty_vists empty buckets.
@@ -356,57 +674,64 @@ int Dictionary<TKey, TValue>::RehashNStep(int n) {
       if (--empty_vists == 0) return 1;
     }
     
-    // Rehash one bucket.
-    DictEntry* entry = dict_[0].table[rehashidx_];
-    while (entry) {
-      DictEntry* next = entry->next;
-      size_t index = hash_func_(entry->key) & dict_[1].sizemask;
-      entry->next = dict_[1].table[index];
-      dict_[1].table[index] = entry;
-      dict_[0].used--;
-      dict_[1].used++;
-      entry = next; 
-    }
-    dict_[0].table[rehashidx_++] = nullptr;
+    size_t moved = RehashBucket(rehashidx_++);
+    dict_[0].used -= moved;
+    dict_[1].used += moved;
   }
   
   // Check if we rehashed all buckets.
   if (dict_[0].used == 0) {
-    delete[] dict_[0].table;
-    dict_[0] = dict_[1];
-    dict_[1].Reset();
-    rehashidx_ = -1;
+    FinishRehash();
     return 0;
   }
   return 1;
 }
 
+// Move the entries of bucket index of dict_[0] to dict_[1], return how
+// many are moved. The used counters are left to the caller.
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+size_t Dictionary<TKey, TValue, TAllocator, THasher>::RehashBucket(size_t index) {
+  size_t moved = 0;
+  DictEntry* entry = dict_[0].table[index];
+  while (entry) {
+    DictEntry* next = entry->next;
+    size_t new_index = entry->hash & dict_[1].sizemask;
+    entry->next = dict_[1].table[new_index];
+    dict_[1].table[new_index] = entry;
+    moved++;
+    entry = next;
+  }
+  dict_[0].table[index] = nullptr;
+  return moved;
+}
+
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+void Dictionary<TKey, TValue, TAllocator, THasher>::FinishRehash() {
+  FreeTable(dict_[0]);
+  dict_[0] = dict_[1];
+  dict_[1].Reset();
+  rehashidx_ = -1;
+}
+
 /* Return true if we add a new entry.
  * Return false if we replace the value of an old entry.
  */
-template<typename TKey, typename TValue>
-bool Dictionary<TKey, TValue>::Replace(const TKey& key, TValue value) {
-  if (Add(key, value)) return true;
-  
-  DictEntry* entry = Find(key);
-  assert(entry != nullptr);
-
-  // need to free the old value?
-  entry->value = value;
-  return false;
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+bool Dictionary<TKey, TValue, TAllocator, THasher>::Replace(const TKey& key, TValue value) {
+  return InsertOrAssign(key, std::move(value));
 }
 
-template<typename TKey, typename TValue>
-typename Dictionary<TKey, TValue>::DictEntry* Dictionary<TKey, TValue>::ReplaceRaw(const TKey& key) {
-  DictEntry* entry = Find(key);
-  return (entry == nullptr) ? AddRaw(key) : entry;
+// Return the entry of key, added with a default value if it doesn't exist.
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+typename Dictionary<TKey, TValue, TAllocator, THasher>::DictEntry* Dictionary<TKey, TValue, TAllocator, THasher>::ReplaceRaw(const TKey& key) {
+  return EmplaceRaw(key).first;
 }
 
 /* Return entry of the key if key found.
  * Return nullptr if key is not found.
  */
-template<typename TKey, typename TValue>
-typename Dictionary<TKey, TValue>::DictEntry* Dictionary<TKey, TValue>::Find(const TKey& key) {
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+typename Dictionary<TKey, TValue, TAllocator, THasher>::DictEntry* Dictionary<TKey, TValue, TAllocator, THasher>::Find(const TKey& key) {
   if (IsRehashing()) RehashStep();
   
   if (dict_[0].size == 0) return nullptr;
@@ -415,7 +740,7 @@ typename Dictionary<TKey, TValue>::DictEntry* Dictionary<TKey, TValue>::Find(con
     size_t index = hash & dict_[i].sizemask;
     DictEntry* entry = dict_[i].table[index];
     while (entry) {
-      if (entry->key == key) return entry;
+      if (entry->hash == hash && entry->key == key) return entry;
       entry = entry->next;
     }
     if (!IsRehashing()) break;
@@ -423,9 +748,22 @@ typename Dictionary<TKey, TValue>::DictEntry* Dictionary<TKey, TValue>::Find(con
   return nullptr;
 }
 
-template<typename TKey, typename TValue>
-bool Dictionary<TKey, TValue>::Erase(const TKey& key) {
-  if (dict_[0].size == 0) return false;
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+bool Dictionary<TKey, TValue, TAllocator, THasher>::Erase(const TKey& key) {
+  DictEntry* entry = Unlink(key);
+  if (entry == nullptr) return false;
+  FreeEntry(entry);
+  return true;
+}
+
+/* Remove the entry of key from the dictionary without freeing it, so the
+ * caller can still use the key and value, or move them somewhere else.
+ * The entry must be given back by FreeUnlinkedEntry().
+ * Return nullptr if key is not found.
+ */
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+typename Dictionary<TKey, TValue, TAllocator, THasher>::DictEntry* Dictionary<TKey, TValue, TAllocator, THasher>::Unlink(const TKey& key) {
+  if (dict_[0].size == 0) return nullptr;
 
   if (IsRehashing()) RehashStep();
   
@@ -435,27 +773,33 @@ bool Dictionary<TKey, TValue>::Erase(const TKey& key) {
     DictEntry* entry = dict_[i].table[index];
     DictEntry* prev = nullptr;
     while (entry) {
-      if (entry->key == key) {
+      if (entry->hash == hash && entry->key == key) {
         if (prev == nullptr) {
           dict_[i].table[index] = entry->next;
         }
         else {
           prev->next = entry->next;
         }
-        delete entry;
+        entry->next = nullptr;
         dict_[i].used--;
-        return true;
+        ShrinkIfNeed();
+        return entry;
       }
       prev = entry;
       entry = entry->next;
     }
     if (!IsRehashing()) break;
   }
-  return false;
+  return nullptr;
 }
 
-template<typename TKey, typename TValue>
-TValue* Dictionary<TKey, TValue>::Fetch(const TKey& key) {
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+void Dictionary<TKey, TValue, TAllocator, THasher>::FreeUnlinkedEntry(DictEntry* entry) {
+  if (entry != nullptr) FreeEntry(entry);
+}
+
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+TValue* Dictionary<TKey, TValue, TAllocator, THasher>::Fetch(const TKey& key) {
   DictEntry* entry = Find(key);
   if (entry != nullptr) {
     return &entry->value;
@@ -463,77 +807,363 @@ TValue* Dictionary<TKey, TValue>::Fetch(const TKey& key) {
   return nullptr;
 }
 
-template<typename TKey, typename TValue>
-void Dictionary<TKey, TValue>::Clear() {
+/* Like Fetch but without the rehash step, so the dictionary is not
+ * modified and many threads may Peek at once while none writes.
+ */
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+const TValue* Dictionary<TKey, TValue, TAllocator, THasher>::Peek(const TKey& key) const {
+  if (dict_[0].size == 0) return nullptr;
+  size_t hash = hash_func_(key);
+  for (int i = 0; i <= 1; ++i) {
+    DictEntry* entry = dict_[i].table[hash & dict_[i].sizemask];
+    while (entry) {
+      if (entry->hash == hash && entry->key == key) return &entry->value;
+      entry = entry->next;
+    }
+    if (!IsRehashing()) break;
+  }
+  return nullptr;
+}
+
+/* Fetch count keys at once, values[i] is set to what Fetch(keys[i]) would
+ * return. A chained lookup is two dependent cache misses, the bucket and
+ * then the entry, so fetching keys one by one pays them one after another.
+ * Here keys go kMultiFetchBatch at a time: all of them are hashed and
+ * their buckets prefetched, then the first entry of every chain is
+ * prefetched, and only then keys are compared, so the misses of a batch
+ * overlap.
+ */
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+void Dictionary<TKey, TValue, TAllocator, THasher>::MultiFetch(const TKey* keys, size_t count, TValue** values) {
+  size_t hashes[kMultiFetchBatch];
+  DictEntry* heads[kMultiFetchBatch][2];
+  for (size_t base = 0; base < count; base += kMultiFetchBatch) {
+    size_t n = count - base < kMultiFetchBatch ? count - base : kMultiFetchBatch;
+    // One rehash step per key like Fetch, all before the batch starts.
+    for (size_t i = 0; i < n && IsRehashing(); ++i) RehashStep();
+    if (dict_[0].size == 0) {
+      for (size_t i = 0; i < n; ++i) values[base + i] = nullptr;
+      continue;
+    }
+
+    int tables = IsRehashing() ? 2 : 1;
+    for (size_t i = 0; i < n; ++i) {
+      hashes[i] = hash_func_(keys[base + i]);
+      for (int t = 0; t < tables; ++t) {
+        __builtin_prefetch(&dict_[t].table[hashes[i] & dict_[t].sizemask]);
+      }
+    }
+    for (size_t i = 0; i < n; ++i) {
+      heads[i][1] = nullptr;
+      for (int t = 0; t < tables; ++t) {
+        heads[i][t] = dict_[t].table[hashes[i] & dict_[t].sizemask];
+        if (heads[i][t] != nullptr) __builtin_prefetch(heads[i][t]);
+      }
+    }
+    for (size_t i = 0; i < n; ++i) {
+      values[base + i] = nullptr;
+      for (int t = 0; t < 2 && values[base + i] == nullptr; ++t) {
+        for (DictEntry* entry = heads[i][t]; entry != nullptr; entry = entry->next) {
+          if (entry->hash == hashes[i] && entry->key == keys[base + i]) {
+            values[base + i] = &entry->value;
+            break;
+          }
+        }
+      }
+    }
+  }
+}
+
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+void Dictionary<TKey, TValue, TAllocator, THasher>::Clear() {
   Clear(dict_[0]);
   Clear(dict_[1]);
   rehashidx_ = -1;
   iterator_count_ = 0;
 }
 
-template<typename TKey, typename TValue>
-size_t Dictionary<TKey, TValue>::RehashMilliseconds(int ms) {
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+size_t Dictionary<TKey, TValue, TAllocator, THasher>::RehashMilliseconds(int ms) {
   auto start = std::chrono::high_resolution_clock::now();
   size_t rehash_step = 0;
   // why rehash 100 steps?
   while (RehashNStep(100)) {
     rehash_step += 100;
     auto current = std::chrono::high_resolution_clock::now();
-    std::chrono::duration<int, std::milli> diff = current - start;
+    auto diff = std::chrono::duration_cast<std::chrono::milliseconds>(current - start);
     if (diff.count() > ms) break;
   }
   return rehash_step;
 }
 
-// Fetch a random key from dictionary.
-// Return null if no key found.
-template<typename TKey, typename TValue>
-TKey* Dictionary<TKey, TValue>::FetchRandom() {
-  if (dict_[0].used + dict_[1].used == 0) return nullptr;
-  
-  if (IsRehashing()) RehashStep();
+/* Rehash for about ms milliseconds like RehashMilliseconds, but with
+ * threads threads: every round splits the next kParallelRehashBuckets
+ * buckets of dict_[0] into ranges moved at the same time by ParallelRun.
+ * The caller is blocked for one round at most past ms, and can read and
+ * write the dictionary between calls as usual.
+ * When the table grows, keys of bucket i only move to buckets of dict_[1]
+ * whose low bits are i, so two ranges never write the same bucket.
+ * Shrinking merges buckets, it's done on this thread only.
+ * Return about the number of buckets of dict_[0] rehashed.
+ */
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+size_t Dictionary<TKey, TValue, TAllocator, THasher>::RehashParallel(int ms, int threads) {
+  if (!IsRehashing() || iterator_count_ > 0) return 0;
+  if (threads <= 1 || dict_[1].size < dict_[0].size) {
+    return RehashMilliseconds(ms);
+  }
 
-  DictEntry* entry;
-  if (IsRehashing()) {
-    // Repeat to find a non-empty bucket.
-    while (true) {
-      int index = rehashidx_ + std::rand() % (dict_[0].size + dict_[1].size - rehashidx_);
-      if (index >= dict_[0].size) {
-        entry = dict_[0].table[index];
-      }
-      else {
-        entry = dict_[1].table[index - dict_[0].size];
-      }
-      if (entry != nullptr) break;
+  auto start = std::chrono::high_resolution_clock::now();
+  size_t visited = 0;
+  std::vector<size_t> moved(threads);
+  while (true) {
+    size_t begin = rehashidx_;
+    size_t end = begin + kParallelRehashBuckets;
+    if (end > dict_[0].size) end = dict_[0].size;
+    size_t range = (end - begin + threads - 1) / threads;
+    ParallelRun(threads, [this, &moved, begin, end, range](int task) {
+      size_t from = begin + task * range;
+      size_t to = from + range < end ? from + range : end;
+      moved[task] = 0;
+      for (size_t i = from; i < to; ++i) moved[task] += RehashBucket(i);
+    });
+    for (size_t count : moved) {
+      dict_[0].used -= count;
+      dict_[1].used += count;
+    }
+    visited += end - begin;
+    rehashidx_ = end;
+
+    if (dict_[0].used == 0) {
+      FinishRehash();
+      break;
+    }
+    auto diff = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::high_resolution_clock::now() - start);
+    if (diff.count() > ms) break;
+  }
+  return visited;
+}
+
+/* Defrag entries, keys and values bucket by bucket for about ms
+ * milliseconds, starting from cursor (0 for a new pass).
+ * Return the cursor to continue with, 0 if all buckets are visited.
+ * Cursor counts buckets of dict_[0] then dict_[1], so some buckets may be
+ * missed or visited twice if the table is resized between two calls.
+ */
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+size_t Dictionary<TKey, TValue, TAllocator, THasher>::Defrag(size_t cursor, int ms) {
+  // Safe iterators keep pointers to entries, don't move them.
+  if (iterator_count_ > 0) return cursor;
+
+  auto start = std::chrono::high_resolution_clock::now();
+  while (true) {
+    DictTable* dict = &dict_[0];
+    size_t index = cursor;
+    if (index >= dict->size) {
+      index -= dict->size;
+      dict = &dict_[1];
+      if (index >= dict->size) return 0;
     }
+    DefragBucket(&dict->table[index]);
+    cursor++;
+
+    // Checking time is not free, do it every 16 buckets.
+    if (cursor % 16 == 0) {
+      auto diff = std::chrono::duration_cast<std::chrono::milliseconds>(
+          std::chrono::high_resolution_clock::now() - start);
+      if (diff.count() >= ms) break;
+    }
+  }
+  return cursor;
+}
+
+/* Visit the buckets of one cursor position, call callback on their entries
+ * and return the cursor of the next call, 0 when every bucket is visited.
+ * Start with cursor 0. Keys present from the first call to the last are
+ * returned at least once, even if the table is expanded, shrunk or
+ * rehashed in between, but some may be returned more than once.
+ *
+ * Like redis dictScan, the cursor is incremented from its high bits down
+ * (reversed binary), so the buckets visited in a table of size n are the
+ * ones a key of those buckets can move to in a table of size 2n or n/2.
+ * The callback can change values but must not insert or erase keys.
+ */
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+size_t Dictionary<TKey, TValue, TAllocator, THasher>::Scan(size_t cursor, std::function<void(const TKey&, TValue&)> callback) {
+  if (Size() == 0) return 0;
+
+  // No rehash by the callback while we are in a bucket.
+  iterator_count_++;
+  if (!IsRehashing()) {
+    const DictTable& t0 = dict_[0];
+    ScanBucket(t0.table[cursor & t0.sizemask], callback);
+
+    // Set the bits above the mask so incrementing the reversed cursor
+    // carries into the masked ones.
+    cursor |= ~t0.sizemask;
+    cursor = ReverseBits(cursor);
+    cursor++;
+    cursor = ReverseBits(cursor);
   }
   else {
-    while (true) {
-      int index = std::rand() & dict_[0].sizemask;
-      entry = dict_[0].table[index];
-      if (entry != nullptr) break;
+    // Visit the bucket of the small table, then every bucket of the
+    // large table which expands to it.
+    const DictTable* t0 = &dict_[0];
+    const DictTable* t1 = &dict_[1];
+    if (t0->size > t1->size) std::swap(t0, t1);
+    ScanBucket(t0->table[cursor & t0->sizemask], callback);
+    do {
+      ScanBucket(t1->table[cursor & t1->sizemask], callback);
+      cursor |= ~t1->sizemask;
+      cursor = ReverseBits(cursor);
+      cursor++;
+      cursor = ReverseBits(cursor);
+      // Continue while the bits only the large mask has are not 0.
+    } while (cursor & (t0->sizemask ^ t1->sizemask));
+  }
+  iterator_count_--;
+  return cursor;
+}
+
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+void Dictionary<TKey, TValue, TAllocator, THasher>::ScanBucket(DictEntry* entry, const std::function<void(const TKey&, TValue&)>& callback) {
+  while (entry != nullptr) {
+    DictEntry* next = entry->next;
+    callback(entry->key, entry->value);
+    entry = next;
+  }
+}
+
+// Move every entry of the bucket which the allocator suggests to move, link
+// points to the bucket slot and then to the next field of each entry.
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+void Dictionary<TKey, TValue, TAllocator, THasher>::DefragBucket(DictEntry** link) {
+  while (*link != nullptr) {
+    DictEntry* entry = *link;
+    DefragObject(entry->key);
+    DefragObject(entry->value);
+    if (TAllocator::DefragHint(entry)) {
+      DictEntry* moved = new (TAllocator::AllocateNoCache(sizeof(DictEntry)))
+          DictEntry(std::move(*entry));
+      entry->~DictEntry();
+      TAllocator::DeallocateNoCache(entry);
+      *link = entry = moved;
+    }
+    link = &entry->next;
+  }
+}
+
+/* Return bytes used by the dictionary: itself, the bucket arrays, the
+ * entries and the memory owned by keys and values. Entries, keys and
+ * values are estimated from the chains of random buckets till samples
+ * entries are seen, pass 0 to visit every entry.
+ */
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+size_t Dictionary<TKey, TValue, TAllocator, THasher>::MemoryUsage(size_t samples) const {
+  size_t bytes = sizeof(*this);
+  for (int i = 0; i < 2; ++i) {
+    bytes += TAllocator::TableSize(dict_[i].table, dict_[i].size * sizeof(DictEntry*));
+  }
+  size_t used = dict_[0].used + dict_[1].used;
+  if (used == 0) return bytes;
+  if (samples == 0 || samples > used) samples = used;
+
+  // Walk the live buckets of both tables as one array. Buckets of dict_[0]
+  // before rehashidx_ are empty.
+  size_t start = IsRehashing() ? rehashidx_ : 0;
+  size_t buckets = dict_[0].size + dict_[1].size - start;
+  size_t sampled = 0;
+  size_t sampled_bytes = 0;
+  auto sample_chain = [&](size_t index) {
+    index += start;
+    const DictTable& dict = index < dict_[0].size ? dict_[0] : dict_[1];
+    DictEntry* entry = dict.table[index < dict_[0].size ? index : index - dict_[0].size];
+    for (; entry != nullptr; entry = entry->next) {
+      sampled_bytes += TAllocator::Size(entry);
+      sampled_bytes += ObjectMemoryUsage(entry->key) + ObjectMemoryUsage(entry->value);
+      sampled++;
     }
+  };
+  if (samples == used) {
+    for (size_t index = 0; index < buckets; ++index) sample_chain(index);
+    return bytes + sampled_bytes;
+  }
+
+  // Whole chains of independent buckets, so every entry is as likely to
+  // be seen and the samples don't come from one run of the table. Sparse
+  // tables stop after kMemoryUsageDraws draws per sample.
+  for (size_t draws = 0; sampled < samples && draws < samples * kMemoryUsageDraws; ++draws) {
+    sample_chain(RandomIndex(buckets));
+  }
+  // Out of luck, the next chain from a random bucket will do.
+  size_t index = RandomIndex(buckets);
+  for (size_t visited = 0; sampled == 0 && visited < buckets; ++visited) {
+    sample_chain(index);
+    index = (index + 1) % buckets;
   }
+  return bytes + static_cast<size_t>(
+      static_cast<double>(sampled_bytes) / sampled * used);
+}
+
+/* Fetch a random key from dictionary.
+ * Return null if no key found.
+ *
+ * Picking a random bucket and then a random entry of its chain favours
+ * keys in short chains. Instead pick a bucket and a position in
+ * [0, bound) and retry when the chain is shorter than the position, so
+ * every key in a chain of at most bound entries has the same chance.
+ * Keys of longer chains are picked at least bound/len as often, bound
+ * grows with the load factor so that's rare.
+ */
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+TKey* Dictionary<TKey, TValue, TAllocator, THasher>::FetchRandom() {
+  if (dict_[0].used + dict_[1].used == 0) return nullptr;
   
-  int len = 0;
-  DictEntry* p = entry;
-  while (p) {
-    p = p->next;
-    len++;
+  if (IsRehashing()) RehashStep();
+
+  // Walk the live buckets of both tables as one array. Buckets of dict_[0]
+  // before rehashidx_ are empty.
+  size_t start = IsRehashing() ? rehashidx_ : 0;
+  size_t buckets = dict_[0].size - start;
+  if (IsRehashing()) buckets += dict_[1].size;
+  size_t bound = 2 * ((dict_[0].used + dict_[1].used) / buckets + 1);
+  if (bound < kFetchRandomChain) bound = kFetchRandomChain;
+
+  while (true) {
+    size_t index = start + RandomIndex(buckets);
+    DictEntry* entry;
+    if (index < dict_[0].size) {
+      entry = dict_[0].table[index];
+    }
+    else {
+      entry = dict_[1].table[index - dict_[0].size];
+    }
+    if (entry == nullptr) continue;
+
+    size_t len = 0;
+    for (DictEntry* p = entry; p != nullptr; p = p->next) len++;
+    size_t pos = RandomIndex(len > bound ? len : bound);
+    if (pos >= len) continue;
+    while (pos--) entry = entry->next;
+    return &entry->key;
   }
-  int index = std::rand() % len;
-  while(index--) entry = entry->next;
-  return &entry->key;
 }
 
-// Sample some continuous kv pairs from dictionary at a random location,
-// Pairs maybe empty or have less count than given param.
-template<typename TKey, typename TValue>
-std::vector<std::pair<TKey*, TValue*>> Dictionary<TKey, TValue>::FetchSome(int count) {
+/* Sample some distinct kv pairs from dictionary, continuous buckets from a
+ * random location. Pairs maybe empty or have less count than given param.
+ *
+ * Cheaper than count FetchRandom calls but the samples are correlated: keys
+ * after a run of empty buckets come up more often. When a chain holds more
+ * entries than still needed, a random subset of it is taken rather than
+ * its head.
+ */
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+std::vector<std::pair<TKey*, TValue*>> Dictionary<TKey, TValue, TAllocator, THasher>::FetchSome(int count) {
   std::vector<std::pair<TKey*, TValue*>> result;
-  unsigned long used = dict_[0].used + dict_[1].used;
-  if (used == 0) return result;
-  if (used < count) count = used;
+  size_t used = dict_[0].used + dict_[1].used;
+  if (used == 0 || count <= 0) return result;
+  if (used < static_cast<size_t>(count)) count = used;
   
   for (int i = 0; i < count; ++i) {
     if (IsRehashing()) RehashStep();
@@ -545,34 +1175,48 @@ std::vector<std::pair<TKey*, TValue*>> Dictionary<TKey, TValue>::FetchSome(int c
   if (IsRehashing() && dict_[1].sizemask > maxsizemask) {
     maxsizemask = dict_[1].sizemask;
   }
-  int rand_index = std::rand() & maxsizemask;
+  size_t rand_index = RandomIndex(maxsizemask + 1);
   int empty_len = 0;
   int max_steps = count * 10;
-  while (result.size() && max_steps--) {
+  while (result.size() < static_cast<size_t>(count) && max_steps--) {
     for (int i = 0; i < num_dict; ++i) {
-      if (num_dict == 2 && i == 0 && rand_index < rehashidx_) {
-        if (rand_index > dict_[1].size) {
+      // Buckets of dict_[0] before rehashidx_ are empty. If rand_index is
+      // also out of dict_[1], jump to the first bucket not rehashed yet.
+      if (num_dict == 2 && i == 0 && rand_index < static_cast<size_t>(rehashidx_)) {
+        if (rand_index >= dict_[1].size) {
           rand_index = rehashidx_;
         }
-        continue;
+        else {
+          continue;
+        }
       }
       if (rand_index >= dict_[i].size) continue;
 
       DictEntry* entry = dict_[i].table[rand_index];
       if (entry == nullptr) {
         empty_len++;
-        // why need these conditions?
+        // Long empty runs in a sparse table, start over elsewhere instead
+        // of walking them.
         if (empty_len >= 5 && empty_len > count) {
-          rand_index = std::rand() & maxsizemask;
+          rand_index = RandomIndex(maxsizemask + 1);
           empty_len = 0;
         }
       }
       else {
         empty_len = 0;
-        while (entry) {
-          result.push_back(std::make_pair(&entry->key, &entry->value));
-          if (result.size() == count) return result;
+        size_t len = 0;
+        for (DictEntry* p = entry; p != nullptr; p = p->next) len++;
+        // Take each entry with chance needed / left, which picks a uniform
+        // subset when the chain can't be taken whole.
+        size_t needed = count - result.size();
+        for (size_t left = len; entry != nullptr && needed > 0; --left) {
+          if (needed >= left || RandomIndex(left) < needed) {
+            result.push_back(std::make_pair(&entry->key, &entry->value));
+            needed--;
+          }
+          entry = entry->next;
         }
+        if (result.size() == static_cast<size_t>(count)) return result;
       }
     }
     rand_index = (rand_index + 1) & maxsizemask;
@@ -580,28 +1224,28 @@ std::vector<std::pair<TKey*, TValue*>> Dictionary<TKey, TValue>::FetchSome(int c
   return result;
 }
 
-template<typename TKey, typename TValue>
-typename Dictionary<TKey, TValue>::Iterator Dictionary<TKey, TValue>::SafeBegin() {
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+typename Dictionary<TKey, TValue, TAllocator, THasher>::Iterator Dictionary<TKey, TValue, TAllocator, THasher>::SafeBegin() {
   Iterator it = Iterator(this, true);
   it++;
   return it;
 }
 
-template<typename TKey, typename TValue>
-typename Dictionary<TKey, TValue>::Iterator Dictionary<TKey, TValue>::SafeEnd() {
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+typename Dictionary<TKey, TValue, TAllocator, THasher>::Iterator Dictionary<TKey, TValue, TAllocator, THasher>::SafeEnd() {
   Iterator it = Iterator(this, true);
   return it;
 }
 
-template<typename TKey, typename TValue>
-typename Dictionary<TKey, TValue>::Iterator Dictionary<TKey, TValue>::Begin() {
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+typename Dictionary<TKey, TValue, TAllocator, THasher>::Iterator Dictionary<TKey, TValue, TAllocator, THasher>::Begin() {
   Iterator it = Iterator(this, false);
   it++;
   return it;
 }
 
-template<typename TKey, typename TValue>
-typename Dictionary<TKey, TValue>::Iterator Dictionary<TKey, TValue>::End() {
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+typename Dictionary<TKey, TValue, TAllocator, THasher>::Iterator Dictionary<TKey, TValue, TAllocator, THasher>::End() {
   Iterator it = Iterator(this, false);
   return it;
 }
@@ -609,8 +1253,8 @@ typename Dictionary<TKey, TValue>::Iterator Dictionary<TKey, TValue>::End() {
 /* Hash for a dictionary, mainly use pointer, size and used for
  * two internal dicts.
  */
-template <typename TKey, typename TValue>
-size_t Dictionary<TKey, TValue>::FingerPrint() {
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+size_t Dictionary<TKey, TValue, TAllocator, THasher>::FingerPrint() {
   size_t integers[6] = {
     reinterpret_cast<size_t>(dict_[0].table),
     dict_[0].size,
@@ -645,10 +1289,10 @@ size_t Dictionary<TKey, TValue>::FingerPrint() {
 // 1. It will not work incrementally.
 // 2. It will not produce the same results on little-endian and big-endian
 //    machines.    */
-uint32_t MurmurHash2(const void * key, int len){
+inline uint32_t MurmurHash2(const void * key, int len){
   /* 'm' and 'r' are mixing constants generated offline.
      They're not really 'magic', they just happen to work well.  */
-  uint32_t seed = hash_seed;
+  uint32_t seed = DictHashSeed();
   const uint32_t m = 0x5bd1e995;
   const int r = 24;
 
@@ -692,25 +1336,97 @@ uint32_t MurmurHash2(const void * key, int len){
 }
 
 /* And a case insensitive hash function (based on djb hash) */
-uint32_t GenCaseHashFunction(const unsigned char *buf, int len) {
-    uint32_t hash = hash_seed;
+inline uint32_t GenCaseHashFunction(const unsigned char *buf, int len) {
+    uint32_t hash = DictHashSeed();
     while (len--)
         hash = ((hash << 5) + hash) + (std::tolower(*buf++)); /* hash * 33 + c */
     return hash;
 }
 
-void EnableResize() {
-  can_resize = true;
+/* MurmurHash64A, the 64 bit version of MurmurHash2 by Austin Appleby, with
+ * the same assumptions. It mixes 8 bytes at a time, which pays off on
+ * long keys. */
+inline uint64_t MurmurHash64A(const void * key, int len) {
+  const uint64_t m = 0xc6a4a7935bd1e995ULL;
+  const int r = 47;
+
+  uint64_t h = DictHashSeed() ^ (len * m);
+
+  const unsigned char * data = (const unsigned char *)key;
+  const unsigned char * end = data + (len & ~7);
+
+  while (data != end) {
+    uint64_t k = *(uint64_t*)data;
+
+    k *= m;
+    k ^= k >> r;
+    k *= m;
+
+    h ^= k;
+    h *= m;
+
+    data += 8;
+  }
+
+  switch (len & 7) {
+  case 7: h ^= uint64_t(data[6]) << 48;
+  case 6: h ^= uint64_t(data[5]) << 40;
+  case 5: h ^= uint64_t(data[4]) << 32;
+  case 4: h ^= uint64_t(data[3]) << 24;
+  case 3: h ^= uint64_t(data[2]) << 16;
+  case 2: h ^= uint64_t(data[1]) << 8;
+  case 1: h ^= uint64_t(data[0]);
+      h *= m;
+  };
+
+  h ^= h >> r;
+  h *= m;
+  h ^= h >> r;
+
+  return h;
+}
+
+/* Hash policies for the THasher parameter of Dictionary. They work on any
+ * key with data() and size(), like std::string, and are inlined into the
+ * dictionary instead of being called through std::function. */
+struct MurmurHasher {
+  template<typename TKey>
+  size_t operator()(const TKey& key) const {
+    return MurmurHash2(key.data(), static_cast<int>(key.size()));
+  }
+};
+
+// Only for keys whose operator== ignores case too.
+struct CaseHasher {
+  template<typename TKey>
+  size_t operator()(const TKey& key) const {
+    return GenCaseHashFunction(reinterpret_cast<const unsigned char*>(key.data()),
+                               static_cast<int>(key.size()));
+  }
+};
+
+struct Murmur64Hasher {
+  template<typename TKey>
+  size_t operator()(const TKey& key) const {
+    return static_cast<size_t>(MurmurHash64A(key.data(), static_cast<int>(key.size())));
+  }
+};
+
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+inline size_t ObjectMemoryUsage(const Dictionary<TKey, TValue, TAllocator, THasher>& dict) {
+  return dict.MemoryUsage() - sizeof(dict);
 }
-void DisableResize() {
-  can_resize = false;
+
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+inline size_t ObjectFreeEffort(const Dictionary<TKey, TValue, TAllocator, THasher>& dict) {
+  return dict.Size();
 }
 
-void SetHashSeed(uint32_t seed) {
-  hash_seed = seed;
+inline void SetHashSeed(uint32_t seed) {
+  DictHashSeed() = seed;
 }
-uint32_t GetHashSeed() {
-  return hash_seed;
+inline uint32_t GetHashSeed() {
+  return DictHashSeed();
 }
 
 }
@@ -0,0 +1,143 @@
+#include "mredis/src/epoch.h"
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace mredis {
+
+namespace {
+  // Retired objects waiting before the epoch is tried to advance.
+  const size_t kEpochReclaimBatch = 64;
+  // Epoch of a slot whose thread is not inside a guard.
+  const uint64_t kEpochIdle = 0;
+
+  // One per thread, on its own cache line so readers don't share lines.
+  struct alignas(64) EpochSlot {
+    std::atomic<uint64_t> epoch;
+    std::atomic<bool> taken;
+  };
+
+  struct RetiredObject {
+    uint64_t epoch;
+    std::function<void()> free;
+  };
+
+  std::atomic<uint64_t> global_epoch(1);
+  EpochSlot epoch_slots[kEpochMaxThreads];
+  std::atomic<size_t> epoch_pending(0);
+  std::atomic<size_t> epoch_retired(0);
+  std::mutex retired_lock;
+  std::vector<RetiredObject> retired;
+
+  // The slot of the calling thread, taken on first guard and given back
+  // when the thread exits.
+  class ThreadSlot {
+   public:
+    ThreadSlot() : slot_(nullptr), depth_(0) {}
+    ~ThreadSlot() {
+      if (slot_ != nullptr) slot_->taken.store(false);
+    }
+
+    void Enter() {
+      if (depth_++ > 0) return;
+      if (slot_ == nullptr) slot_ = Take();
+      // Publish the epoch before any shared pointer is read. Checking it
+      // again means the slot never lags the global epoch when we start.
+      uint64_t epoch = global_epoch.load();
+      while (true) {
+        slot_->epoch.store(epoch, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        uint64_t current = global_epoch.load(std::memory_order_relaxed);
+        if (current == epoch) break;
+        epoch = current;
+      }
+    }
+
+    void Leave() {
+      if (--depth_ > 0) return;
+      slot_->epoch.store(kEpochIdle, std::memory_order_release);
+    }
+
+   private:
+    static EpochSlot* Take() {
+      while (true) {
+        for (int i = 0; i < kEpochMaxThreads; ++i) {
+          bool taken = false;
+          if (!epoch_slots[i].taken.load(std::memory_order_relaxed) &&
+              epoch_slots[i].taken.compare_exchange_strong(taken, true)) {
+            return &epoch_slots[i];
+          }
+        }
+        // More than kEpochMaxThreads readers, wait for one to exit.
+        std::this_thread::yield();
+      }
+    }
+
+    EpochSlot* slot_;
+    int depth_;
+  };
+
+  thread_local ThreadSlot thread_slot;
+
+  // Move the global epoch on if every thread inside a guard has seen it.
+  uint64_t TryAdvance() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    uint64_t epoch = global_epoch.load();
+    for (int i = 0; i < kEpochMaxThreads; ++i) {
+      uint64_t seen = epoch_slots[i].epoch.load(std::memory_order_acquire);
+      if (seen != kEpochIdle && seen != epoch) return epoch;
+    }
+    global_epoch.compare_exchange_strong(epoch, epoch + 1);
+    return global_epoch.load();
+  }
+}
+
+EpochGuard::EpochGuard() {
+  thread_slot.Enter();
+}
+
+EpochGuard::~EpochGuard() {
+  thread_slot.Leave();
+}
+
+void EpochRetire(std::function<void()> free) {
+  {
+    std::lock_guard<std::mutex> guard(retired_lock);
+    retired.push_back(RetiredObject{global_epoch.load(), std::move(free)});
+    epoch_pending++;
+  }
+  if (++epoch_retired % kEpochReclaimBatch == 0) EpochReclaim();
+}
+
+size_t EpochReclaim() {
+  uint64_t epoch = TryAdvance();
+  std::vector<RetiredObject> ready;
+  {
+    std::lock_guard<std::mutex> guard(retired_lock);
+    size_t kept = 0;
+    for (size_t i = 0; i < retired.size(); ++i) {
+      // Readers may be one epoch behind, objects of two epochs ago are safe.
+      if (retired[i].epoch + 2 <= epoch) {
+        ready.push_back(std::move(retired[i]));
+      }
+      else {
+        retired[kept++] = std::move(retired[i]);
+      }
+    }
+    retired.resize(kept);
+    epoch_pending -= ready.size();
+  }
+  // Free outside the lock, frees may retire more.
+  for (auto& object : ready) object.free();
+  return ready.size();
+}
+
+size_t EpochPendingObjects() {
+  return epoch_pending.load();
+}
+
+}
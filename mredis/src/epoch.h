@@ -0,0 +1,45 @@
+#ifndef MREDIS_SRC_EPOCH_H_
+#define MREDIS_SRC_EPOCH_H_
+
+#include <cstddef>
+#include <functional>
+
+/* Epoch based reclamation, for memory which lock-free readers may still
+ * be looking at after a writer has unlinked it.
+ *
+ * A reader holds an EpochGuard while it uses shared pointers. A writer
+ * unlinks an object and hands it to EpochRetire instead of freeing it.
+ * The global epoch moves on only when every thread inside a guard has
+ * seen the current one, so once it moved twice past the epoch an object
+ * was retired in, no reader can still hold a pointer to it and it's
+ * freed by whichever thread retires or reclaims next.
+ *
+ * Entering and leaving a guard is a store and a fence on a cache line of
+ * the thread's own, readers never write shared memory.
+ */
+namespace mredis {
+
+// Threads which can be inside a guard at the same time.
+const int kEpochMaxThreads = 256;
+
+// Guards nest, only the outermost one enters and leaves the epoch.
+class EpochGuard {
+ public:
+  EpochGuard();
+  ~EpochGuard();
+  EpochGuard(const EpochGuard&) = delete;
+  EpochGuard& operator=(const EpochGuard&) = delete;
+};
+
+// Run free once no reader can reach what it frees. It may run on any
+// thread, so it must only free memory.
+void EpochRetire(std::function<void()> free);
+// Advance the epoch if possible and run the frees which became safe.
+// Return how many ran.
+size_t EpochReclaim();
+// Frees retired but not run yet.
+size_t EpochPendingObjects();
+
+}
+
+#endif
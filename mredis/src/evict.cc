@@ -0,0 +1,55 @@
+#include "mredis/src/evict.h"
+
+#include <chrono>
+#include <cstdlib>
+
+namespace mredis {
+
+namespace {
+  const unsigned long long kLRUClockResolution = 1000;
+
+  unsigned long long MillisecondsNow() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+}
+
+uint32_t LRUClock() {
+  return (MillisecondsNow() / kLRUClockResolution) & kLRUClockMax;
+}
+
+unsigned long long LRUIdleTime(uint32_t lru) {
+  unsigned long long clock = LRUClock();
+  if (clock >= lru) return (clock - lru) * kLRUClockResolution;
+  // The clock wrapped around since lru.
+  return (clock + (kLRUClockMax - lru)) * kLRUClockResolution;
+}
+
+uint32_t LFUTimeInMinutes() {
+  return (MillisecondsNow() / 1000 / 60) & 65535;
+}
+
+// Increment the counter with a probability which gets lower as the counter
+// grows, so 8 bits are enough for millions of accesses.
+uint8_t LFULogIncr(uint8_t counter, int log_factor) {
+  if (counter == 255) return 255;
+  double r = static_cast<double>(std::rand()) / RAND_MAX;
+  double baseval = counter - kLFUInitValue;
+  if (baseval < 0) baseval = 0;
+  double p = 1.0 / (baseval * log_factor + 1);
+  if (r < p) counter++;
+  return counter;
+}
+
+// Return the counter of lru decremented by one per decay_time minutes
+// elapsed since the last decrement.
+uint8_t LFUDecrAndReturn(uint32_t lru, int decay_time) {
+  uint32_t last = lru >> 8;
+  uint32_t counter = lru & 255;
+  uint32_t now = LFUTimeInMinutes();
+  uint32_t elapsed = now >= last ? now - last : 65535 - last + now;
+  uint32_t periods = decay_time > 0 ? elapsed / decay_time : 0;
+  return periods > counter ? 0 : counter - periods;
+}
+
+}
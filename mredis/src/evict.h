@@ -0,0 +1,277 @@
+#ifndef MREDIS_SRC_EVICT_H_
+#define MREDIS_SRC_EVICT_H_
+
+#include <cstdint>
+#include <limits>
+#include <utility>
+#include <vector>
+
+#include "mredis/src/dict.h"
+#include "mredis/src/zmalloc.h"
+
+/* maxmemory enforcement with approximated LRU/LFU eviction.
+ *
+ * Like redis we don't keep the keys ordered by access time, instead some
+ * keys are sampled with Dictionary::FetchSome and the best candidates are
+ * kept in a small eviction pool across calls, the key with the largest
+ * idle time in the pool is evicted first.
+ */
+namespace mredis {
+
+enum class MaxmemoryPolicy {
+  kNoEviction,
+  kAllKeysLRU,
+  kAllKeysLFU,
+  kAllKeysRandom,
+  kVolatileLRU,
+  kVolatileLFU,
+  kVolatileRandom,
+  kVolatileTTL
+};
+
+// LRU clock in seconds, wraps around every 2^24 seconds (194 days).
+const uint32_t kLRUClockMax = (1 << 24) - 1;
+const int kLFUInitValue = 5;
+
+uint32_t LRUClock();
+// Milliseconds since the object with the given lru was accessed.
+unsigned long long LRUIdleTime(uint32_t lru);
+
+// In LFU mode lru keeps the last decrement time in minutes in the high
+// 16 bits and a logarithmic access counter in the low 8 bits.
+uint32_t LFUTimeInMinutes();
+uint8_t LFULogIncr(uint8_t counter, int log_factor);
+uint8_t LFUDecrAndReturn(uint32_t lru, int decay_time);
+
+/* Evict keys of dict until zmalloc_used_memory() is under maxmemory.
+ * expires maps keys with a TTL to their expire time in milliseconds,
+ * volatile policies only evict keys in it.
+ * TValue must have a public uint32_t lru field kept up to date by calling
+ * Touch() on every access, like the lru field of redis objects.
+ */
+template <typename TKey, typename TValue, typename TAllocator = ZmallocAllocator>
+class Evictor {
+ public:
+  using TDictionary = Dictionary<TKey, TValue, TAllocator>;
+  using TExpires = Dictionary<TKey, long long, TAllocator>;
+
+  Evictor(TDictionary* dict, TExpires* expires)
+      : dict_(dict), expires_(expires), maxmemory_(0),
+        policy_(MaxmemoryPolicy::kNoEviction), samples_(5),
+        lfu_log_factor_(10), lfu_decay_time_(1), evicted_(0),
+        pool_(kEvictionPoolSize) {}
+
+  // 0 means no limit.
+  inline void SetMaxmemory(size_t bytes) { maxmemory_ = bytes; }
+  inline size_t Maxmemory() const { return maxmemory_; }
+  inline void SetPolicy(MaxmemoryPolicy policy) { policy_ = policy; ClearPool(); }
+  inline MaxmemoryPolicy Policy() const { return policy_; }
+  inline void SetSamples(int samples) { samples_ = samples; }
+  inline void SetLFULogFactor(int factor) { lfu_log_factor_ = factor; }
+  inline void SetLFUDecayTime(int minutes) { lfu_decay_time_ = minutes; }
+  inline size_t Evicted() const { return evicted_; }
+
+  uint32_t InitialLRU() const;
+  void Touch(TValue& value) const;
+  bool PerformEvictions();
+
+ private:
+  static const int kEvictionPoolSize = 16;
+  static const int kMaxPopulateTries = 100;
+  struct PoolEntry {
+    unsigned long long idle;
+    TKey key;
+    bool valid;
+    PoolEntry() : idle(0), valid(false) {}
+  };
+
+  inline bool IsLFU() const {
+    return policy_ == MaxmemoryPolicy::kAllKeysLFU
+        || policy_ == MaxmemoryPolicy::kVolatileLFU;
+  }
+  inline bool IsVolatile() const {
+    return policy_ == MaxmemoryPolicy::kVolatileLRU
+        || policy_ == MaxmemoryPolicy::kVolatileLFU
+        || policy_ == MaxmemoryPolicy::kVolatileRandom
+        || policy_ == MaxmemoryPolicy::kVolatileTTL;
+  }
+  inline bool IsRandom() const {
+    return policy_ == MaxmemoryPolicy::kAllKeysRandom
+        || policy_ == MaxmemoryPolicy::kVolatileRandom;
+  }
+
+  unsigned long long IdleScore(const TValue& value) const;
+  void PopulatePool();
+  void PoolInsert(const TKey& key, unsigned long long idle);
+  bool PoolPopBest(TKey* key);
+  void ClearPool();
+  void EvictKey(const TKey& key);
+
+  TDictionary* dict_;
+  TExpires* expires_;
+  size_t maxmemory_;
+  MaxmemoryPolicy policy_;
+  int samples_;
+  int lfu_log_factor_;
+  int lfu_decay_time_;
+  size_t evicted_;
+  // Sorted by idle ascending, valid entries first.
+  std::vector<PoolEntry> pool_;
+};
+
+// The lru a new object starts with.
+template <typename TKey, typename TValue, typename TAllocator>
+uint32_t Evictor<TKey, TValue, TAllocator>::InitialLRU() const {
+  if (IsLFU()) return (LFUTimeInMinutes() << 8) | kLFUInitValue;
+  return LRUClock();
+}
+
+// Update the access time or frequency of value.
+template <typename TKey, typename TValue, typename TAllocator>
+void Evictor<TKey, TValue, TAllocator>::Touch(TValue& value) const {
+  if (IsLFU()) {
+    uint8_t counter = LFUDecrAndReturn(value.lru, lfu_decay_time_);
+    counter = LFULogIncr(counter, lfu_log_factor_);
+    value.lru = (LFUTimeInMinutes() << 8) | counter;
+  }
+  else {
+    value.lru = LRUClock();
+  }
+}
+
+// The larger the score, the better to evict.
+template <typename TKey, typename TValue, typename TAllocator>
+unsigned long long Evictor<TKey, TValue, TAllocator>::IdleScore(const TValue& value) const {
+  if (IsLFU()) return 255 - LFUDecrAndReturn(value.lru, lfu_decay_time_);
+  return LRUIdleTime(value.lru);
+}
+
+/* Free keys until used memory is under maxmemory.
+ * Return false if memory is still over the limit, that is when the policy
+ * is noeviction or there is no key left to evict.
+ */
+template <typename TKey, typename TValue, typename TAllocator>
+bool Evictor<TKey, TValue, TAllocator>::PerformEvictions() {
+  if (maxmemory_ == 0) return true;
+  while (zmalloc_used_memory() > maxmemory_) {
+    if (policy_ == MaxmemoryPolicy::kNoEviction) return false;
+
+    TKey key;
+    if (IsRandom()) {
+      TKey* random = IsVolatile() ? expires_->FetchRandom() : dict_->FetchRandom();
+      if (random == nullptr) return false;
+      key = *random;
+    }
+    else {
+      if (IsVolatile() ? expires_->Size() == 0 : dict_->Size() == 0) return false;
+      // Sample before every pick. Keys in the pool may be gone already,
+      // so sample again till we find one still alive.
+      int tries = 0;
+      do {
+        if (tries++ == kMaxPopulateTries) return false;
+        PopulatePool();
+      } while (!PoolPopBest(&key));
+    }
+    EvictKey(key);
+  }
+  return true;
+}
+
+template <typename TKey, typename TValue, typename TAllocator>
+void Evictor<TKey, TValue, TAllocator>::EvictKey(const TKey& key) {
+  dict_->Erase(key);
+  if (expires_ != nullptr) expires_->Erase(key);
+  evicted_++;
+}
+
+template <typename TKey, typename TValue, typename TAllocator>
+void Evictor<TKey, TValue, TAllocator>::PopulatePool() {
+  if (IsVolatile()) {
+    std::vector<std::pair<TKey*, long long*>> samples = expires_->FetchSome(samples_);
+    // FetchSome gives up on a sparse table, make sure we get one at least.
+    if (samples.empty()) {
+      TKey* key = expires_->FetchRandom();
+      if (key != nullptr) samples.push_back(std::make_pair(key, expires_->Fetch(*key)));
+    }
+    for (auto& sample : samples) {
+      if (policy_ == MaxmemoryPolicy::kVolatileTTL) {
+        // Sooner to expire is better to evict.
+        PoolInsert(*sample.first, std::numeric_limits<unsigned long long>::max()
+                   - static_cast<unsigned long long>(*sample.second));
+        continue;
+      }
+      TValue* value = dict_->Fetch(*sample.first);
+      if (value != nullptr) PoolInsert(*sample.first, IdleScore(*value));
+    }
+  }
+  else {
+    std::vector<std::pair<TKey*, TValue*>> samples = dict_->FetchSome(samples_);
+    if (samples.empty()) {
+      TKey* key = dict_->FetchRandom();
+      if (key != nullptr) samples.push_back(std::make_pair(key, dict_->Fetch(*key)));
+    }
+    for (auto& sample : samples) {
+      PoolInsert(*sample.first, IdleScore(*sample.second));
+    }
+  }
+}
+
+// Insert key into the pool if it's better than the worst one there or
+// the pool has room.
+template <typename TKey, typename TValue, typename TAllocator>
+void Evictor<TKey, TValue, TAllocator>::PoolInsert(const TKey& key, unsigned long long idle) {
+  const int last = kEvictionPoolSize - 1;
+  for (int i = 0; i < kEvictionPoolSize && pool_[i].valid; ++i) {
+    if (pool_[i].key == key) return;
+  }
+  int k = 0;
+  while (k < kEvictionPoolSize && pool_[k].valid && pool_[k].idle < idle) {
+    k++;
+  }
+
+  if (k == 0 && pool_[last].valid) {
+    // Worse than every key in a full pool.
+    return;
+  }
+  else if (k < kEvictionPoolSize && !pool_[k].valid) {
+    // Empty slot, insert right here.
+  }
+  else if (!pool_[last].valid) {
+    // Room at the end, shift k..last-1 to the right.
+    for (int i = last; i > k; --i) pool_[i] = std::move(pool_[i - 1]);
+  }
+  else {
+    // Pool is full, drop the worst one at 0 by shifting 1..k-1 left.
+    k--;
+    for (int i = 0; i < k; ++i) pool_[i] = std::move(pool_[i + 1]);
+  }
+  pool_[k].idle = idle;
+  pool_[k].key = key;
+  pool_[k].valid = true;
+}
+
+// Take the best candidate out of the pool. Return false if the pool has
+// no key which still exists.
+template <typename TKey, typename TValue, typename TAllocator>
+bool Evictor<TKey, TValue, TAllocator>::PoolPopBest(TKey* key) {
+  for (int k = kEvictionPoolSize - 1; k >= 0; --k) {
+    if (!pool_[k].valid) continue;
+    pool_[k].valid = false;
+    bool exists = IsVolatile() ? expires_->Fetch(pool_[k].key) != nullptr
+                               : dict_->Fetch(pool_[k].key) != nullptr;
+    if (exists) {
+      *key = std::move(pool_[k].key);
+      return true;
+    }
+  }
+  return false;
+}
+
+template <typename TKey, typename TValue, typename TAllocator>
+void Evictor<TKey, TValue, TAllocator>::ClearPool() {
+  for (auto& entry : pool_) entry.valid = false;
+}
+
+}
+
+#endif
@@ -0,0 +1,832 @@
+#ifndef MREDIS_SRC_FLAT_DICT_H_
+#define MREDIS_SRC_FLAT_DICT_H_
+
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <new>
+#include <utility>
+#include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "mredis/src/allocator.h"
+#include "mredis/src/hash.h"
+#include "mredis/src/object_traits.h"
+
+/* Open addressing hash table in the style of SwissTable.
+ *
+ * Keys and values are stored inline in a slot array, next to it there is
+ * one control byte per slot: empty, deleted, or the low 7 bits of the hash
+ * (h2) if the slot is full. Slots are probed a group of 16 at a time, the
+ * control bytes of a group are compared with h2 by one SSE2 instruction,
+ * so most lookups touch one control line and one slot, and no pointer is
+ * chased.
+ *
+ * Like Dictionary, growing is incremental: there are two tables while
+ * rehashing and every operation moves a few slots to the new one.
+ */
+namespace {
+  const size_t kFlatGroupWidth = 16;
+  const size_t kFlatInitSize = 16;
+  const int8_t kFlatEmpty = -128;
+  const int8_t kFlatDeleted = -2;
+  // Slots moved by one rehash step.
+  const size_t kFlatRehashSlots = 16;
+
+  inline size_t FlatNextPower(size_t size) {
+    size_t power = kFlatInitSize;
+    while (power < size) {
+      power *= 2;
+    }
+    return power;
+  }
+
+  // Keep 1/8 of the slots empty so probing always ends soon.
+  inline size_t FlatMaxLoad(size_t size) {
+    return size - size / 8;
+  }
+
+  // The hash of key for the table. Hash functions like std::hash<long> are
+  // the identity, mix the bits so both the high bits used by h1 and the
+  // low ones used by h2 are random. IntHasher is mixed already.
+  template<typename THasher, typename TKey>
+  inline size_t FlatHash(const THasher& hasher, const TKey& key) {
+    return static_cast<size_t>(mredis::FibonacciMix(hasher(key)));
+  }
+  template<typename TKey>
+  inline size_t FlatHash(const mredis::IntHasher& hasher, const TKey& key) {
+    return hasher(key);
+  }
+
+  inline uint8_t FlatH2(size_t hash) {
+    return hash & 0x7F;
+  }
+
+  inline size_t FlatH1(size_t hash) {
+    return hash >> 7;
+  }
+
+  inline int FlatLowestBit(uint32_t mask) {
+    return __builtin_ctz(mask);
+  }
+
+  // Control bytes of a group of slots. Match* return a mask where bit i is
+  // set if slot i of the group matches.
+  class FlatGroup {
+   public:
+    explicit FlatGroup(const int8_t* ctrl) {
+#ifdef __SSE2__
+      ctrl_ = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ctrl));
+#else
+      std::memcpy(ctrl_, ctrl, kFlatGroupWidth);
+#endif
+    }
+
+    uint32_t Match(uint8_t h2) const {
+#ifdef __SSE2__
+      __m128i match = _mm_set1_epi8(static_cast<char>(h2));
+      return _mm_movemask_epi8(_mm_cmpeq_epi8(match, ctrl_));
+#else
+      return MatchBytes([h2](int8_t c) { return c == static_cast<int8_t>(h2); });
+#endif
+    }
+
+    uint32_t MatchEmpty() const {
+#ifdef __SSE2__
+      __m128i match = _mm_set1_epi8(kFlatEmpty);
+      return _mm_movemask_epi8(_mm_cmpeq_epi8(match, ctrl_));
+#else
+      return MatchBytes([](int8_t c) { return c == kFlatEmpty; });
+#endif
+    }
+
+    // Full slots have the sign bit clear.
+    uint32_t MatchEmptyOrDeleted() const {
+#ifdef __SSE2__
+      return _mm_movemask_epi8(ctrl_);
+#else
+      return MatchBytes([](int8_t c) { return c < 0; });
+#endif
+    }
+
+   private:
+#ifdef __SSE2__
+    __m128i ctrl_;
+#else
+    template <typename TPred>
+    uint32_t MatchBytes(TPred pred) const {
+      uint32_t mask = 0;
+      for (size_t i = 0; i < kFlatGroupWidth; ++i) {
+        if (pred(ctrl_[i])) mask |= 1u << i;
+      }
+      return mask;
+    }
+    int8_t ctrl_[kFlatGroupWidth];
+#endif
+  };
+}
+
+namespace mredis {
+
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+class FIterator;
+
+/* Same interface and template parameters as Dictionary. TKey and TValue
+ * must be default constructible and movable, TKey must support the hash
+ * function passed in. Pointers to keys and values are invalidated by
+ * rehashing, which moves them to another slot.
+ *
+ * Safe iterators pause rehashing, no entry moves while they are open. If
+ * inserts fill the new table meanwhile, it's set aside as it is and a
+ * table twice as big takes the inserts. The tables set aside are merged
+ * by the first rehash step after the last safe iterator is gone.
+ */
+template<typename TKey, typename TValue, typename TAllocator = ZmallocAllocator,
+         typename THasher = std::function<size_t(const TKey&)>>
+class FlatDictionary {
+ private:
+  friend class FIterator<TKey, TValue, TAllocator, THasher>;
+  struct FlatEntry {
+    TKey key;
+    TValue value;
+  };
+
+  struct FlatTable {
+    int8_t* ctrl;
+    FlatEntry* slots;
+    size_t size;
+    size_t sizemask;
+    size_t used;
+    size_t deleted;
+    void Reset() {
+      ctrl = nullptr;
+      slots = nullptr;
+      size = 0;
+      sizemask = 0;
+      used = 0;
+      deleted = 0;
+    }
+  };
+
+  FlatTable table_[2];
+  // Next slot of table_[0] to rehash, -1 if not rehashing.
+  long rehashidx_;
+  int iterator_count_;
+  // Tables filled by inserts while safe iterators paused rehashing, they
+  // come between table_[0] and table_[1].
+  std::vector<FlatTable> paused_;
+
+  THasher hash_func_;
+
+ public:
+  using Iterator = FIterator<TKey, TValue, TAllocator, THasher>;
+  template<typename H = THasher, typename = EnableIfDefaultHasher<H>>
+  FlatDictionary() : FlatDictionary(THasher()) {}
+  FlatDictionary(THasher hash_func)
+      : rehashidx_(-1), iterator_count_(0), hash_func_(hash_func) {
+    table_[0].Reset();
+    table_[1].Reset();
+  }
+  FlatDictionary(FlatDictionary&& other);
+  FlatDictionary& operator=(FlatDictionary&& rhs);
+  ~FlatDictionary();
+  inline size_t Size() const {
+    size_t used = table_[0].used + table_[1].used;
+    for (const FlatTable& table : paused_) used += table.used;
+    return used;
+  }
+  inline size_t Capacity() const { return IsRehashing() ? table_[1].size : table_[0].size; }
+  bool Expand(size_t size);
+  bool Shrink();
+  bool Insert(const TKey& key, TValue value);
+  bool Erase(const TKey& key);
+  TValue* Fetch(const TKey& key);
+  TKey* FetchRandom();
+  std::vector<std::pair<TKey*, TValue*>> FetchSome(int count);
+  void Clear();
+  size_t RehashMilliseconds(int ms);
+  size_t MemoryUsage(size_t samples = 5) const;
+  Iterator SafeBegin();
+  Iterator SafeEnd();
+  Iterator Begin();
+  Iterator End();
+  size_t FingerPrint();
+
+ private:
+  inline bool IsRehashing() const { return rehashidx_ != -1; }
+  inline bool IsFull(const FlatTable& table, size_t index) const {
+    return table.ctrl[index] >= 0;
+  }
+  // Tables holding keys, in iteration order: table_[0], paused_, table_[1].
+  inline size_t TableCount() const { return IsRehashing() ? paused_.size() + 2 : 1; }
+  inline FlatTable& TableAt(size_t i) {
+    if (i == 0) return table_[0];
+    return i <= paused_.size() ? paused_[i - 1] : table_[1];
+  }
+  inline const FlatTable& TableAt(size_t i) const {
+    if (i == 0) return table_[0];
+    return i <= paused_.size() ? paused_[i - 1] : table_[1];
+  }
+  // Slots of all tables counted as one array, index is turned into a slot
+  // of the table returned.
+  inline const FlatTable& TableOfSlot(size_t* index) const {
+    size_t i = 0;
+    while (*index >= TableAt(i).size) *index -= TableAt(i++).size;
+    return TableAt(i);
+  }
+  inline size_t TotalSlots() const {
+    size_t total = 0;
+    for (size_t i = 0; i < TableCount(); ++i) total += TableAt(i).size;
+    return total;
+  }
+  void Clear(FlatTable& table);
+  void ExpandIfNeed();
+  void GrowPaused();
+  void MergePaused();
+  void RehashStep();
+  int RehashNStep(int n);
+  FlatEntry* Find(const TKey& key, size_t hash);
+  FlatEntry* FindInTable(const FlatTable& table, const TKey& key, size_t hash) const;
+  size_t FindInsertSlot(const FlatTable& table, size_t hash) const;
+  FlatEntry* InsertSlot(FlatTable& table, size_t hash);
+  void EraseSlot(FlatTable& table, size_t index);
+  static size_t RandomIndex(size_t size);
+
+  void NewTable(FlatTable& table, size_t size) {
+    table.ctrl = static_cast<int8_t*>(TAllocator::AllocateTable(size));
+    table.slots = static_cast<FlatEntry*>(
+        TAllocator::AllocateTable(size * sizeof(FlatEntry)));
+    std::memset(table.ctrl, kFlatEmpty, size);
+    table.size = size;
+    table.sizemask = size - 1;
+    table.used = 0;
+    table.deleted = 0;
+  }
+  void FreeTable(FlatTable& table) {
+    TAllocator::DeallocateTable(table.ctrl, table.size);
+    TAllocator::DeallocateTable(table.slots, table.size * sizeof(FlatEntry));
+  }
+};
+
+template <typename TKey, typename TValue, typename TAllocator, typename THasher>
+class FIterator {
+ private:
+  using TDictionary = FlatDictionary<TKey, TValue, TAllocator, THasher>;
+  TDictionary* dictionary_;
+  int table_index_;
+  int64_t index_;
+  size_t fingerprint_;
+  bool safe_;
+  typename TDictionary::FlatEntry* entry_;
+ public:
+  FIterator(TDictionary* dictionary, bool safe) {
+    dictionary_ = dictionary;
+    table_index_ = 0;
+    index_ = -1;
+    safe_ = safe;
+    entry_ = nullptr;
+  }
+
+  ~FIterator() {
+    if (!(table_index_ == 0 && index_ == -1)) {
+      if (safe_) {
+        dictionary_->iterator_count_--;
+      }
+      else {
+        assert(dictionary_->FingerPrint() == fingerprint_);
+      }
+    }
+  }
+
+  FIterator& operator++() {
+    // If it's the initial iterator.
+    if (table_index_ == 0 && index_ == -1) {
+      if (safe_) dictionary_->iterator_count_++;
+      else fingerprint_ = dictionary_->FingerPrint();
+    }
+    while (true) {
+      // A table set aside by GrowPaused keeps its position in the order.
+      const typename TDictionary::FlatTable* table = &dictionary_->TableAt(table_index_);
+      index_++;
+      if (static_cast<size_t>(index_) >= table->size) {
+        if (static_cast<size_t>(table_index_) + 1 < dictionary_->TableCount()) {
+          table_index_++;
+          index_ = -1;
+          continue;
+        }
+        break;
+      }
+      if (dictionary_->IsFull(*table, index_)) {
+        entry_ = &table->slots[index_];
+        return *this;
+      }
+    }
+    entry_ = nullptr;
+    return *this;
+  }
+
+  FIterator operator++(int) {
+    FIterator temp = *this;
+    ++*this;
+    return temp;
+  }
+
+  bool operator==(const FIterator<TKey, TValue, TAllocator, THasher>& rhs) const {
+    return dictionary_ == rhs.dictionary_ && entry_ == rhs.entry_;
+  }
+
+  bool operator!=(const FIterator<TKey, TValue, TAllocator, THasher>& rhs) const {
+    return !((*this) == rhs);
+  }
+
+  typename TDictionary::FlatEntry& operator*() const {
+    return *entry_;
+  }
+
+  typename TDictionary::FlatEntry* operator->() const {
+    return entry_;
+  }
+};
+
+// The tables are stolen, other is left empty but still usable.
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+FlatDictionary<TKey, TValue, TAllocator, THasher>::FlatDictionary(FlatDictionary&& other)
+    : rehashidx_(other.rehashidx_), iterator_count_(0),
+      paused_(std::move(other.paused_)), hash_func_(other.hash_func_) {
+  table_[0] = other.table_[0];
+  table_[1] = other.table_[1];
+  other.table_[0].Reset();
+  other.table_[1].Reset();
+  other.paused_.clear();
+  other.rehashidx_ = -1;
+}
+
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+FlatDictionary<TKey, TValue, TAllocator, THasher>& FlatDictionary<TKey, TValue, TAllocator, THasher>::operator=(FlatDictionary&& rhs) {
+  if (this == &rhs) return *this;
+  Clear();
+  table_[0] = rhs.table_[0];
+  table_[1] = rhs.table_[1];
+  paused_ = std::move(rhs.paused_);
+  rehashidx_ = rhs.rehashidx_;
+  hash_func_ = rhs.hash_func_;
+  rhs.table_[0].Reset();
+  rhs.table_[1].Reset();
+  rhs.paused_.clear();
+  rhs.rehashidx_ = -1;
+  return *this;
+}
+
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+FlatDictionary<TKey, TValue, TAllocator, THasher>::~FlatDictionary() {
+  Clear(table_[0]);
+  for (FlatTable& table : paused_) Clear(table);
+  Clear(table_[1]);
+}
+
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+void FlatDictionary<TKey, TValue, TAllocator, THasher>::Clear(FlatTable& table) {
+  for (size_t i = 0; i < table.size && table.used > 0; ++i) {
+    if (IsFull(table, i)) {
+      table.slots[i].~FlatEntry();
+      table.used--;
+    }
+  }
+  if (table.ctrl != nullptr) FreeTable(table);
+  table.Reset();
+}
+
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+void FlatDictionary<TKey, TValue, TAllocator, THasher>::Clear() {
+  Clear(table_[0]);
+  for (FlatTable& table : paused_) Clear(table);
+  paused_.clear();
+  Clear(table_[1]);
+  rehashidx_ = -1;
+  iterator_count_ = 0;
+}
+
+/* Resize the table to hold at least size keys, tombstones are dropped on
+ * the way. Return true if expand success, false if nothing happen.
+ */
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+bool FlatDictionary<TKey, TValue, TAllocator, THasher>::Expand(size_t size) {
+  if (IsRehashing() || table_[0].used > size) return false;
+
+  // Every insert moves kFlatRehashSlots slots to the new table, so it must
+  // also fit the keys inserted before rehash is done.
+  size_t need = table_[0].used + table_[0].size / kFlatRehashSlots + 1;
+  size_t realsize = FlatNextPower(size);
+  while (FlatMaxLoad(realsize) < need) realsize *= 2;
+  if (realsize == table_[0].size && table_[0].deleted == 0) return false;
+
+  FlatTable table;
+  NewTable(table, realsize);
+
+  // No need to rehash if table_[0] is empty.
+  if (table_[0].used == 0) {
+    Clear(table_[0]);
+    table_[0] = table;
+    return true;
+  }
+
+  // Prepare for rehashing.
+  table_[1] = table;
+  rehashidx_ = 0;
+  return true;
+}
+
+// Shrink the table to the minimal size which holds all keys.
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+bool FlatDictionary<TKey, TValue, TAllocator, THasher>::Shrink() {
+  if (IsRehashing()) return false;
+  return Expand(table_[0].used + table_[0].used / 7 + 1);
+}
+
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+void FlatDictionary<TKey, TValue, TAllocator, THasher>::ExpandIfNeed() {
+  if (IsRehashing()) {
+    // The new table is sized to take every insert till rehash is done,
+    // unless safe iterators pause rehashing for too long.
+    if (table_[1].used + table_[1].deleted + 1 > FlatMaxLoad(table_[1].size)) {
+      GrowPaused();
+    }
+    return;
+  }
+  if (table_[0].size == 0) {
+    Expand(kFlatInitSize);
+  }
+  else if (table_[0].used + table_[0].deleted + 1 > FlatMaxLoad(table_[0].size)) {
+    // Same size if most of the load is tombstones.
+    Expand(table_[0].used * 2);
+  }
+}
+
+/* Safe iterators hold pointers to entries and positions in the tables,
+ * so nothing may move till they are gone. Set the full table_[1] aside
+ * and take the inserts in a table twice as big, safe iterators visit it
+ * after the ones set aside.
+ */
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+void FlatDictionary<TKey, TValue, TAllocator, THasher>::GrowPaused() {
+  paused_.push_back(table_[1]);
+  NewTable(table_[1], table_[1].size * 2);
+}
+
+/* Move the keys of the tables set aside to table_[1] at once. If they
+ * don't fit along with the keys left in table_[0] and the inserts till
+ * rehash is done, as sized by Expand, table_[1] is set aside as well and
+ * all go to a bigger one.
+ */
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+void FlatDictionary<TKey, TValue, TAllocator, THasher>::MergePaused() {
+  size_t need = Size() + table_[0].size / kFlatRehashSlots + 1;
+  if (table_[1].deleted + need > FlatMaxLoad(table_[1].size)) {
+    size_t size = table_[1].size * 2;
+    while (FlatMaxLoad(size) < need) size *= 2;
+    paused_.push_back(table_[1]);
+    NewTable(table_[1], size);
+  }
+  for (FlatTable& from : paused_) {
+    for (size_t index = 0; index < from.size && from.used > 0; ++index) {
+      if (!IsFull(from, index)) continue;
+      FlatEntry* entry = &from.slots[index];
+      size_t hash = FlatHash(hash_func_, entry->key);
+      new (InsertSlot(table_[1], hash)) FlatEntry(std::move(*entry));
+      entry->~FlatEntry();
+      from.used--;
+    }
+    FreeTable(from);
+  }
+  paused_.clear();
+}
+
+// Search key in all tables, return its entry or null if not found.
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+typename FlatDictionary<TKey, TValue, TAllocator, THasher>::FlatEntry* FlatDictionary<TKey, TValue, TAllocator, THasher>::Find(const TKey& key, size_t hash) {
+  if (table_[0].size == 0) return nullptr;
+  for (size_t i = 0; i < TableCount(); ++i) {
+    FlatEntry* entry = FindInTable(TableAt(i), key, hash);
+    if (entry != nullptr) return entry;
+  }
+  return nullptr;
+}
+
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+typename FlatDictionary<TKey, TValue, TAllocator, THasher>::FlatEntry* FlatDictionary<TKey, TValue, TAllocator, THasher>::FindInTable(const FlatTable& table, const TKey& key, size_t hash) const {
+  uint8_t h2 = FlatH2(hash);
+  size_t group = FlatH1(hash) & table.sizemask & ~(kFlatGroupWidth - 1);
+  // Triangular probing visits every group once when the number of
+  // groups is a power of two, and some group always has an empty slot.
+  for (size_t probe = 1; ; ++probe) {
+    FlatGroup g(table.ctrl + group);
+    for (uint32_t match = g.Match(h2); match != 0; match &= match - 1) {
+      FlatEntry* entry = &table.slots[group + FlatLowestBit(match)];
+      if (entry->key == key) return entry;
+    }
+    if (g.MatchEmpty()) return nullptr;
+    group = (group + probe * kFlatGroupWidth) & table.sizemask;
+  }
+}
+
+// Return the first empty or deleted slot on the probe sequence of hash.
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+size_t FlatDictionary<TKey, TValue, TAllocator, THasher>::FindInsertSlot(const FlatTable& table, size_t hash) const {
+  size_t group = (FlatH1(hash) & table.sizemask) & ~(kFlatGroupWidth - 1);
+  for (size_t probe = 1; ; ++probe) {
+    uint32_t match = FlatGroup(table.ctrl + group).MatchEmptyOrDeleted();
+    if (match != 0) return group + FlatLowestBit(match);
+    group = (group + probe * kFlatGroupWidth) & table.sizemask;
+  }
+}
+
+// Claim a slot for hash in table, the entry is default constructed.
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+typename FlatDictionary<TKey, TValue, TAllocator, THasher>::FlatEntry* FlatDictionary<TKey, TValue, TAllocator, THasher>::InsertSlot(FlatTable& table, size_t hash) {
+  size_t index = FindInsertSlot(table, hash);
+  if (table.ctrl[index] == kFlatDeleted) table.deleted--;
+  table.ctrl[index] = FlatH2(hash);
+  table.used++;
+  return &table.slots[index];
+}
+
+/* Destroy the entry at index. The slot becomes empty again if its group
+ * has an empty slot: a group with an empty slot was never full, so no
+ * probe sequence went through it. Otherwise leave a tombstone.
+ */
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+void FlatDictionary<TKey, TValue, TAllocator, THasher>::EraseSlot(FlatTable& table, size_t index) {
+  table.slots[index].~FlatEntry();
+  size_t group = index & ~(kFlatGroupWidth - 1);
+  if (FlatGroup(table.ctrl + group).MatchEmpty()) {
+    table.ctrl[index] = kFlatEmpty;
+  }
+  else {
+    table.ctrl[index] = kFlatDeleted;
+    table.deleted++;
+  }
+  table.used--;
+}
+
+/* Return true if successfully add key, value to dictionary.
+ * Return false if key already exists.
+ */
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+bool FlatDictionary<TKey, TValue, TAllocator, THasher>::Insert(const TKey& key, TValue value) {
+  if (IsRehashing()) RehashStep();
+
+  size_t hash = FlatHash(hash_func_, key);
+  if (Find(key, hash) != nullptr) return false;
+
+  ExpandIfNeed();
+  FlatEntry* entry = InsertSlot(IsRehashing() ? table_[1] : table_[0], hash);
+  new (entry) FlatEntry{key, std::move(value)};
+  return true;
+}
+
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+bool FlatDictionary<TKey, TValue, TAllocator, THasher>::Erase(const TKey& key) {
+  if (Size() == 0) return false;
+  if (IsRehashing()) RehashStep();
+
+  FlatEntry* entry = Find(key, FlatHash(hash_func_, key));
+  if (entry == nullptr) return false;
+  size_t i = 0;
+  while (entry < TableAt(i).slots || entry >= TableAt(i).slots + TableAt(i).size) ++i;
+  EraseSlot(TableAt(i), entry - TableAt(i).slots);
+  return true;
+}
+
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+TValue* FlatDictionary<TKey, TValue, TAllocator, THasher>::Fetch(const TKey& key) {
+  if (Size() == 0) return nullptr;
+  if (IsRehashing()) RehashStep();
+
+  FlatEntry* entry = Find(key, FlatHash(hash_func_, key));
+  return entry == nullptr ? nullptr : &entry->value;
+}
+
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+void FlatDictionary<TKey, TValue, TAllocator, THasher>::RehashStep() {
+  // Make sure no iterator is iterating the dictionary.
+  if (iterator_count_ == 0) {
+    RehashNStep(1);
+  }
+}
+
+// Move n * kFlatRehashSlots slots of table_[0] to table_[1], after the
+// tables set aside by GrowPaused.
+// Return 1 if rehash is still in progress.
+// Return 0 if rehash is done.
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+int FlatDictionary<TKey, TValue, TAllocator, THasher>::RehashNStep(int n) {
+  if (!IsRehashing()) return 0;
+  if (!paused_.empty()) MergePaused();
+
+  FlatTable& from = table_[0];
+  size_t end = rehashidx_ + n * kFlatRehashSlots;
+  if (end > from.size) end = from.size;
+  for (; static_cast<size_t>(rehashidx_) < end && from.used != 0; ++rehashidx_) {
+    if (!IsFull(from, rehashidx_)) continue;
+
+    FlatEntry* entry = &from.slots[rehashidx_];
+    size_t hash = FlatHash(hash_func_, entry->key);
+    new (InsertSlot(table_[1], hash)) FlatEntry(std::move(*entry));
+    entry->~FlatEntry();
+    // Keep probe sequences of the keys left in table_[0] going.
+    from.ctrl[rehashidx_] = kFlatDeleted;
+    from.deleted++;
+    from.used--;
+  }
+
+  // Check if we rehashed all slots.
+  if (from.used == 0) {
+    FreeTable(from);
+    table_[0] = table_[1];
+    table_[1].Reset();
+    rehashidx_ = -1;
+    return 0;
+  }
+  return 1;
+}
+
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+size_t FlatDictionary<TKey, TValue, TAllocator, THasher>::RehashMilliseconds(int ms) {
+  // Safe iterators must not see entries move.
+  if (iterator_count_ > 0) return 0;
+  auto start = std::chrono::steady_clock::now();
+  size_t rehash_step = 0;
+  while (RehashNStep(100)) {
+    rehash_step += 100;
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - start);
+    if (elapsed.count() > ms) break;
+  }
+  return rehash_step;
+}
+
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+size_t FlatDictionary<TKey, TValue, TAllocator, THasher>::RandomIndex(size_t size) {
+  size_t r = (static_cast<size_t>(std::rand()) << 31) ^ std::rand();
+  return r % size;
+}
+
+// Fetch a random key from dictionary.
+// Return null if no key found.
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+TKey* FlatDictionary<TKey, TValue, TAllocator, THasher>::FetchRandom() {
+  if (Size() == 0) return nullptr;
+  if (IsRehashing()) RehashStep();
+
+  // Every full slot has the same chance, slots of table_[0] before
+  // rehashidx_ are never full.
+  size_t start = IsRehashing() ? rehashidx_ : 0;
+  size_t total = TotalSlots() - start;
+  while (true) {
+    size_t index = start + RandomIndex(total);
+    const FlatTable& table = TableOfSlot(&index);
+    if (IsFull(table, index)) return &table.slots[index].key;
+  }
+}
+
+// Sample some continuous kv pairs from dictionary at a random location,
+// Pairs maybe empty or have less count than given param.
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+std::vector<std::pair<TKey*, TValue*>> FlatDictionary<TKey, TValue, TAllocator, THasher>::FetchSome(int count) {
+  std::vector<std::pair<TKey*, TValue*>> result;
+  size_t used = Size();
+  if (used == 0 || count <= 0) return result;
+  if (used < static_cast<size_t>(count)) count = used;
+  if (IsRehashing()) RehashStep();
+
+  size_t total = TotalSlots();
+  size_t index = RandomIndex(total);
+  size_t max_steps = static_cast<size_t>(count) * 10 * kFlatGroupWidth;
+  for (size_t step = 0; step < max_steps && step < total; ++step) {
+    size_t slot = index;
+    const FlatTable& table = TableOfSlot(&slot);
+    if (IsFull(table, slot)) {
+      result.push_back(std::make_pair(&table.slots[slot].key, &table.slots[slot].value));
+      if (result.size() == static_cast<size_t>(count)) break;
+    }
+    index = (index + 1) % total;
+  }
+  return result;
+}
+
+/* Return bytes used by the dictionary: itself, the tables and the memory
+ * owned by keys and values, which is estimated from samples keys starting
+ * at a random slot, pass 0 to visit every key.
+ */
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+size_t FlatDictionary<TKey, TValue, TAllocator, THasher>::MemoryUsage(size_t samples) const {
+  size_t bytes = sizeof(*this);
+  for (size_t i = 0; i < TableCount(); ++i) {
+    const FlatTable& table = TableAt(i);
+    bytes += TAllocator::TableSize(table.ctrl, table.size);
+    bytes += TAllocator::TableSize(table.slots, table.size * sizeof(FlatEntry));
+  }
+  size_t used = Size();
+  if (used == 0) return bytes;
+  if (samples == 0 || samples > used) samples = used;
+
+  size_t total = TotalSlots();
+  size_t index = RandomIndex(total);
+  size_t sampled = 0;
+  size_t sampled_bytes = 0;
+  for (size_t visited = 0; visited < total && sampled < samples; ++visited) {
+    size_t slot = index;
+    const FlatTable& table = TableOfSlot(&slot);
+    if (IsFull(table, slot)) {
+      sampled_bytes += ObjectMemoryUsage(table.slots[slot].key);
+      sampled_bytes += ObjectMemoryUsage(table.slots[slot].value);
+      sampled++;
+    }
+    index = (index + 1) % total;
+  }
+  if (sampled == used) return bytes + sampled_bytes;
+  return bytes + static_cast<size_t>(
+      static_cast<double>(sampled_bytes) / sampled * used);
+}
+
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+typename FlatDictionary<TKey, TValue, TAllocator, THasher>::Iterator FlatDictionary<TKey, TValue, TAllocator, THasher>::SafeBegin() {
+  Iterator it = Iterator(this, true);
+  it++;
+  return it;
+}
+
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+typename FlatDictionary<TKey, TValue, TAllocator, THasher>::Iterator FlatDictionary<TKey, TValue, TAllocator, THasher>::SafeEnd() {
+  Iterator it = Iterator(this, true);
+  return it;
+}
+
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+typename FlatDictionary<TKey, TValue, TAllocator, THasher>::Iterator FlatDictionary<TKey, TValue, TAllocator, THasher>::Begin() {
+  Iterator it = Iterator(this, false);
+  it++;
+  return it;
+}
+
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+typename FlatDictionary<TKey, TValue, TAllocator, THasher>::Iterator FlatDictionary<TKey, TValue, TAllocator, THasher>::End() {
+  Iterator it = Iterator(this, false);
+  return it;
+}
+
+/* Hash for a dictionary, mainly use pointer, size and used for
+ * two internal tables.
+ */
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+size_t FlatDictionary<TKey, TValue, TAllocator, THasher>::FingerPrint() {
+  size_t integers[6] = {
+    reinterpret_cast<size_t>(table_[0].ctrl),
+    table_[0].size,
+    table_[0].used,
+    reinterpret_cast<size_t>(table_[1].ctrl),
+    table_[1].size,
+    table_[1].used
+  };
+
+  size_t hash = 0;
+  for (int i = 0; i < 6; ++i) {
+    hash += integers[i];
+    /* Tomas Wang's 64 bit integer hash, as in Dictionary::FingerPrint. */
+    hash = (~hash) + (hash << 21);
+    hash = hash ^ (hash >> 24);
+    hash = (hash + (hash << 3)) + (hash << 8);
+    hash = hash ^ (hash >> 14);
+    hash = (hash + (hash << 2)) + (hash << 4);
+    hash = hash ^ (hash >> 28);
+    hash = hash + (hash << 31);
+  }
+  return hash;
+}
+
+/* For tables keyed by int64 IDs: keys sit inline in the slot array next
+ * to their values, with no entry to chase, and are hashed by the inlined
+ * IntHasher only. Rehash, FetchRandom and FetchSome work as for any
+ * FlatDictionary.
+ */
+template<typename TValue, typename TAllocator = ZmallocAllocator>
+using IntDictionary = FlatDictionary<int64_t, TValue, TAllocator, IntHasher>;
+
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+inline size_t ObjectMemoryUsage(const FlatDictionary<TKey, TValue, TAllocator, THasher>& dict) {
+  return dict.MemoryUsage() - sizeof(dict);
+}
+
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+inline size_t ObjectFreeEffort(const FlatDictionary<TKey, TValue, TAllocator, THasher>& dict) {
+  return dict.Size();
+}
+
+}
+
+#endif
@@ -0,0 +1,246 @@
+#include "mredis/src/hash.h"
+
+#include <cstring>
+#include <random>
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+// Built for AVX2 even if the rest is not, used if the cpu has it.
+#define MREDIS_HASH_AVX2 __attribute__((target("avx2")))
+// Have xxhash.h define its AVX2 kernels next to the default ones, like
+// its own xxh_x86dispatch.c does.
+#define XXH_DISPATCH_AVX2 1
+#define XXH_TARGET_AVX2 MREDIS_HASH_AVX2
+// The AVX2 kernels load the accumulator and secret 32 byte aligned.
+#define XXH_ACC_ALIGN 32
+#endif
+// Everything static in this file, nothing is exported.
+#define XXH_INLINE_ALL
+#include <xxhash/xxhash.h>
+
+namespace mredis {
+
+namespace {
+  class HashKeyHolder {
+   public:
+    HashKeyHolder() {
+      std::random_device random;
+      for (size_t i = 0; i < kHashKeySize; i += 4) {
+        uint32_t r = random();
+        std::memcpy(key_ + i, &r, 4);
+      }
+    }
+    uint8_t* Key() { return key_; }
+   private:
+    uint8_t key_[kHashKeySize];
+  };
+
+  uint8_t* MutableHashKey() {
+    static HashKeyHolder holder;
+    return holder.Key();
+  }
+
+  inline uint64_t Read64(const uint8_t* p) {
+    uint64_t v;
+    std::memcpy(&v, p, 8);
+    return v;
+  }
+
+  inline uint64_t Read32(const uint8_t* p) {
+    uint32_t v;
+    std::memcpy(&v, p, 4);
+    return v;
+  }
+
+  inline uint64_t Rotl(uint64_t x, int b) {
+    return (x << b) | (x >> (64 - b));
+  }
+
+  class SipState {
+   public:
+    explicit SipState(const uint8_t* key) {
+      uint64_t k0 = Read64(key);
+      uint64_t k1 = Read64(key + 8);
+      v0_ = 0x736f6d6570736575ULL ^ k0;
+      v1_ = 0x646f72616e646f6dULL ^ k1;
+      v2_ = 0x6c7967656e657261ULL ^ k0;
+      v3_ = 0x7465646279746573ULL ^ k1;
+    }
+
+    void Round() {
+      v0_ += v1_; v1_ = Rotl(v1_, 13); v1_ ^= v0_; v0_ = Rotl(v0_, 32);
+      v2_ += v3_; v3_ = Rotl(v3_, 16); v3_ ^= v2_;
+      v0_ += v3_; v3_ = Rotl(v3_, 21); v3_ ^= v0_;
+      v2_ += v1_; v1_ = Rotl(v1_, 17); v1_ ^= v2_; v2_ = Rotl(v2_, 32);
+    }
+
+    void Compress(uint64_t m, int rounds) {
+      v3_ ^= m;
+      for (int i = 0; i < rounds; ++i) Round();
+      v0_ ^= m;
+    }
+
+    uint64_t Finalize(int rounds) {
+      v2_ ^= 0xff;
+      for (int i = 0; i < rounds; ++i) Round();
+      return v0_ ^ v1_ ^ v2_ ^ v3_;
+    }
+
+   private:
+    uint64_t v0_, v1_, v2_, v3_;
+  };
+
+  // SipHash-c-d, c rounds per 8 byte word and d rounds to finalize.
+  uint64_t SipHashRounds(const void* data, size_t len, const uint8_t* key, int c, int d) {
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    const uint8_t* end = p + (len & ~static_cast<size_t>(7));
+    SipState state(key);
+    for (; p != end; p += 8) {
+      state.Compress(Read64(p), c);
+    }
+
+    // The last word holds the remaining bytes and len in the top byte.
+    uint64_t last = static_cast<uint64_t>(len) << 56;
+    for (size_t i = 0; i < (len & 7); ++i) {
+      last |= static_cast<uint64_t>(p[i]) << (8 * i);
+    }
+    state.Compress(last, c);
+    return state.Finalize(d);
+  }
+
+  const uint64_t kWyP0 = 0x2d358dccaa6c78a5ULL;
+  const uint64_t kWyP1 = 0x8bb84b93962eacc9ULL;
+  const uint64_t kWyP2 = 0x4b33a62ed433d4a3ULL;
+  const uint64_t kWyP3 = 0x4d5a2da51de1aa47ULL;
+
+  // 64x64 -> 128 bit multiply, low half in a and high half in b.
+  inline void WyMum(uint64_t* a, uint64_t* b) {
+    __uint128_t r = *a;
+    r *= *b;
+    *a = static_cast<uint64_t>(r);
+    *b = static_cast<uint64_t>(r >> 64);
+  }
+
+  inline uint64_t WyMix(uint64_t a, uint64_t b) {
+    WyMum(&a, &b);
+    return a ^ b;
+  }
+
+  typedef XXH64_hash_t (*Xxh3LongFunc)(const void*, size_t, XXH64_hash_t, const xxh_u8*, size_t);
+
+  // XXH3 of keys over 240 bytes, the only ones which use the vector
+  // kernels. Not inlined, as upstream advises for the long loop.
+  XXH_NO_INLINE XXH64_hash_t Xxh3LongDefault(const void* data, size_t len, XXH64_hash_t seed,
+                                             const xxh_u8* secret, size_t secret_len) {
+    (void)secret;
+    (void)secret_len;
+    return XXH3_hashLong_64b_withSeed_internal(data, len, seed, XXH3_accumulate,
+                                               XXH3_scrambleAcc, XXH3_initCustomSecret);
+  }
+
+#ifdef MREDIS_HASH_AVX2
+  XXH_NO_INLINE MREDIS_HASH_AVX2 XXH64_hash_t Xxh3LongAvx2(const void* data, size_t len, XXH64_hash_t seed,
+                                                           const xxh_u8* secret, size_t secret_len) {
+    (void)secret;
+    (void)secret_len;
+    return XXH3_hashLong_64b_withSeed_internal(data, len, seed, XXH3_accumulate_avx2,
+                                               XXH3_scrambleAcc_avx2, XXH3_initCustomSecret_avx2);
+  }
+#endif
+
+  Xxh3LongFunc Xxh3Long(HashSimd simd) {
+#ifdef MREDIS_HASH_AVX2
+    if (simd == HashSimd::kAvx2) return Xxh3LongAvx2;
+#endif
+    (void)simd;
+    return Xxh3LongDefault;
+  }
+
+  inline uint64_t Xxh3HashWith(const void* data, size_t len, uint64_t seed, Xxh3LongFunc hash_long) {
+    return XXH3_64bits_internal(data, len, seed, XXH3_kSecret, sizeof(XXH3_kSecret), hash_long);
+  }
+}
+
+const uint8_t* HashKey() {
+  return MutableHashKey();
+}
+
+uint64_t HashSeed() {
+  return Read64(MutableHashKey());
+}
+
+void SetHashKey(const uint8_t* key) {
+  std::memcpy(MutableHashKey(), key, kHashKeySize);
+}
+
+uint64_t SipHash(const void* data, size_t len, const uint8_t* key) {
+  return SipHashRounds(data, len, key, 2, 4);
+}
+
+uint64_t SipHash13(const void* data, size_t len, const uint8_t* key) {
+  return SipHashRounds(data, len, key, 1, 3);
+}
+
+uint64_t WyHash(const void* data, size_t len, uint64_t seed) {
+  const uint8_t* p = static_cast<const uint8_t*>(data);
+  seed ^= WyMix(seed ^ kWyP0, kWyP1);
+  uint64_t a, b;
+  if (len <= 16) {
+    if (len >= 4) {
+      a = (Read32(p) << 32) | Read32(p + ((len >> 3) << 2));
+      b = (Read32(p + len - 4) << 32) | Read32(p + len - 4 - ((len >> 3) << 2));
+    }
+    else if (len > 0) {
+      a = (static_cast<uint64_t>(p[0]) << 16) | (static_cast<uint64_t>(p[len >> 1]) << 8) | p[len - 1];
+      b = 0;
+    }
+    else {
+      a = b = 0;
+    }
+  }
+  else {
+    size_t i = len;
+    if (i > 48) {
+      uint64_t see1 = seed, see2 = seed;
+      do {
+        seed = WyMix(Read64(p) ^ kWyP1, Read64(p + 8) ^ seed);
+        see1 = WyMix(Read64(p + 16) ^ kWyP2, Read64(p + 24) ^ see1);
+        see2 = WyMix(Read64(p + 32) ^ kWyP3, Read64(p + 40) ^ see2);
+        p += 48;
+        i -= 48;
+      } while (i > 48);
+      seed ^= see1 ^ see2;
+    }
+    while (i > 16) {
+      seed = WyMix(Read64(p) ^ kWyP1, Read64(p + 8) ^ seed);
+      i -= 16;
+      p += 16;
+    }
+    a = Read64(p + i - 16);
+    b = Read64(p + i - 8);
+  }
+  a ^= kWyP1;
+  b ^= seed;
+  WyMum(&a, &b);
+  return WyMix(a ^ kWyP0 ^ len, b ^ kWyP1);
+}
+
+bool HashSimdSupported(HashSimd simd) {
+  if (simd == HashSimd::kDefault) return true;
+#ifdef MREDIS_HASH_AVX2
+  return __builtin_cpu_supports("avx2");
+#else
+  return false;
+#endif
+}
+
+uint64_t Xxh3Hash(const void* data, size_t len, uint64_t seed) {
+  static const Xxh3LongFunc hash_long = Xxh3Long(
+      HashSimdSupported(HashSimd::kAvx2) ? HashSimd::kAvx2 : HashSimd::kDefault);
+  return Xxh3HashWith(data, len, seed, hash_long);
+}
+
+uint64_t Xxh3Hash(const void* data, size_t len, uint64_t seed, HashSimd simd) {
+  return Xxh3HashWith(data, len, seed, Xxh3Long(simd));
+}
+
+}
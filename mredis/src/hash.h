@@ -0,0 +1,114 @@
+#ifndef MREDIS_SRC_HASH_H_
+#define MREDIS_SRC_HASH_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <type_traits>
+
+/* 64 bit keyed hash functions for dictionary keys.
+ *
+ * MurmurHash2 in dict.h gives 32 bits, and its seed doesn't stop a client
+ * who knows the function from sending keys which all land in one bucket
+ * (hash flooding). SipHash is a keyed pseudo random function: without the
+ * key, colliding keys can't be found faster than by brute force, so keys
+ * coming from clients should be hashed by it.
+ *
+ * FastHash is wyhash for short keys and XXH3 for long ones. It's much
+ * faster, but only seeded, not flooding resistant, so it's for tables
+ * whose keys we control.
+ *
+ * Both are keyed by HashKey(), 16 random bytes drawn once per process.
+ * Like MurmurHash2 they read the input as little endian words.
+ */
+namespace mredis {
+
+const size_t kHashKeySize = 16;
+// FastHash uses XXH3 for keys longer than this.
+const size_t kHashLongThreshold = 512;
+
+// The key of this process, random unless SetHashKey() is called.
+const uint8_t* HashKey();
+// The first 8 bytes of HashKey() as the seed of FastHash.
+uint64_t HashSeed();
+// Set kHashKeySize bytes of key, for reproducible hashes. Must be called
+// before any dictionary is filled, or their keys can't be found anymore.
+void SetHashKey(const uint8_t* key);
+
+// SipHash-2-4 by Jean-Philippe Aumasson and Daniel J. Bernstein.
+uint64_t SipHash(const void* data, size_t len, const uint8_t* key);
+// SipHash-1-3, about twice as fast, still believed flooding resistant.
+uint64_t SipHash13(const void* data, size_t len, const uint8_t* key);
+
+// wyhash (final version 4) by Wang Yi.
+uint64_t WyHash(const void* data, size_t len, uint64_t seed);
+
+// Vector instructions XXH3 hashes keys over 240 bytes with. kDefault is
+// what the build targets, SSE2 on x86-64.
+enum class HashSimd { kDefault, kAvx2 };
+// Whether both the build and the cpu can run simd.
+bool HashSimdSupported(HashSimd simd);
+// XXH3-64 of xxHash 0.8.2 by Yann Collet, vendored in thirdparty. Uses
+// AVX2 if the cpu has it, the result is the same on every simd.
+uint64_t Xxh3Hash(const void* data, size_t len, uint64_t seed);
+// Same on the given simd, which must be supported. For tests.
+uint64_t Xxh3Hash(const void* data, size_t len, uint64_t seed, HashSimd simd);
+
+// WyHash or Xxh3Hash by len.
+inline uint64_t FastHash(const void* data, size_t len, uint64_t seed) {
+  return len > kHashLongThreshold ? Xxh3Hash(data, len, seed) : WyHash(data, len, seed);
+}
+
+// A default constructed std::function is empty and throws when called, so
+// containers are only default constructible with other hashers.
+template<typename THasher>
+struct IsFunctionHasher : std::false_type {};
+template<typename TResult, typename... TArgs>
+struct IsFunctionHasher<std::function<TResult(TArgs...)>> : std::true_type {};
+template<typename THasher>
+using EnableIfDefaultHasher =
+    typename std::enable_if<!IsFunctionHasher<THasher>::value>::type;
+
+/* Hash policies for the THasher parameter of Dictionary, for keys with
+ * data() and size() like the ones in dict.h. */
+struct SipHasher {
+  template<typename TKey>
+  size_t operator()(const TKey& key) const {
+    return static_cast<size_t>(SipHash13(key.data(), key.size(), HashKey()));
+  }
+};
+
+struct FastHasher {
+  template<typename TKey>
+  size_t operator()(const TKey& key) const {
+    return static_cast<size_t>(FastHash(key.data(), key.size(), HashSeed()));
+  }
+};
+
+// 2^64 / golden ratio.
+const uint64_t kFibonacciMultiplier = 0x9E3779B97F4A7C15ull;
+
+/* Fibonacci hashing: one multiply by 2^64 / golden ratio, then the well
+ * mixed high half is folded into the low bits buckets are taken from.
+ * The high half alone, FibonacciMix(x) >> 32, is as well mixed.
+ */
+inline uint64_t FibonacciMix(uint64_t x) {
+  uint64_t h = x * kFibonacciMultiplier;
+  return h ^ (h >> 32);
+}
+
+/* FibonacciMix for integer keys. Inlined, unlike std::hash through
+ * std::function, and unlike std::hash<long> (the identity) keys with a
+ * common stride don't pile up in a few buckets. Not keyed, for IDs we
+ * assign, not client strings.
+ */
+struct IntHasher {
+  template<typename TKey>
+  size_t operator()(TKey key) const {
+    return static_cast<size_t>(FibonacciMix(static_cast<uint64_t>(key)));
+  }
+};
+
+}
+
+#endif
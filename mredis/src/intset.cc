@@ -31,6 +31,10 @@ Intset::Intset() {
   contents = nullptr;
 }
 
+Intset::~Intset() {
+  if (contents != nullptr) zfree(contents, length_ * encoding_);
+}
+
 bool Intset::Add(int64_t value) {
   // Upgrade and add the element if value encoding is larger than current.
   auto value_encoding = ValueEncoding(value);
@@ -19,6 +19,9 @@ namespace mredis {
     int8_t* contents;
    public:
     Intset();
+    Intset(const Intset& other) = delete;
+    Intset& operator=(const Intset& rhs) = delete;
+    ~Intset();
     bool Add(int64_t value);
     bool Remove(int64_t value);
     bool Find(int64_t value) const;
@@ -0,0 +1,99 @@
+#include "mredis/src/lazyfree.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+namespace mredis {
+
+namespace {
+  std::atomic<size_t> lazyfree_pending(0);
+  std::atomic<size_t> lazyfree_freed(0);
+
+  class LazyfreeWorker {
+   public:
+    LazyfreeWorker() : stop_(false), busy_(false) {
+      // Memory is freed from two threads from now on.
+      zmalloc_enable_thread_safeness();
+      thread_ = std::thread(&LazyfreeWorker::Run, this);
+    }
+
+    // Free what's left before exit.
+    ~LazyfreeWorker() {
+      {
+        std::lock_guard<std::mutex> guard(lock_);
+        stop_ = true;
+      }
+      cond_.notify_one();
+      thread_.join();
+    }
+
+    void Submit(std::function<void()> job) {
+      lazyfree_pending++;
+      {
+        std::lock_guard<std::mutex> guard(lock_);
+        jobs_.push_back(std::move(job));
+      }
+      cond_.notify_one();
+    }
+
+    void Wait() {
+      std::unique_lock<std::mutex> guard(lock_);
+      idle_cond_.wait(guard, [this]() { return jobs_.empty() && !busy_; });
+    }
+
+   private:
+    void Run() {
+      std::unique_lock<std::mutex> guard(lock_);
+      while (true) {
+        cond_.wait(guard, [this]() { return stop_ || !jobs_.empty(); });
+        if (jobs_.empty()) break;
+
+        std::function<void()> job = std::move(jobs_.front());
+        jobs_.pop_front();
+        busy_ = true;
+        guard.unlock();
+        job();
+        lazyfree_pending--;
+        lazyfree_freed++;
+        guard.lock();
+        busy_ = false;
+        if (jobs_.empty()) idle_cond_.notify_all();
+      }
+    }
+
+    std::mutex lock_;
+    std::condition_variable cond_;
+    std::condition_variable idle_cond_;
+    std::deque<std::function<void()>> jobs_;
+    bool stop_;
+    bool busy_;
+    std::thread thread_;
+  };
+
+  LazyfreeWorker& Worker() {
+    static LazyfreeWorker worker;
+    return worker;
+  }
+}
+
+void LazyfreeSubmit(std::function<void()> job) {
+  Worker().Submit(std::move(job));
+}
+
+size_t LazyfreePendingObjects() {
+  return lazyfree_pending.load();
+}
+
+size_t LazyfreeFreedObjects() {
+  return lazyfree_freed.load();
+}
+
+void LazyfreeWait() {
+  if (lazyfree_pending.load() == 0) return;
+  Worker().Wait();
+}
+
+}
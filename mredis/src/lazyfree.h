@@ -0,0 +1,68 @@
+#ifndef MREDIS_SRC_LAZYFREE_H_
+#define MREDIS_SRC_LAZYFREE_H_
+
+#include <cstddef>
+#include <functional>
+#include <new>
+#include <utility>
+
+#include "mredis/src/dict.h"
+#include "mredis/src/object_traits.h"
+#include "mredis/src/zmalloc.h"
+
+/* Lazy free: destroy large objects on a background thread.
+ *
+ * Freeing a value with millions of elements takes hundreds of ms. Instead
+ * the value is moved out of its container on the caller's thread, which
+ * is O(1), and destroyed later by the lazyfree thread. Small objects are
+ * cheaper to free right away than to hand over, ObjectFreeEffort() tells
+ * them apart.
+ */
+namespace mredis {
+
+// Objects taking more allocations than this to free go to the background.
+const size_t kLazyfreeThreshold = 64;
+
+// Run job on the lazyfree thread, which is started on first use.
+void LazyfreeSubmit(std::function<void()> job);
+// Objects submitted but not freed yet.
+size_t LazyfreePendingObjects();
+// Objects freed by the lazyfree thread since start.
+size_t LazyfreeFreedObjects();
+// Block until every submitted object is freed.
+void LazyfreeWait();
+
+/* Free the content of object in the background if it's large, object is
+ * left moved from. Return false if object is small, and nothing is done.
+ */
+template <typename T>
+bool LazyfreeObject(T& object) {
+  if (ObjectFreeEffort(object) <= kLazyfreeThreshold) return false;
+
+  T* holder = new (zmalloc(sizeof(T))) T(std::move(object));
+  LazyfreeSubmit([holder]() {
+    holder->~T();
+    zfree(holder, sizeof(T));
+  });
+  return true;
+}
+
+// Like Dictionary::Erase, but a large value is freed in the background.
+template <typename TKey, typename TValue, typename TAllocator, typename THasher>
+bool LazyfreeErase(Dictionary<TKey, TValue, TAllocator, THasher>& dict, const TKey& key) {
+  auto entry = dict.Unlink(key);
+  if (entry == nullptr) return false;
+  LazyfreeObject(entry->value);
+  dict.FreeUnlinkedEntry(entry);
+  return true;
+}
+
+// Like Dictionary::Clear, but a large dictionary is freed in the background.
+template <typename TKey, typename TValue, typename TAllocator, typename THasher>
+void LazyfreeClear(Dictionary<TKey, TValue, TAllocator, THasher>& dict) {
+  if (!LazyfreeObject(dict)) dict.Clear();
+}
+
+}
+
+#endif
@@ -0,0 +1,389 @@
+#ifndef MREDIS_SRC_LOCKFREE_DICT_H_
+#define MREDIS_SRC_LOCKFREE_DICT_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <new>
+
+#include "mredis/src/allocator.h"
+#include "mredis/src/dict.h"
+#include "mredis/src/epoch.h"
+#include "mredis/src/zmalloc.h"
+
+/* A chained hash table like Dictionary whose readers take no lock.
+ *
+ * Readers walk buckets with acquire loads inside an EpochGuard. Writers
+ * are serialized by a mutex and publish every change with one release
+ * store of a bucket or next pointer, so a reader sees a chain either
+ * before or after a change, never in between. Published entries are never
+ * written again: Replace links a new entry in place of the old one, and
+ * unlinked entries and old tables go through EpochRetire, so a reader
+ * still on them is safe until it leaves its guard.
+ *
+ * Rehash is incremental as in Dictionary. While it's in progress the old
+ * table points to the new one by next, and a reader looks in the old
+ * table first, then in the new one. A bucket is moved by linking copies
+ * of its entries into the new table before the old bucket is cleared, so
+ * a reader finds a key in one of the two at any moment. When the old
+ * table is empty the new one is published in its place.
+ *
+ * Values are copied out by Fetch, TValue must be copyable.
+ */
+namespace mredis {
+
+template<typename TKey, typename TValue, typename TAllocator = ZmallocAllocator,
+         typename THasher = std::function<size_t(const TKey&)>>
+class LockFreeDictionary {
+ private:
+  struct DictEntry {
+    DictEntry(const TKey& k, const TValue& v, size_t h, DictEntry* n)
+        : key(k), value(v), hash(h), next(n) {}
+    const TKey key;
+    const TValue value;
+    const size_t hash;
+    std::atomic<DictEntry*> next;
+  };
+
+  struct DictTable {
+    std::atomic<DictEntry*>* table;
+    size_t size;
+    size_t sizemask;
+    // Written by the writer only.
+    size_t used;
+    // The table being rehashed into, nullptr if none.
+    std::atomic<DictTable*> next;
+  };
+
+ public:
+  template<typename H = THasher, typename = EnableIfDefaultHasher<H>>
+  LockFreeDictionary() : LockFreeDictionary(THasher()) {}
+  LockFreeDictionary(THasher hash_func);
+  ~LockFreeDictionary();
+  LockFreeDictionary(const LockFreeDictionary&) = delete;
+  LockFreeDictionary& operator=(const LockFreeDictionary&) = delete;
+
+  inline size_t Size() const { return size_.load(std::memory_order_relaxed); }
+  void SetResizePolicy(const DictResizePolicy& policy);
+  bool Expand(size_t size);
+  bool Insert(const TKey& key, TValue value);
+  bool Replace(const TKey& key, TValue value);
+  bool Erase(const TKey& key);
+  bool Fetch(const TKey& key, TValue* value) const;
+  size_t RehashMilliseconds(int ms);
+
+ private:
+  inline bool IsRehashing() const { return rehashidx_ != -1; }
+  inline DictTable* Head() const { return head_.load(std::memory_order_relaxed); }
+  inline DictTable* Target() const {
+    DictTable* head = Head();
+    return IsRehashing() ? head->next.load(std::memory_order_relaxed) : head;
+  }
+  bool ExpandLocked(size_t size);
+  bool ExpandIfNeed();
+  int RehashNStep(int n);
+  void FinishRehash();
+  std::atomic<DictEntry*>* FindLink(const TKey& key, size_t hash, DictTable** owner);
+
+  DictEntry* NewEntry(const TKey& key, const TValue& value, size_t hash, DictEntry* next) {
+    return new (TAllocator::Allocate(sizeof(DictEntry))) DictEntry(key, value, hash, next);
+  }
+  static void FreeEntry(DictEntry* entry) {
+    entry->~DictEntry();
+    TAllocator::Deallocate(entry, sizeof(DictEntry));
+  }
+  static void FreeTable(DictTable* dict) {
+    TAllocator::DeallocateTable(dict->table, dict->size * sizeof(std::atomic<DictEntry*>));
+    dict->~DictTable();
+    TAllocator::Deallocate(dict, sizeof(DictTable));
+  }
+  // Free once the readers which may see it are gone.
+  static void RetireEntry(DictEntry* entry) {
+    EpochRetire([entry]() { FreeEntry(entry); });
+  }
+  // Free a chain of entries following next, with one retire.
+  static void RetireChain(DictEntry* entry) {
+    EpochRetire([entry]() {
+      DictEntry* next = entry;
+      while (next != nullptr) {
+        DictEntry* current = next;
+        next = current->next.load(std::memory_order_relaxed);
+        FreeEntry(current);
+      }
+    });
+  }
+  static void RetireTable(DictTable* dict) {
+    EpochRetire([dict]() { FreeTable(dict); });
+  }
+
+  std::atomic<DictTable*> head_;
+  std::atomic<size_t> size_;
+  long rehashidx_;
+  DictResizePolicy policy_;
+  std::mutex write_lock_;
+  THasher hash_func_;
+};
+
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+LockFreeDictionary<TKey, TValue, TAllocator, THasher>::LockFreeDictionary(THasher hash_func)
+    : head_(nullptr), size_(0), rehashidx_(-1), hash_func_(hash_func) {
+  // Retired memory is freed on whatever thread reclaims it.
+  zmalloc_enable_thread_safeness();
+}
+
+// No reader may be left, everything is freed right away.
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+LockFreeDictionary<TKey, TValue, TAllocator, THasher>::~LockFreeDictionary() {
+  DictTable* dict = Head();
+  while (dict != nullptr) {
+    for (size_t i = 0; i < dict->size; ++i) {
+      DictEntry* entry = dict->table[i].load(std::memory_order_relaxed);
+      while (entry != nullptr) {
+        DictEntry* next = entry->next.load(std::memory_order_relaxed);
+        FreeEntry(entry);
+        entry = next;
+      }
+    }
+    DictTable* next = dict->next.load(std::memory_order_relaxed);
+    FreeTable(dict);
+    dict = next;
+  }
+}
+
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+void LockFreeDictionary<TKey, TValue, TAllocator, THasher>::SetResizePolicy(const DictResizePolicy& policy) {
+  std::lock_guard<std::mutex> guard(write_lock_);
+  policy_ = policy;
+}
+
+/* Start rehashing into a table of the given size, like Dictionary::Expand.
+ * Return true if expand success, false if nothing happen.
+ */
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+bool LockFreeDictionary<TKey, TValue, TAllocator, THasher>::Expand(size_t size) {
+  std::lock_guard<std::mutex> guard(write_lock_);
+  return ExpandLocked(size);
+}
+
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+bool LockFreeDictionary<TKey, TValue, TAllocator, THasher>::ExpandLocked(size_t size) {
+  if (IsRehashing() || Size() > size) return false;
+
+  size_t realsize = NextPower(size);
+  DictTable* head = Head();
+  if (head != nullptr && realsize == head->size) return false;
+
+  DictTable* dict = new (TAllocator::Allocate(sizeof(DictTable))) DictTable;
+  dict->table = static_cast<std::atomic<DictEntry*>*>(
+      TAllocator::AllocateTable(realsize * sizeof(std::atomic<DictEntry*>)));
+  dict->size = realsize;
+  dict->sizemask = realsize - 1;
+  dict->used = 0;
+  dict->next.store(nullptr, std::memory_order_relaxed);
+
+  if (head == nullptr) {
+    head_.store(dict, std::memory_order_release);
+    return true;
+  }
+  // Readers reach the new table through the old one from now on.
+  head->next.store(dict, std::memory_order_release);
+  rehashidx_ = 0;
+  return true;
+}
+
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+bool LockFreeDictionary<TKey, TValue, TAllocator, THasher>::ExpandIfNeed() {
+  if (IsRehashing()) return true;
+
+  DictTable* head = Head();
+  if (head == nullptr) return ExpandLocked(kTableInitSize);
+
+  if (policy_.NeedGrow(head->used, head->size)) {
+    return ExpandLocked(policy_.GrowSize(head->used));
+  }
+  return true;
+}
+
+/* Move n non-empty buckets to the new table, like Dictionary::RehashNStep.
+ * Return 1 if rehash is still in progress, 0 if rehash is done.
+ */
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+int LockFreeDictionary<TKey, TValue, TAllocator, THasher>::RehashNStep(int n) {
+  if (!IsRehashing()) return 0;
+
+  DictTable* from = Head();
+  DictTable* to = from->next.load(std::memory_order_relaxed);
+  int empty_vists = n * 10;
+  while (n-- && from->used != 0) {
+    while (from->table[rehashidx_].load(std::memory_order_relaxed) == nullptr) {
+      rehashidx_++;
+      if (--empty_vists == 0) return 1;
+    }
+
+    // Link copies into the new table first, then clear the old bucket, so
+    // a reader between the two finds the keys in either.
+    std::atomic<DictEntry*>& bucket = from->table[rehashidx_++];
+    DictEntry* entry = bucket.load(std::memory_order_relaxed);
+    DictEntry* moved = entry;
+    while (entry != nullptr) {
+      std::atomic<DictEntry*>& slot = to->table[entry->hash & to->sizemask];
+      DictEntry* copy = NewEntry(entry->key, entry->value, entry->hash,
+                                 slot.load(std::memory_order_relaxed));
+      slot.store(copy, std::memory_order_release);
+      from->used--;
+      to->used++;
+      entry = entry->next.load(std::memory_order_relaxed);
+    }
+    bucket.store(nullptr, std::memory_order_release);
+    RetireChain(moved);
+  }
+
+  if (from->used == 0) {
+    FinishRehash();
+    return 0;
+  }
+  return 1;
+}
+
+// Publish the new table, readers still on the old one go on to it by next.
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+void LockFreeDictionary<TKey, TValue, TAllocator, THasher>::FinishRehash() {
+  DictTable* from = Head();
+  head_.store(from->next.load(std::memory_order_relaxed), std::memory_order_release);
+  rehashidx_ = -1;
+  RetireTable(from);
+}
+
+/* Return the pointer to the entry of key, the bucket or the next of the
+ * entry before it, and set owner to its table.
+ * Return nullptr if key is not found.
+ */
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+std::atomic<typename LockFreeDictionary<TKey, TValue, TAllocator, THasher>::DictEntry*>*
+LockFreeDictionary<TKey, TValue, TAllocator, THasher>::FindLink(const TKey& key, size_t hash, DictTable** owner) {
+  for (DictTable* dict = Head(); dict != nullptr;
+       dict = dict->next.load(std::memory_order_relaxed)) {
+    std::atomic<DictEntry*>* link = &dict->table[hash & dict->sizemask];
+    DictEntry* entry;
+    while ((entry = link->load(std::memory_order_relaxed)) != nullptr) {
+      if (entry->hash == hash && entry->key == key) {
+        *owner = dict;
+        return link;
+      }
+      link = &entry->next;
+    }
+  }
+  return nullptr;
+}
+
+// Return false if key already exists.
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+bool LockFreeDictionary<TKey, TValue, TAllocator, THasher>::Insert(const TKey& key, TValue value) {
+  std::lock_guard<std::mutex> guard(write_lock_);
+  RehashNStep(1);
+  ExpandIfNeed();
+
+  size_t hash = hash_func_(key);
+  DictTable* owner;
+  if (FindLink(key, hash, &owner) != nullptr) return false;
+
+  DictTable* dict = Target();
+  std::atomic<DictEntry*>& bucket = dict->table[hash & dict->sizemask];
+  DictEntry* entry = NewEntry(key, value, hash, bucket.load(std::memory_order_relaxed));
+  bucket.store(entry, std::memory_order_release);
+  dict->used++;
+  size_.fetch_add(1, std::memory_order_relaxed);
+  return true;
+}
+
+/* Return true if we add a new entry.
+ * Return false if we replace the value of an old entry.
+ */
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+bool LockFreeDictionary<TKey, TValue, TAllocator, THasher>::Replace(const TKey& key, TValue value) {
+  std::unique_lock<std::mutex> guard(write_lock_);
+  size_t hash = hash_func_(key);
+  DictTable* owner;
+  std::atomic<DictEntry*>* link = FindLink(key, hash, &owner);
+  if (link == nullptr) {
+    guard.unlock();
+    return Insert(key, value);
+  }
+
+  // Readers see either the old value or the new one, never half of one.
+  DictEntry* old = link->load(std::memory_order_relaxed);
+  DictEntry* entry = NewEntry(key, value, hash, old->next.load(std::memory_order_relaxed));
+  link->store(entry, std::memory_order_release);
+  RetireEntry(old);
+  return false;
+}
+
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+bool LockFreeDictionary<TKey, TValue, TAllocator, THasher>::Erase(const TKey& key) {
+  std::lock_guard<std::mutex> guard(write_lock_);
+  RehashNStep(1);
+
+  size_t hash = hash_func_(key);
+  DictTable* owner;
+  std::atomic<DictEntry*>* link = FindLink(key, hash, &owner);
+  if (link == nullptr) return false;
+
+  // The next of the entry is kept, a reader on it goes on along the chain.
+  DictEntry* entry = link->load(std::memory_order_relaxed);
+  link->store(entry->next.load(std::memory_order_relaxed), std::memory_order_release);
+  owner->used--;
+  size_.fetch_sub(1, std::memory_order_relaxed);
+  RetireEntry(entry);
+
+  DictTable* head = Head();
+  if (!IsRehashing() && policy_.NeedShrink(head->used, head->size)) {
+    ExpandLocked(policy_.ShrinkSize(head->used));
+  }
+  return true;
+}
+
+// Copy the value of key to value. Return false if key is not found.
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+bool LockFreeDictionary<TKey, TValue, TAllocator, THasher>::Fetch(const TKey& key, TValue* value) const {
+  EpochGuard guard;
+  size_t hash = hash_func_(key);
+  for (DictTable* dict = head_.load(std::memory_order_acquire); dict != nullptr;
+       dict = dict->next.load(std::memory_order_acquire)) {
+    DictEntry* entry = dict->table[hash & dict->sizemask].load(std::memory_order_acquire);
+    while (entry != nullptr) {
+      if (entry->hash == hash && entry->key == key) {
+        *value = entry->value;
+        return true;
+      }
+      entry = entry->next.load(std::memory_order_acquire);
+    }
+  }
+  return false;
+}
+
+/* Rehash for about ms milliseconds. The lock is taken for 100 steps at a
+ * time, so writers are not held up for the whole ms.
+ * Return the steps done.
+ */
+template<typename TKey, typename TValue, typename TAllocator, typename THasher>
+size_t LockFreeDictionary<TKey, TValue, TAllocator, THasher>::RehashMilliseconds(int ms) {
+  auto start = std::chrono::high_resolution_clock::now();
+  size_t rehash_step = 0;
+  while (true) {
+    {
+      std::lock_guard<std::mutex> guard(write_lock_);
+      if (!RehashNStep(100)) break;
+    }
+    rehash_step += 100;
+    auto diff = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::high_resolution_clock::now() - start);
+    if (diff.count() > ms) break;
+  }
+  return rehash_step;
+}
+
+}
+
+#endif
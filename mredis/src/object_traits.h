@@ -0,0 +1,37 @@
+#ifndef MREDIS_SRC_OBJECT_TRAITS_H_
+#define MREDIS_SRC_OBJECT_TRAITS_H_
+
+#include <cstddef>
+
+/* Hooks containers call on the keys and values they hold.
+ * These are the defaults for plain types, types owning zmalloc memory
+ * overload them in their own header so the containers find them by ADL.
+ */
+namespace mredis {
+
+// Move the memory owned by object to less fragmented pages.
+// Return true if anything was moved.
+template <typename T>
+inline bool DefragObject(T& object) {
+  (void)object;
+  return false;
+}
+
+// Roughly the number of allocations freed when object is destroyed, used
+// to decide whether to free it in the background.
+template <typename T>
+inline size_t ObjectFreeEffort(const T& object) {
+  (void)object;
+  return 1;
+}
+
+// Bytes of zmalloc memory owned by object, sizeof(object) not included.
+template <typename T>
+inline size_t ObjectMemoryUsage(const T& object) {
+  (void)object;
+  return 0;
+}
+
+}
+
+#endif
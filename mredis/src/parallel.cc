@@ -0,0 +1,101 @@
+#include "mredis/src/parallel.h"
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace mredis {
+
+namespace {
+  class ParallelPool {
+   public:
+    ParallelPool() : job_(nullptr), tasks_(0), next_(0), done_(0),
+                     generation_(0), stop_(false) {}
+
+    ~ParallelPool() {
+      {
+        std::lock_guard<std::mutex> guard(lock_);
+        stop_ = true;
+      }
+      work_cond_.notify_all();
+      for (auto& thread : threads_) thread.join();
+    }
+
+    void Run(int tasks, const std::function<void(int)>& job) {
+      // One job at a time.
+      std::lock_guard<std::mutex> run_guard(run_lock_);
+      {
+        std::lock_guard<std::mutex> guard(lock_);
+        while (static_cast<int>(threads_.size()) < tasks - 1) {
+          threads_.emplace_back(&ParallelPool::Loop, this);
+        }
+        job_ = &job;
+        tasks_ = tasks;
+        next_ = 0;
+        done_ = 0;
+        generation_++;
+      }
+      work_cond_.notify_all();
+
+      RunTasks();
+      std::unique_lock<std::mutex> guard(lock_);
+      done_cond_.wait(guard, [this]() { return done_ == tasks_; });
+      job_ = nullptr;
+    }
+
+   private:
+    // Take tasks of the current job till none is left.
+    void RunTasks() {
+      std::unique_lock<std::mutex> guard(lock_);
+      while (next_ < tasks_) {
+        int task = next_++;
+        const std::function<void(int)>* job = job_;
+        guard.unlock();
+        (*job)(task);
+        guard.lock();
+        if (++done_ == tasks_) done_cond_.notify_all();
+      }
+    }
+
+    void Loop() {
+      unsigned long long seen = 0;
+      while (true) {
+        {
+          std::unique_lock<std::mutex> guard(lock_);
+          work_cond_.wait(guard, [this, seen]() { return stop_ || generation_ != seen; });
+          if (stop_) break;
+          seen = generation_;
+        }
+        RunTasks();
+      }
+    }
+
+    std::mutex run_lock_;
+    std::mutex lock_;
+    std::condition_variable work_cond_;
+    std::condition_variable done_cond_;
+    std::vector<std::thread> threads_;
+    const std::function<void(int)>* job_;
+    int tasks_;
+    int next_;
+    int done_;
+    unsigned long long generation_;
+    bool stop_;
+  };
+
+  ParallelPool& Pool() {
+    static ParallelPool pool;
+    return pool;
+  }
+}
+
+void ParallelRun(int tasks, const std::function<void(int)>& job) {
+  if (tasks <= 1) {
+    if (tasks == 1) job(0);
+    return;
+  }
+  Pool().Run(tasks, job);
+}
+
+}
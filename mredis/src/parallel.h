@@ -0,0 +1,22 @@
+#ifndef MREDIS_SRC_PARALLEL_H_
+#define MREDIS_SRC_PARALLEL_H_
+
+#include <functional>
+
+/* A small pool of threads to split one large job, like the rehash of a
+ * huge dictionary, into tasks run at the same time. The caller runs tasks
+ * too and waits for all of them, so the job's data needs no locking as
+ * long as the tasks touch disjoint parts of it.
+ *
+ * zmalloc is not made thread safe for them: tasks which allocate must
+ * call zmalloc_enable_thread_safeness() first.
+ */
+namespace mredis {
+
+// Run job(0) .. job(tasks - 1) on the calling thread and tasks - 1 worker
+// threads, which are started on first use. Return when all are done.
+void ParallelRun(int tasks, const std::function<void(int)>& job);
+
+}
+
+#endif
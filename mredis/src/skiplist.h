@@ -1,8 +1,14 @@
 #ifndef MREDIS_SRC_SKIPLIST_H_
 #define MREDIS_SRC_SKIPLIST_H_
 
+#include <chrono>
 #include <cstdlib>
 #include <limits>
+#include <new>
+#include <utility>
+
+#include "mredis/src/allocator.h"
+#include "mredis/src/object_traits.h"
 
 namespace mredis {
 
@@ -21,30 +27,41 @@ namespace {
 }
 
 /* forward declaration. */
-template <typename T>
+template <typename T, typename TAllocator>
 class SLIterator;
 
-template <typename T>
+/* Nodes and their level arrays are allocated by TAllocator, see allocator.h. */
+template <typename T, typename TAllocator = ZmallocAllocator>
 class SkipList {
  private:
-  friend class SLIterator<T>;
+  friend class SLIterator<T, TAllocator>;
   class SkipListNode {
    private:
     friend class SkipList;
-    friend class SLIterator<T>;
+    friend class SLIterator<T, TAllocator>;
     struct SkipListLevel {
       SkipListNode* forward;
       size_t span;
     };
     SkipListNode* backward_;
     SkipListLevel* level_;
+    // Number of levels, needed to give the level array back.
+    int height_;
+    // Only used to move a node by defrag, other's level array is stolen.
+    SkipListNode(SkipListNode&& other)
+        : backward_(other.backward_), level_(other.level_),
+          height_(other.height_), key(std::move(other.key)), score(other.score) {
+      other.level_ = nullptr;
+    }
    public:
     T key;
     double score;
     SkipListNode(int level) {
       score = std::numeric_limits<double>::min();
       backward_ = nullptr;
-      level_ = new SkipListLevel[level];
+      level_ = static_cast<SkipListLevel*>(
+          TAllocator::Allocate(level * sizeof(SkipListLevel)));
+      height_ = level;
       for (int i = 0; i < level; ++i) {
         level_[i].forward = nullptr;
         level_[i].span = 0;
@@ -54,18 +71,23 @@ class SkipList {
       this->key = key;
       this->score = score;
     }
+    ~SkipListNode() {
+      if (level_ != nullptr) {
+        TAllocator::Deallocate(level_, height_ * sizeof(SkipListLevel));
+      }
+    }
   };
   SkipListNode* head_;
   SkipListNode* tail_;
   int level_;
   size_t length_;
  public:
-  using Iterator = SLIterator<T>;
+  using Iterator = SLIterator<T, TAllocator>;
   SkipList();
-  SkipList(const SkipList<T>& other) = delete;
-  SkipList(SkipList<T>&& other) noexcept;
-  SkipList<T>& operator=(const SkipList<T>& rhs) = delete;
-  SkipList<T>& operator=(SkipList<T>&& rhs) noexcept;
+  SkipList(const SkipList<T, TAllocator>& other) = delete;
+  SkipList(SkipList<T, TAllocator>&& other) noexcept;
+  SkipList<T, TAllocator>& operator=(const SkipList<T, TAllocator>& rhs) = delete;
+  SkipList<T, TAllocator>& operator=(SkipList<T, TAllocator>&& rhs) noexcept;
   ~SkipList();
 
   inline size_t Len() const { return length_; }
@@ -76,17 +98,31 @@ class SkipList {
   /* Iterator related */
   inline Iterator Begin() const { return Iterator(head_->level_[0].forward); }
   inline Iterator End() const { return Iterator(nullptr); }
+
+  size_t Defrag(size_t cursor, int ms);
+  size_t MemoryUsage(size_t samples = 5) const;
  private:
   SkipListNode* InternalInsert(const T& key, double score);
   int Compare(SkipListNode* node, const T& key, double score) const;
   void Release();
+  SkipListNode* DefragNode(SkipListNode* node, SkipListNode** update);
+
+  template <typename... Args>
+  inline SkipListNode* NewNode(Args&&... args) {
+    return new (TAllocator::Allocate(sizeof(SkipListNode)))
+        SkipListNode(std::forward<Args>(args)...);
+  }
+  inline void FreeNode(SkipListNode* node) {
+    node->~SkipListNode();
+    TAllocator::Deallocate(node, sizeof(SkipListNode));
+  }
 };
 
 /* Iterator class to iterate the whole SkipList. */
-template <typename T>
+template <typename T, typename TAllocator>
 class SLIterator {
  private:
-  using TSkipListNode = typename SkipList<T>::SkipListNode;
+  using TSkipListNode = typename SkipList<T, TAllocator>::SkipListNode;
   TSkipListNode* node_;
  public:
   SLIterator(TSkipListNode* node): node_(node) {}
@@ -104,11 +140,11 @@ class SLIterator {
     return temp;
   }
 
-  bool operator==(const SLIterator<T>& rhs) const {
+  bool operator==(const SLIterator<T, TAllocator>& rhs) const {
     return node_ == rhs.node_;
   }
 
-  bool operator!=(const SLIterator<T>& rhs) const {
+  bool operator!=(const SLIterator<T, TAllocator>& rhs) const {
     return !((*this) == rhs);
   }
 
@@ -121,17 +157,17 @@ class SLIterator {
   }
 };
 
-template <typename T>
-SkipList<T>::SkipList() {
-  head_ = new SkipListNode(kSkipListMaxLevel);
+template <typename T, typename TAllocator>
+SkipList<T, TAllocator>::SkipList() {
+  head_ = NewNode(kSkipListMaxLevel);
   tail_ = nullptr;
   level_ = 1;
   length_ = 0;
 }
 
 /* After move, other is not accessable. */
-template <typename T>
-SkipList<T>::SkipList(SkipList<T>&& other) noexcept {
+template <typename T, typename TAllocator>
+SkipList<T, TAllocator>::SkipList(SkipList<T, TAllocator>&& other) noexcept {
   head_ = other.head_;
   tail_ = other.tail_;
   level_ = other.level_;
@@ -139,9 +175,9 @@ SkipList<T>::SkipList(SkipList<T>&& other) noexcept {
   other.head_ = other.tail_ = nullptr;
 }
 
-template <typename T>
+template <typename T, typename TAllocator>
 /* After move, rhs is not accessable. */
-SkipList<T>& SkipList<T>::operator=(SkipList<T>&& rhs) noexcept {
+SkipList<T, TAllocator>& SkipList<T, TAllocator>::operator=(SkipList<T, TAllocator>&& rhs) noexcept {
   Release();
   head_ = rhs.head_;
   tail_ = rhs.tail_;
@@ -151,14 +187,14 @@ SkipList<T>& SkipList<T>::operator=(SkipList<T>&& rhs) noexcept {
   return *this;
 }
 
-template <typename T>
-SkipList<T>::~SkipList() {
+template <typename T, typename TAllocator>
+SkipList<T, TAllocator>::~SkipList() {
   Release();
 }
 
 /* Get the 1-based rank for a given key. */
-template <typename T>
-size_t SkipList<T>::GetRank(const T& key, double score) const {
+template <typename T, typename TAllocator>
+size_t SkipList<T, TAllocator>::GetRank(const T& key, double score) const {
   SkipListNode* node = head_;
   size_t rank = 0;
   for (int i = level_ - 1; i >= 0; --i) {
@@ -178,16 +214,16 @@ size_t SkipList<T>::GetRank(const T& key, double score) const {
 
 /* Insert a key to skiplist.
  * Return true if success, false if key already exists. */
-template <typename T>
-bool SkipList<T>::Insert(const T& key, double score) {
+template <typename T, typename TAllocator>
+bool SkipList<T, TAllocator>::Insert(const T& key, double score) {
   SkipListNode* node = InternalInsert(key, score);
   return (node != nullptr);
 }
 
 /* Delete a key from skiplist. 
  * Return true if success, false if key not exists. */ 
-template <typename T>
-bool SkipList<T>::Delete(const T& key, double score) {
+template <typename T, typename TAllocator>
+bool SkipList<T, TAllocator>::Delete(const T& key, double score) {
   SkipListNode* update[kSkipListMaxLevel];
 
   SkipListNode* node = head_;
@@ -232,14 +268,14 @@ bool SkipList<T>::Delete(const T& key, double score) {
   }
   length_--;
 
-  delete node;
+  FreeNode(node);
   return true;
 }
 
 /* Insert a key with score into SkipList with the sorted order.
  * Return pointer of the inserted node. */
-template <typename T>
-typename SkipList<T>::SkipListNode* SkipList<T>::InternalInsert(const T& key, double score) {
+template <typename T, typename TAllocator>
+typename SkipList<T, TAllocator>::SkipListNode* SkipList<T, TAllocator>::InternalInsert(const T& key, double score) {
   SkipListNode* update[kSkipListMaxLevel];
   size_t rank[kSkipListMaxLevel];
 
@@ -248,8 +284,8 @@ typename SkipList<T>::SkipListNode* SkipList<T>::InternalInsert(const T& key, do
     rank[i] = (i == level_ - 1) ? 0 : rank[i + 1];
     while (node->level_[i].forward != nullptr 
            && Compare(node->level_[i].forward, key, score) == -1) {
-      node = node->level_[i].forward;
       rank[i] += node->level_[i].span;
+      node = node->level_[i].forward;
     }
     update[i] = node;
   }
@@ -268,7 +304,7 @@ typename SkipList<T>::SkipListNode* SkipList<T>::InternalInsert(const T& key, do
   }
   if (level > level_) level_ = level;
 
-  SkipListNode* insert_node = new SkipListNode(level, key, score);
+  SkipListNode* insert_node = NewNode(level, key, score);
   for (int i = 0; i < level; ++i) {
     insert_node->level_[i].forward = update[i]->level_[i].forward;
     update[i]->level_[i].forward = insert_node;
@@ -288,8 +324,8 @@ typename SkipList<T>::SkipListNode* SkipList<T>::InternalInsert(const T& key, do
 
 /* Compare SkipListNode with given key and score, return 0 if equal;
  * Return -1 if node is smaller, 1 if node is larger. */
-template <typename T>
-int SkipList<T>::Compare(SkipListNode* node, const T& key, double score) const {
+template <typename T, typename TAllocator>
+int SkipList<T, TAllocator>::Compare(SkipListNode* node, const T& key, double score) const {
   if (node->score == score) {
     if (node->key == key) return 0;
     else return (node->key < key ? -1 : 1);
@@ -298,15 +334,127 @@ int SkipList<T>::Compare(SkipListNode* node, const T& key, double score) const {
 }
 
 /* Release the nodes in Skiplist. */
-template <typename T>
-void SkipList<T>::Release() {
+template <typename T, typename TAllocator>
+void SkipList<T, TAllocator>::Release() {
   SkipListNode* node = head_;
   while (node != nullptr) {
     SkipListNode* next = node->level_[0].forward;
-    delete node;
+    FreeNode(node);
     node = next;
   }
 }
 
+/* Defrag nodes, level arrays and keys in rank order for about ms
+ * milliseconds, starting after the node of rank cursor (0 for a new pass).
+ * Return the cursor to continue with, 0 if all nodes are visited. */
+template <typename T, typename TAllocator>
+size_t SkipList<T, TAllocator>::Defrag(size_t cursor, int ms) {
+  if (cursor >= length_) return 0;
+
+  // update[i] is the last node at level i whose rank is at most cursor.
+  SkipListNode* update[kSkipListMaxLevel];
+  SkipListNode* node = head_;
+  size_t rank = 0;
+  for (int i = level_ - 1; i >= 0; --i) {
+    while (node->level_[i].forward != nullptr
+           && rank + node->level_[i].span <= cursor) {
+      rank += node->level_[i].span;
+      node = node->level_[i].forward;
+    }
+    update[i] = node;
+  }
+
+  auto start = std::chrono::high_resolution_clock::now();
+  while (true) {
+    node = update[0]->level_[0].forward;
+    if (node == nullptr) return 0;
+    node = DefragNode(node, update);
+    for (int i = 0; i < level_ && update[i]->level_[i].forward == node; ++i) {
+      update[i] = node;
+    }
+    cursor++;
+
+    // Checking time is not free, do it every 16 nodes.
+    if (cursor % 16 == 0) {
+      auto diff = std::chrono::duration_cast<std::chrono::milliseconds>(
+          std::chrono::high_resolution_clock::now() - start);
+      if (diff.count() >= ms) break;
+    }
+  }
+  return cursor;
+}
+
+/* Return bytes used by the SkipList: itself, the nodes with their level
+ * arrays and the memory owned by keys. Nodes are estimated from samples
+ * consecutive nodes starting at a random rank, pass 0 to visit every node.
+ */
+template <typename T, typename TAllocator>
+size_t SkipList<T, TAllocator>::MemoryUsage(size_t samples) const {
+  size_t bytes = sizeof(*this) + TAllocator::Size(head_) + TAllocator::Size(head_->level_);
+  bytes += ObjectMemoryUsage(head_->key);
+  if (length_ == 0) return bytes;
+  if (samples == 0 || samples > length_) samples = length_;
+
+  // Find the node of rank start, the sample begins right after it.
+  size_t start = std::rand() % (length_ - samples + 1);
+  SkipListNode* node = head_;
+  size_t rank = 0;
+  for (int i = level_ - 1; i >= 0; --i) {
+    while (node->level_[i].forward != nullptr
+           && rank + node->level_[i].span <= start) {
+      rank += node->level_[i].span;
+      node = node->level_[i].forward;
+    }
+  }
+
+  size_t sampled_bytes = 0;
+  for (size_t i = 0; i < samples; ++i) {
+    node = node->level_[0].forward;
+    sampled_bytes += TAllocator::Size(node) + TAllocator::Size(node->level_);
+    sampled_bytes += ObjectMemoryUsage(node->key);
+  }
+  if (samples == length_) return bytes + sampled_bytes;
+  return bytes + static_cast<size_t>(
+      static_cast<double>(sampled_bytes) / samples * length_);
+}
+
+template <typename T, typename TAllocator>
+inline size_t ObjectMemoryUsage(const SkipList<T, TAllocator>& list) {
+  return list.MemoryUsage() - sizeof(list);
+}
+
+template <typename T, typename TAllocator>
+inline size_t ObjectFreeEffort(const SkipList<T, TAllocator>& list) {
+  return list.Len();
+}
+
+/* Defrag the key and level array of node, and move node itself if the
+ * allocator suggests so. update[i] must be the predecessor of node at level i.
+ * Return the address of node after defrag. */
+template <typename T, typename TAllocator>
+typename SkipList<T, TAllocator>::SkipListNode* SkipList<T, TAllocator>::DefragNode(
+    SkipListNode* node, SkipListNode** update) {
+  using SkipListLevel = typename SkipListNode::SkipListLevel;
+  DefragObject(node->key);
+  void* level = TAllocator::Defrag(node->level_);
+  if (level != nullptr) node->level_ = static_cast<SkipListLevel*>(level);
+  if (!TAllocator::DefragHint(node)) return node;
+
+  SkipListNode* moved = new (TAllocator::AllocateNoCache(sizeof(SkipListNode)))
+      SkipListNode(std::move(*node));
+  for (int i = 0; i < level_ && update[i]->level_[i].forward == node; ++i) {
+    update[i]->level_[i].forward = moved;
+  }
+  if (moved->level_[0].forward != nullptr) {
+    moved->level_[0].forward->backward_ = moved;
+  }
+  else {
+    tail_ = moved;
+  }
+  node->~SkipListNode();
+  TAllocator::DeallocateNoCache(node);
+  return moved;
+}
+
 }
 #endif
\ No newline at end of file
@@ -0,0 +1,313 @@
+#include <sys/mman.h>
+#include <cstdint>
+#include <mutex>
+
+#include "mredis/src/slab.h"
+
+namespace {
+  using mredis::kSlabMaxSize;
+
+  // Classes are 16 bytes apart up to 128, then every power of two
+  // range (128, 256], (256, 512]... is divided into 4 classes.
+  const int kSlabNumClasses = 28;
+  const size_t kSlabSpanSize = 64 * 1024;
+  const size_t kSlabSpanHeaderSize = 64;
+  // Objects moved between thread cache and central pool at a time.
+  const size_t kSlabBatchBytes = 8 * 1024;
+  const uint32_t kSlabMaxBatch = 32;
+
+  // A span is a kSlabSpanSize aligned memory block, the header lives at
+  // the beginning so we can find the span of any object by masking.
+  struct SlabSpan {
+    SlabSpan* prev;
+    SlabSpan* next;
+    // Objects returned to this span.
+    void* freelist;
+    // Objects never handed out are carved lazily, so untouched pages of a
+    // new span stay out of rss.
+    char* carve;
+    char* end;
+    uint32_t inuse;
+    bool partial;
+  };
+  static_assert(sizeof(SlabSpan) <= kSlabSpanHeaderSize, "span header too large");
+
+  struct SlabClass {
+    std::mutex lock;
+    // Spans which still have free objects.
+    SlabSpan* partial;
+    size_t spans;
+    // Objects handed out to thread caches or callers.
+    size_t inuse;
+  };
+
+  SlabClass central[kSlabNumClasses];
+
+  struct FreeList {
+    void* head;
+    uint32_t count;
+  };
+
+  // Plain old data, so it is still usable after the flusher below is
+  // destroyed at thread exit.
+  thread_local FreeList tcache[kSlabNumClasses];
+  thread_local bool tcache_destroyed = false;
+
+  struct ThreadCacheFlusher {
+    ~ThreadCacheFlusher();
+  };
+  thread_local ThreadCacheFlusher tcache_flusher;
+
+  inline void*& NextOf(void* obj) {
+    return *static_cast<void**>(obj);
+  }
+
+  inline SlabSpan* SpanOf(void* obj) {
+    return reinterpret_cast<SlabSpan*>(
+        reinterpret_cast<uintptr_t>(obj) & ~(kSlabSpanSize - 1));
+  }
+
+  inline uint32_t BatchSize(int cls) {
+    size_t n = kSlabBatchBytes / mredis::slab_class_size(cls);
+    if (n < 2) n = 2;
+    if (n > kSlabMaxBatch) n = kSlabMaxBatch;
+    return static_cast<uint32_t>(n);
+  }
+
+  // Map a span aligned to kSlabSpanSize, unmap the unaligned head and tail.
+  SlabSpan* MapSpan(int cls) {
+    size_t len = kSlabSpanSize * 2;
+    void* p = mmap(nullptr, len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) return nullptr;
+
+    uintptr_t start = reinterpret_cast<uintptr_t>(p);
+    uintptr_t aligned = (start + kSlabSpanSize - 1) & ~(kSlabSpanSize - 1);
+    size_t head = aligned - start;
+    size_t tail = len - head - kSlabSpanSize;
+    if (head) munmap(p, head);
+    if (tail) munmap(reinterpret_cast<void*>(aligned + kSlabSpanSize), tail);
+
+    SlabSpan* span = reinterpret_cast<SlabSpan*>(aligned);
+    size_t size = mredis::slab_class_size(cls);
+    span->prev = span->next = nullptr;
+    span->freelist = nullptr;
+    span->carve = reinterpret_cast<char*>(aligned) + kSlabSpanHeaderSize;
+    span->end = span->carve
+        + (kSlabSpanSize - kSlabSpanHeaderSize) / size * size;
+    span->inuse = 0;
+    span->partial = false;
+    return span;
+  }
+
+  void LinkPartial(SlabClass* c, SlabSpan* span) {
+    span->prev = nullptr;
+    span->next = c->partial;
+    if (c->partial) c->partial->prev = span;
+    c->partial = span;
+    span->partial = true;
+  }
+
+  void UnlinkPartial(SlabClass* c, SlabSpan* span) {
+    if (span->prev) span->prev->next = span->next;
+    else c->partial = span->next;
+    if (span->next) span->next->prev = span->prev;
+    span->prev = span->next = nullptr;
+    span->partial = false;
+  }
+
+  // Pop one object from span, return nullptr if span is full.
+  inline void* SpanPop(SlabSpan* span, size_t size) {
+    void* obj = span->freelist;
+    if (obj != nullptr) {
+      span->freelist = NextOf(obj);
+    }
+    else if (span->carve < span->end) {
+      obj = span->carve;
+      span->carve += size;
+    }
+    else {
+      return nullptr;
+    }
+    span->inuse++;
+    return obj;
+  }
+
+  // Move at most n objects of cls from central pool to list.
+  // Return the number of objects moved, 0 means out of memory.
+  uint32_t FetchFromCentral(int cls, FreeList* list, uint32_t n) {
+    SlabClass* c = &central[cls];
+    size_t size = mredis::slab_class_size(cls);
+    uint32_t got = 0;
+
+    std::lock_guard<std::mutex> guard(c->lock);
+    while (got < n) {
+      SlabSpan* span = c->partial;
+      if (span == nullptr) {
+        span = MapSpan(cls);
+        if (span == nullptr) break;
+        c->spans++;
+        LinkPartial(c, span);
+      }
+      void* obj;
+      while (got < n && (obj = SpanPop(span, size)) != nullptr) {
+        NextOf(obj) = list->head;
+        list->head = obj;
+        got++;
+      }
+      if (span->freelist == nullptr && span->carve >= span->end) {
+        UnlinkPartial(c, span);
+      }
+    }
+    c->inuse += got;
+    list->count += got;
+    return got;
+  }
+
+  // Give n objects from the head of list back to their spans. Empty spans
+  // are unmapped, but we always keep one span per class to avoid thrashing.
+  void ReleaseToCentral(int cls, FreeList* list, uint32_t n) {
+    SlabClass* c = &central[cls];
+
+    std::lock_guard<std::mutex> guard(c->lock);
+    while (n-- && list->head != nullptr) {
+      void* obj = list->head;
+      list->head = NextOf(obj);
+      list->count--;
+
+      SlabSpan* span = SpanOf(obj);
+      NextOf(obj) = span->freelist;
+      span->freelist = obj;
+      span->inuse--;
+      c->inuse--;
+      if (!span->partial) LinkPartial(c, span);
+      if (span->inuse == 0 && c->spans > 1) {
+        UnlinkPartial(c, span);
+        c->spans--;
+        munmap(span, kSlabSpanSize);
+      }
+    }
+  }
+
+  // Pop one object for defrag from the fullest of the first few partial
+  // spans, so moved objects are packed into dense spans.
+  void* PopDensest(int cls) {
+    const int kMaxScan = 16;
+    SlabClass* c = &central[cls];
+    size_t size = mredis::slab_class_size(cls);
+
+    std::lock_guard<std::mutex> guard(c->lock);
+    SlabSpan* best = c->partial;
+    SlabSpan* span = c->partial;
+    for (int i = 0; span != nullptr && i < kMaxScan; ++i, span = span->next) {
+      if (span->inuse > best->inuse) best = span;
+    }
+    if (best == nullptr) {
+      best = MapSpan(cls);
+      if (best == nullptr) return nullptr;
+      c->spans++;
+      LinkPartial(c, best);
+    }
+    void* obj = SpanPop(best, size);
+    if (best->freelist == nullptr && best->carve >= best->end) {
+      UnlinkPartial(c, best);
+    }
+    c->inuse++;
+    return obj;
+  }
+
+  ThreadCacheFlusher::~ThreadCacheFlusher() {
+    for (int cls = 0; cls < kSlabNumClasses; ++cls) {
+      ReleaseToCentral(cls, &tcache[cls], tcache[cls].count);
+    }
+    tcache_destroyed = true;
+  }
+}
+
+namespace mredis {
+
+int slab_size_class(size_t size) {
+  if (size > kSlabMaxSize) return kSlabNoClass;
+  if (size <= 128) return size == 0 ? 0 : static_cast<int>((size + 15) / 16 - 1);
+
+  // power is the index of the highest bit of (size - 1), at least 7.
+  int power = 63 - __builtin_clzll(static_cast<unsigned long long>(size - 1));
+  size_t offset = (size - 1) - (static_cast<size_t>(1) << power);
+  return 8 + (power - 7) * 4 + static_cast<int>(offset >> (power - 2));
+}
+
+size_t slab_class_size(int cls) {
+  if (cls < 8) return static_cast<size_t>(cls + 1) * 16;
+  int group = (cls - 8) / 4;
+  size_t base = static_cast<size_t>(128) << group;
+  return base + (cls - 8 + 1 - group * 4) * (base / 4);
+}
+
+void *slab_alloc(int cls) {
+  if (tcache_destroyed) {
+    FreeList list = {nullptr, 0};
+    FetchFromCentral(cls, &list, 1);
+    return list.head;
+  }
+
+  FreeList* list = &tcache[cls];
+  if (list->head == nullptr) {
+    // Make sure the flusher is registered for this thread.
+    (void)&tcache_flusher;
+    if (FetchFromCentral(cls, list, BatchSize(cls)) == 0) return nullptr;
+  }
+  void* obj = list->head;
+  list->head = NextOf(obj);
+  list->count--;
+  return obj;
+}
+
+void slab_free(void *ptr, int cls) {
+  if (tcache_destroyed) {
+    slab_free_no_tcache(ptr, cls);
+    return;
+  }
+
+  FreeList* list = &tcache[cls];
+  NextOf(ptr) = list->head;
+  list->head = ptr;
+  list->count++;
+  uint32_t batch = BatchSize(cls);
+  if (list->count > batch * 2) {
+    ReleaseToCentral(cls, list, batch);
+  }
+}
+
+void slab_get_stats(size_t *allocated, size_t *active) {
+  *allocated = *active = 0;
+  for (int cls = 0; cls < kSlabNumClasses; ++cls) {
+    SlabClass* c = &central[cls];
+    std::lock_guard<std::mutex> guard(c->lock);
+    *allocated += c->inuse * slab_class_size(cls);
+    *active += c->spans * kSlabSpanSize;
+  }
+}
+
+// Objects in a span used less than the average span of its class are
+// worth moving: once all of them are gone the span can be unmapped.
+bool slab_defrag_hint(void *ptr, int cls) {
+  SlabClass* c = &central[cls];
+  SlabSpan* span = SpanOf(ptr);
+  size_t capacity = (kSlabSpanSize - kSlabSpanHeaderSize) / slab_class_size(cls);
+
+  std::lock_guard<std::mutex> guard(c->lock);
+  if (c->spans <= 1 || span->inuse == capacity) return false;
+  return static_cast<size_t>(span->inuse) * c->spans < c->inuse;
+}
+
+void *slab_alloc_no_tcache(int cls) {
+  return PopDensest(cls);
+}
+
+void slab_free_no_tcache(void *ptr, int cls) {
+  FreeList list = {ptr, 1};
+  NextOf(ptr) = nullptr;
+  ReleaseToCentral(cls, &list, 1);
+}
+
+}
\ No newline at end of file
@@ -0,0 +1,37 @@
+#ifndef MREDIS_SRC_SLAB_H_
+#define MREDIS_SRC_SLAB_H_
+
+#include <cstddef>
+
+/* Size-class slab allocator used by zmalloc for small allocations.
+ *
+ * Memory is carved from 64KB spans, every span only serves one size class.
+ * Each thread keeps a free list per class and moves objects from/to the
+ * central pool in batches, so the common path never takes a lock.
+ */
+namespace mredis {
+  const size_t kSlabMaxSize = 4096;
+  const int kSlabNoClass = -1;
+
+  // Return the size class index that fits size, or kSlabNoClass if size
+  // is too large to be served by the slab.
+  int slab_size_class(size_t size);
+  // Return the object size of the given size class.
+  size_t slab_class_size(int cls);
+
+  void *slab_alloc(int cls);
+  void slab_free(void *ptr, int cls);
+
+  // Bytes of objects handed out (including the ones cached by threads)
+  // and bytes of spans mapped by the slab.
+  void slab_get_stats(size_t *allocated, size_t *active);
+
+  // Defrag support: tell whether the object sits in a sparsely used span,
+  // and allocate/free bypassing the thread cache so moved objects land
+  // in dense spans and the sparse ones get empty.
+  bool slab_defrag_hint(void *ptr, int cls);
+  void *slab_alloc_no_tcache(int cls);
+  void slab_free_no_tcache(void *ptr, int cls);
+}
+
+#endif
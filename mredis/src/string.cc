@@ -12,37 +12,54 @@
 namespace mredis{
   
 void String::Init(const void* init, size_t initlen) {
-  if (init != nullptr) {
-    buf_ = static_cast<char*>(zmalloc(initlen + 1));
+  char* buf;
+  if (initlen < kStringEmbedSize) {
+    buf = embed_;
+    free_ = kStringEmbedSize - 1 - initlen;
   }
   else {
-    buf_ = static_cast<char*>(zcalloc(initlen + 1));
+    buf = buf_ = static_cast<char*>(zmalloc(initlen + 1));
+    free_ = 0;
   }
   if (init != nullptr && initlen) {
-    std::memcpy(buf_, init, initlen);
+    std::memcpy(buf, init, initlen);
   }
-  buf_[initlen] = '\0';
+  else if (init == nullptr) {
+    std::memset(buf, 0, initlen);
+  }
+  buf[initlen] = '\0';
   len_ = initlen;
-  free_ = 0;
+}
+
+// An empty embedded string, also what a moved from string becomes.
+void String::InitEmpty() {
+  len_ = 0;
+  free_ = kStringEmbedSize - 1;
+  embed_[0] = '\0';
+}
+
+void String::FreeBuf() {
+  if (!IsEmbedded()) zfree(buf_, len_ + free_ + 1);
 }
 
 String::String(): String(nullptr, 0) { }
 
 String::String(long long int value) {
-  const char* str = std::to_string(value).c_str();
   // NOTE: cannot write like this: String(str, std::strlen(str))
-  Init(str, std::strlen(str));
+  std::string str = std::to_string(value);
+  Init(str.data(), str.size());
 }
 
 String::String(const char* init) : String(init, init == nullptr ? 0 : std::strlen(init)) { }
 
-String::String(const String& s): String(s.buf_, s.len_) { }
+String::String(const String& s): String(s.data(), s.len_) { }
 
+// Copying the union moves either the embedded bytes or the buffer pointer.
 String::String(String&& s) noexcept {
-  buf_ = s.buf_;
   len_ = s.len_;
   free_ = s.free_;
-  s.buf_ = nullptr;
+  std::memcpy(embed_, s.embed_, sizeof(embed_));
+  s.InitEmpty();
 }
 
 String::String(const void* init, size_t initlen) {
@@ -59,54 +76,54 @@ String::String(std::vector<const char*> tokens, const char* sep): String() {
 }
 
 String::~String() {
-  if (buf_ == nullptr) return;
-  zfree(buf_);
-  buf_ = nullptr;
+  FreeBuf();
 }
 
 String& String::operator=(const String& rhs) {
-  Copy(rhs.buf_, rhs.len_);
+  if (this != &rhs) Copy(rhs.data(), rhs.len_);
   return *this;
 }
 
 String& String::operator=(String&& rhs) noexcept {
-  if (buf_ != nullptr) zfree(buf_);
-  buf_ = rhs.buf_;
+  if (this == &rhs) return *this;
+  FreeBuf();
   len_ = rhs.len_;
   free_ = rhs.free_;
-  rhs.buf_ = nullptr;
+  std::memcpy(embed_, rhs.embed_, sizeof(embed_));
+  rhs.InitEmpty();
   return *this;
 }
 
 bool String::operator==(const String& rhs) const {
   if (len_ != rhs.len_) return false;
-  int cmp = std::memcmp(buf_, rhs.buf_, std::min(len_, rhs.len_));
+  int cmp = std::memcmp(data(), rhs.data(), std::min(len_, rhs.len_));
   return cmp == 0;
 }
 
 bool String::operator<(const String& rhs) const {
-  int cmp = std::memcmp(buf_, rhs.buf_, std::min(len_, rhs.len_));
+  int cmp = std::memcmp(data(), rhs.data(), std::min(len_, rhs.len_));
   if (cmp == 0) return len_ < rhs.len_;
   return cmp < 0;
 }
 
 bool String::operator>(const String& rhs) const {
-  int cmp = std::memcmp(buf_, rhs.buf_, std::min(len_, rhs.len_));
+  int cmp = std::memcmp(data(), rhs.data(), std::min(len_, rhs.len_));
   if (cmp == 0) return len_ > rhs.len_;
   return cmp > 0;
 }
 
 std::ostream& operator<<(std::ostream& os, const String& string) {
   for (size_t i = 0; i < string.len_; ++i) {
-    os << string.buf_[i];
+    os << string.data()[i];
   }
   return os;
 }
 
 void String::Cat(char c) {
   MakeRoomFor(1);
-  buf_[len_] = c;
-  buf_[len_ + 1] = '\0';
+  char* buf = Buf();
+  buf[len_] = c;
+  buf[len_ + 1] = '\0';
   len_++;
   free_--;
 }
@@ -119,14 +136,15 @@ void String::Cat(const char* t) {
 void String::Cat(const void* t, size_t len) {
   MakeRoomFor(len);
 
-  std::memcpy(buf_ + len_, t, len);
-  buf_[len_ + len] = '\0';
+  char* buf = Buf();
+  std::memcpy(buf + len_, t, len);
+  buf[len_ + len] = '\0';
   len_ += len;
   free_ -= len;
 }
 
 void String::Cat(const String& s) {
-  Cat(s.buf_, s.len_);
+  Cat(s.data(), s.len_);
 }
 
 void String::CatFmt(const char* fmt, ...) {
@@ -196,7 +214,7 @@ void String::CatPrintf(const char* fmt, std::va_list vlist) {
     va_end(copy);
     // '\0' means the buf size is not enough.
     if (buf[buflen - 2] != '\0') {
-      if (buf != staticbuf) zfree(buf);
+      if (buf != staticbuf) zfree(buf, buflen);
       buflen *= 2;
       buf = static_cast<char*>(zmalloc(buflen));
     }
@@ -204,7 +222,7 @@ void String::CatPrintf(const char* fmt, std::va_list vlist) {
   }
 
   Cat(buf);
-  if (buf != staticbuf) zfree(buf);
+  if (buf != staticbuf) zfree(buf, buflen);
 }
 
 void String::CatPrintf(const char* fmt, ...) {
@@ -239,7 +257,7 @@ void String::CatRepr(const char* p, size_t len) {
 void String::GrowZero(size_t len) {
   if (len <= len_) return;
   MakeRoomFor(len - len_);
-  std::memset(buf_ + len_, 0, len - len_ + 1);
+  std::memset(Buf() + len_, 0, len - len_ + 1);
   size_t totlen = len_ + free_;
   len_ = len;
   free_ = totlen - len_;
@@ -252,31 +270,33 @@ void String::Copy(const char* t) {
 void String::Copy(const char* t, size_t len) {
   size_t totlen = len_ + free_;
   if (totlen < len) {
-    MakeRoomFor(len - totlen);
+    MakeRoomFor(len - len_);
     totlen = len_ + free_;
   }
-  std::memcpy(buf_, t, len);
-  buf_[len] = '\0';
+  char* buf = Buf();
+  std::memcpy(buf, t, len);
+  buf[len] = '\0';
   len_ = len;
   free_ = totlen - len_;
 }
 
 void String::Trim(const char* cset) {
+  char* buf = Buf();
   char* start, *end, *sp, *ep;
-  start = sp = buf_;
-  end = ep = buf_ + len_ - 1;
+  start = sp = buf;
+  end = ep = buf + len_ - 1;
   while(sp <= end && std::strchr(cset, *sp)) sp++;
   while(ep >= start && std::strchr(cset, *ep)) ep--;
   size_t len = (sp > ep) ? 0 : (ep - sp + 1);
 
-  if (buf_ != sp) memmove(buf_, sp, len);
-  buf_[len] = '\0';
+  if (buf != sp) memmove(buf, sp, len);
+  buf[len] = '\0';
   free_ += (len_ - len);
   len_ = len;
 }
 
 std::vector<String> String::Split(const char* sep, size_t seplen) {
-  return std::move(SplitLen(buf_, len_, sep, seplen));
+  return std::move(SplitLen(data(), len_, sep, seplen));
 }
 
 void String::Range(int start, int end) {
@@ -285,14 +305,15 @@ void String::Range(int start, int end) {
   assert(0 <= start && start <= end && static_cast<size_t>(end) <= len_ - 1);
 
   size_t len = end - start + 1;
-  if (start > 0) memmove(buf_, buf_ + start, len);
-  buf_[len] = '\0';
+  char* buf = Buf();
+  if (start > 0) memmove(buf, buf + start, len);
+  buf[len] = '\0';
   free_ += (len_ - len);
   len_ = len;
 }
 
 void String::UpdateLen() {
-  int len = std::strlen(buf_);
+  int len = std::strlen(Buf());
   free_ += (len_ - len);
   len_ = len;
 }
@@ -300,26 +321,29 @@ void String::UpdateLen() {
 void String::Clear() {
   free_ += len_;
   len_ = 0;
-  buf_[0] = '\0';
+  Buf()[0] = '\0';
 }
 
 void String::ToLower() {
+  char* buf = Buf();
   for (size_t i = 0; i < len_; ++i) {
-    buf_[i] = std::tolower(buf_[i]);
+    buf[i] = std::tolower(buf[i]);
   }
 }
 
 void String::ToUpper() {
+  char* buf = Buf();
   for (size_t i = 0; i < len_; ++i) {
-    buf_[i] = std::toupper(buf_[i]);
+    buf[i] = std::toupper(buf[i]);
   }
 }
 
 void String::MapChars(const char* from, const char* to, size_t len) {
+  char* buf = Buf();
   for (size_t i = 0; i < len_; ++i) {
     for (size_t j = 0; j < len; ++j) {
-      if (buf_[i] == from[j]) {
-        buf_[i] = to[j];
+      if (buf[i] == from[j]) {
+        buf[i] = to[j];
         break;
       }
     }
@@ -327,7 +351,8 @@ void String::MapChars(const char* from, const char* to, size_t len) {
 }
 
 /* Extend a space for addlen, if free space is enough, just return.
- * Else, new a space larger than addlen.  
+ * Else, new a space larger than addlen. An embedded string goes to the
+ * heap here, the new capacity is always at least kStringEmbedSize.
  */
 void String::MakeRoomFor(size_t addlen) {
   if (free_ >= addlen) return;
@@ -340,7 +365,14 @@ void String::MakeRoomFor(size_t addlen) {
     newlen += kStringMaxPreAlloc;
   }
   
-  buf_ = static_cast<char*>(zrealloc(buf_, newlen + 1));
+  if (IsEmbedded()) {
+    char* buf = static_cast<char*>(zmalloc(newlen + 1));
+    std::memcpy(buf, embed_, len_ + 1);
+    buf_ = buf;
+  }
+  else {
+    buf_ = static_cast<char*>(zrealloc(buf_, newlen + 1));
+  }
   free_ = newlen - len_;
 }
 
@@ -349,10 +381,20 @@ void String::IncrLen(int incr) {
   else assert(len_ >= (unsigned int)(-incr));
   len_ += incr;
   free_ -= incr;
-  buf_[len_] = '\0';
+  Buf()[len_] = '\0';
 }
 
+// A heap string short enough to be embedded moves back into the object.
 void String::RemoveFreeSpace() {
+  if (IsEmbedded()) return;
+  if (len_ < kStringEmbedSize) {
+    char* buf = buf_;
+    size_t alloc = len_ + free_ + 1;
+    std::memcpy(embed_, buf, len_ + 1);
+    zfree(buf, alloc);
+    free_ = kStringEmbedSize - 1 - len_;
+    return;
+  }
   buf_ = static_cast<char*>(zrealloc(buf_, len_ + 1));
   free_ = 0;
 }
@@ -361,6 +403,20 @@ size_t String::AllocSize() {
   return free_ + len_ + 1;
 }
 
+// Move the buffer if zmalloc thinks it sits in a sparse page.
+bool String::Defrag() {
+  if (IsEmbedded()) return false;
+  void* ptr = zmalloc_defrag(buf_);
+  if (ptr == nullptr) return false;
+  buf_ = static_cast<char*>(ptr);
+  return true;
+}
+
+// Bytes zmalloc accounts for the buffer.
+size_t String::MemoryUsage() const {
+  return IsEmbedded() ? 0 : zmalloc_size(buf_);
+}
+
 std::vector<String> SplitLen(
     const char* s, size_t len, const char* sep, size_t seplen) {
   std::vector<String> tokens;
@@ -8,15 +8,31 @@
 
 namespace {
   const size_t kStringMaxPreAlloc = 1024*1024;
+  // Strings shorter than this are kept inside the object, '\0' included.
+  const size_t kStringEmbedSize = 32;
 }
 
 namespace mredis {
 
+/* Short strings are embedded: the bytes live in the object itself and no
+ * buffer is allocated. A String held by value, like a key in a
+ * DictEntry, is then one allocation with its container and one cache
+ * miss to compare. Keys under 32 bytes are the common case, a
+ * Dictionary<String, V> with a pointer sized value fits its entry in a
+ * cache line of 64 bytes.
+ * A string is embedded exactly when its capacity len_ + free_ is below
+ * kStringEmbedSize, heap buffers are never smaller than that.
+ * The union makes every String 40 bytes instead of 16, so a long string
+ * pays 24 more bytes besides its buffer, see notes/sds.md.
+ */
 class String {
 private:
   unsigned int len_;
   unsigned int free_;
-  char* buf_; 
+  union {
+    char* buf_;
+    char embed_[kStringEmbedSize];
+  };
   
 public:
   inline size_t Len() {
@@ -25,6 +41,15 @@ public:
   inline size_t Free() {
     return free_;
   }
+  inline bool IsEmbedded() const {
+    return len_ + free_ < kStringEmbedSize;
+  }
+  inline const char* data() const {
+    return IsEmbedded() ? embed_ : buf_;
+  }
+  inline size_t size() const {
+    return len_;
+  }
   
   String();
   String(long long int value);
@@ -72,13 +97,23 @@ public:
   void IncrLen(int incr);
   void RemoveFreeSpace();
   size_t AllocSize();
+  bool Defrag();
+  size_t MemoryUsage() const;
 
 private:
+  inline char* Buf() {
+    return IsEmbedded() ? embed_ : buf_;
+  }
   void Init(const void* t, size_t len);
+  void InitEmpty();
+  void FreeBuf();
   void CatPrintf(const char* fmt, std::va_list vlist);
 };
 
 std::vector<String> SplitLen(const char* s, size_t len, const char* sep, size_t seplen);
 
+inline bool DefragObject(String& s) { return s.Defrag(); }
+inline size_t ObjectMemoryUsage(const String& s) { return s.MemoryUsage(); }
+
 }
 #endif
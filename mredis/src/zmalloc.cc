@@ -1,17 +1,61 @@
+// jemalloc and tcmalloc know the size of every allocation, so they never
+// need the size prefix. The slab is only used with the prefix, because an
+// unsized zfree has no other way to find the size class of a pointer.
+#if defined(USE_JEMALLOC) || defined(USE_TCMALLOC)
+#ifndef ZMALLOC_NO_PREFIX
+#define ZMALLOC_NO_PREFIX
+#endif
+#endif
+#if !defined(ZMALLOC_NO_PREFIX) && !defined(USE_LIBC)
+#define ZMALLOC_USE_SLAB
+#endif
+
 #include <unistd.h>
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <cstdint>
 #include <cstring>
 #include <cstdlib>
 #include <atomic>
+#if defined(USE_JEMALLOC)
+#include <jemalloc/jemalloc.h>
+#elif defined(USE_TCMALLOC)
+#include <gperftools/tcmalloc.h>
+#include <gperftools/malloc_extension_c.h>
+#else
+#include <malloc.h>
+#endif
 
 #include "mredis/src/zmalloc.h"
+#include "mredis/src/slab.h"
 
 namespace {
   int zmalloc_thread_safe_enabled = 0;
-  std::atomic<size_t> used_memory(0);
+
+  // used_memory is split into cache line sized shards, every thread
+  // updates its own shard and zmalloc_used_memory() sums all of them.
+  // A shard may wrap below zero when a thread frees memory allocated by
+  // another thread, the sum is still right in modular arithmetic.
+  const int kUsedMemoryShards = 64;
+  struct alignas(64) UsedMemoryShard {
+    std::atomic<size_t> bytes;
+  };
+  UsedMemoryShard used_memory[kUsedMemoryShards];
+  std::atomic<unsigned int> next_used_memory_shard(0);
+  thread_local int used_memory_shard = -1;
+
+  inline std::atomic<size_t>& thread_used_memory() {
+    if (used_memory_shard < 0) {
+      used_memory_shard = next_used_memory_shard.fetch_add(1) % kUsedMemoryShards;
+    }
+    return used_memory[used_memory_shard].bytes;
+  }
+
+  // Transparent huge page size on x86-64.
+  const size_t kZmallocHugeSize = 2 * 1024 * 1024;
 
   // From /proc/[pid]/stat manual:
   // Resident Set Size: number of pages the process has
@@ -54,10 +98,93 @@ namespace {
     fflush(stderr);
     abort();
   }
+
+  // The allocator zmalloc is built on, chosen by MREDIS_MALLOC in cmake.
+  // lib_malloc_size_hint returns the usable size of ptr allocated with
+  // size bytes, which jemalloc and tcmalloc compute without touching ptr.
+#if defined(USE_JEMALLOC)
+  const char *kZmallocLib = "jemalloc";
+  inline void *lib_malloc(size_t size) { return je_malloc(size); }
+  inline void *lib_calloc(size_t size) { return je_calloc(1, size); }
+  inline void *lib_realloc(void *ptr, size_t size) { return je_realloc(ptr, size); }
+  inline void lib_free(void *ptr) { je_free(ptr); }
+  inline void lib_free_sized(void *ptr, size_t size) { je_sdallocx(ptr, size, 0); }
+  inline size_t lib_malloc_size(void *ptr) { return je_malloc_usable_size(ptr); }
+  inline size_t lib_malloc_size_hint(void *ptr, size_t size) {
+    (void)ptr;
+    return je_nallocx(size, 0);
+  }
+#elif defined(USE_TCMALLOC)
+  const char *kZmallocLib = "tcmalloc";
+  inline void *lib_malloc(size_t size) { return tc_malloc(size); }
+  inline void *lib_calloc(size_t size) { return tc_calloc(1, size); }
+  inline void *lib_realloc(void *ptr, size_t size) { return tc_realloc(ptr, size); }
+  inline void lib_free(void *ptr) { tc_free(ptr); }
+  inline void lib_free_sized(void *ptr, size_t size) { tc_free_sized(ptr, size); }
+  inline size_t lib_malloc_size(void *ptr) { return tc_malloc_size(ptr); }
+  inline size_t lib_malloc_size_hint(void *ptr, size_t size) {
+    (void)ptr;
+    return tc_nallocx(size, 0);
+  }
+#else
+#ifdef ZMALLOC_USE_SLAB
+  const char *kZmallocLib = "slab";
+#else
+  const char *kZmallocLib = "libc";
+#endif
+  inline void *lib_malloc(size_t size) { return std::malloc(size); }
+  inline void *lib_calloc(size_t size) { return std::calloc(1, size); }
+  inline void *lib_realloc(void *ptr, size_t size) { return std::realloc(ptr, size); }
+  inline void lib_free(void *ptr) { std::free(ptr); }
+  // libc has no sized free.
+  inline void lib_free_sized(void *ptr, size_t size) { (void)size; std::free(ptr); }
+  inline size_t lib_malloc_size(void *ptr) { return malloc_usable_size(ptr); }
+  inline size_t lib_malloc_size_hint(void *ptr, size_t size) {
+    (void)size;
+    return malloc_usable_size(ptr);
+  }
+#endif
+
+  // Return the slab size class of size, kSlabNoClass if the slab is
+  // disabled or size is too large.
+  inline int zmalloc_size_class(size_t size) {
+#ifdef ZMALLOC_USE_SLAB
+    return mredis::slab_size_class(size);
+#else
+    (void)size;
+    return mredis::kSlabNoClass;
+#endif
+  }
+
+#if !defined(USE_JEMALLOC) && !defined(USE_TCMALLOC)
+  // Stats of the libc heap, used by the slab and libc backends.
+  bool libc_heap_info(size_t *allocated, size_t *active) {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    struct mallinfo2 mi = mallinfo2();
+    *allocated = mi.uordblks + mi.hblkhd;
+    *active = mi.arena + mi.hblkhd;
+    return true;
+#elif defined(__GLIBC__)
+    struct mallinfo mi = mallinfo();
+    *allocated = static_cast<size_t>(mi.uordblks) + mi.hblkhd;
+    *active = static_cast<size_t>(mi.arena) + mi.hblkhd;
+    return true;
+#else
+    *allocated = *active = 0;
+    return false;
+#endif
+  }
+#endif
 }
 
 namespace mredis {
+  // Without prefix the allocator tells us the size of each allocation,
+  // so nothing needs to be stored in front of the returned pointer.
+  #ifdef ZMALLOC_NO_PREFIX
+  #define PREFIX_SIZE (0)
+  #else
   #define PREFIX_SIZE (sizeof(size_t))
+  #endif
   
   #define update_zmalloc_stat_alloc(__n) do { \
     size_t _n = (__n); \
@@ -65,10 +192,12 @@ namespace mredis {
       _n += sizeof(size_t) - (_n & (sizeof(size_t) - 1)); \
     } \
     if (zmalloc_thread_safe_enabled) { \
-      used_memory.fetch_add(_n); \
+      thread_used_memory().fetch_add(_n, std::memory_order_relaxed); \
     } \
     else { \
-      used_memory += _n; \
+      std::atomic<size_t>& _bytes = used_memory[0].bytes; \
+      _bytes.store(_bytes.load(std::memory_order_relaxed) + _n, \
+                   std::memory_order_relaxed); \
     } \
   } while(0)
 
@@ -78,32 +207,114 @@ namespace mredis {
       _n += sizeof(size_t) - (_n & (sizeof(size_t) - 1)); \
     } \
     if (zmalloc_thread_safe_enabled) { \
-      used_memory.fetch_sub(_n); \
+      thread_used_memory().fetch_sub(_n, std::memory_order_relaxed); \
     } \
     else { \
-      used_memory -= _n; \
+      std::atomic<size_t>& _bytes = used_memory[0].bytes; \
+      _bytes.store(_bytes.load(std::memory_order_relaxed) - _n, \
+                   std::memory_order_relaxed); \
     } \
   } while(0)
   
+#ifdef ZMALLOC_NO_PREFIX
+  // malloc a memory and count the usable size of it.
+  void *zmalloc(size_t size) {
+    void *p = lib_malloc(size);
+    if (p == nullptr) zmalloc_oom_handler(size);
+
+    update_zmalloc_stat_alloc(lib_malloc_size(p));
+    return p;
+  }
+
+  void *zcalloc(size_t size) {
+    void *p = lib_calloc(size);
+    if (p == nullptr) zmalloc_oom_handler(size);
+
+    update_zmalloc_stat_alloc(lib_malloc_size(p));
+    return p;
+  }
+
+  void *zrealloc(void *ptr, size_t size) {
+    if (ptr == nullptr) return zmalloc(size);
+
+    // realloc(ptr, 0) may free ptr, keep the block alive like the prefix
+    // version does.
+    size_t oldsize = lib_malloc_size(ptr);
+    void *newptr = lib_realloc(ptr, size ? size : 1);
+    if (newptr == nullptr) zmalloc_oom_handler(size);
+
+    update_zmalloc_stat_free(oldsize);
+    update_zmalloc_stat_alloc(lib_malloc_size(newptr));
+    return newptr;
+  }
+
+  void zfree(void *ptr) {
+    if (ptr == nullptr) return;
+
+    update_zmalloc_stat_free(lib_malloc_size(ptr));
+    lib_free(ptr);
+  }
+
+  void zfree(void *ptr, size_t size) {
+    if (ptr == nullptr) return;
+
+    // zrealloc(ptr, 0) keeps one byte, and the sized free needs a size
+    // between the requested and the usable one.
+    if (size == 0) size = 1;
+    update_zmalloc_stat_free(lib_malloc_size_hint(ptr, size));
+    lib_free_sized(ptr, size);
+  }
+
+  size_t zmalloc_size(void *ptr) {
+    return lib_malloc_size(ptr);
+  }
+#else
+  // Bytes actually taken by an allocation of size, prefix included.
+  // Small allocations take the whole object of their slab size class,
+  // malloc aligns the others to sizeof(size_t).
+  inline size_t zmalloc_real_size(size_t size) {
+    int cls = zmalloc_size_class(size);
+    if (cls != kSlabNoClass) return slab_class_size(cls);
+    return (size + sizeof(size_t) - 1) & ~(sizeof(size_t) - 1);
+  }
+
+  inline void *zmalloc_raw(size_t size) {
+    int cls = zmalloc_size_class(size);
+    return cls == kSlabNoClass ? lib_malloc(size) : slab_alloc(cls);
+  }
+
+  inline void zfree_raw(void *ptr, size_t size) {
+    int cls = zmalloc_size_class(size);
+    if (cls == kSlabNoClass) lib_free(ptr);
+    else slab_free(ptr, cls);
+  }
+
   // malloc a memory, restore the required memory size
   // and count the actually allocated memory size.
   void *zmalloc(size_t size) {
-    void *p = std::malloc(size + PREFIX_SIZE);
+    void *p = zmalloc_raw(size + PREFIX_SIZE);
     if (p == nullptr) zmalloc_oom_handler(size);
 
     *((size_t*)p) = size;
-    update_zmalloc_stat_alloc(size + PREFIX_SIZE);
+    update_zmalloc_stat_alloc(zmalloc_real_size(size + PREFIX_SIZE));
     return (char*)p + PREFIX_SIZE;
   }
   
   // The only difference between zmalloc is zcalloc initialize
   // the allocated memory with zero value.
   void *zcalloc(size_t size) {
-    void *p = std::calloc(1, size + PREFIX_SIZE);
+    void *p;
+    if (zmalloc_size_class(size + PREFIX_SIZE) == kSlabNoClass) {
+      p = lib_calloc(size + PREFIX_SIZE);
+    }
+    else {
+      p = zmalloc_raw(size + PREFIX_SIZE);
+      if (p != nullptr) memset(p, 0, size + PREFIX_SIZE);
+    }
     if (p == nullptr) zmalloc_oom_handler(size);
 
     *((size_t*)p) = size;
-    update_zmalloc_stat_alloc(size + PREFIX_SIZE);
+    update_zmalloc_stat_alloc(zmalloc_real_size(size + PREFIX_SIZE));
     return (char*)p + PREFIX_SIZE;
   }
   
@@ -112,22 +323,162 @@ namespace mredis {
     
     void *realptr = (char*)ptr - PREFIX_SIZE;
     size_t oldsize = *((size_t*)realptr);
-    void *newptr = realloc(realptr, size + PREFIX_SIZE);
-    if (newptr == nullptr) zmalloc_oom_handler(size);
+    int oldcls = zmalloc_size_class(oldsize + PREFIX_SIZE);
+    int newcls = zmalloc_size_class(size + PREFIX_SIZE);
+    void *newptr;
+    if (oldcls == kSlabNoClass && newcls == kSlabNoClass) {
+      newptr = lib_realloc(realptr, size + PREFIX_SIZE);
+      if (newptr == nullptr) zmalloc_oom_handler(size);
+    }
+    else if (oldcls == newcls) {
+      // Still fits in the same slab object.
+      newptr = realptr;
+    }
+    else {
+      newptr = zmalloc_raw(size + PREFIX_SIZE);
+      if (newptr == nullptr) zmalloc_oom_handler(size);
+      memcpy((char*)newptr + PREFIX_SIZE, ptr, oldsize < size ? oldsize : size);
+      zfree_raw(realptr, oldsize + PREFIX_SIZE);
+    }
 
     *((size_t*)newptr) = size;
-    update_zmalloc_stat_free(oldsize);
-    update_zmalloc_stat_alloc(size);
+    update_zmalloc_stat_free(zmalloc_real_size(oldsize + PREFIX_SIZE));
+    update_zmalloc_stat_alloc(zmalloc_real_size(size + PREFIX_SIZE));
     return (char*)newptr + PREFIX_SIZE; 
   }
 
   void zfree(void *ptr) {
+    if (ptr == nullptr) return;
+
     void *realptr = (char*)ptr - PREFIX_SIZE;
     size_t size = *((size_t*)realptr);
-    free(realptr);
-    update_zmalloc_stat_free(size + PREFIX_SIZE);
+    zfree_raw(realptr, size + PREFIX_SIZE);
+    update_zmalloc_stat_free(zmalloc_real_size(size + PREFIX_SIZE));
   }
-  
+
+  // Same as zfree(ptr), but the caller tells the size it asked for, so
+  // we don't need to read the prefix.
+  void zfree(void *ptr, size_t size) {
+    if (ptr == nullptr) return;
+
+    zfree_raw((char*)ptr - PREFIX_SIZE, size + PREFIX_SIZE);
+    update_zmalloc_stat_free(zmalloc_real_size(size + PREFIX_SIZE));
+  }
+
+  // Return the bytes taken by the allocation, prefix included.
+  size_t zmalloc_size(void *ptr) {
+    void *realptr = (char*)ptr - PREFIX_SIZE;
+    return zmalloc_real_size(*((size_t*)realptr) + PREFIX_SIZE);
+  }
+#endif
+
+  // Return true if ptr sits in a sparsely used part of the heap, so that
+  // moving it with zmalloc_defrag() reduces fragmentation. Only the slab
+  // can tell, other backends always return false.
+  bool zmalloc_defrag_hint(void *ptr) {
+#ifdef ZMALLOC_USE_SLAB
+    void *realptr = (char*)ptr - PREFIX_SIZE;
+    int cls = slab_size_class(*((size_t*)realptr) + PREFIX_SIZE);
+    if (cls == kSlabNoClass) return false;
+    return slab_defrag_hint(realptr, cls);
+#else
+    (void)ptr;
+    return false;
+#endif
+  }
+
+  // Allocate and free without the thread cache, used by defrag to take
+  // objects from dense spans and return them to sparse ones at once.
+  void *zmalloc_no_tcache(size_t size) {
+#ifdef ZMALLOC_USE_SLAB
+    int cls = slab_size_class(size + PREFIX_SIZE);
+    if (cls == kSlabNoClass) return zmalloc(size);
+    void *p = slab_alloc_no_tcache(cls);
+    if (p == nullptr) zmalloc_oom_handler(size);
+
+    *((size_t*)p) = size;
+    update_zmalloc_stat_alloc(slab_class_size(cls));
+    return (char*)p + PREFIX_SIZE;
+#else
+    return zmalloc(size);
+#endif
+  }
+
+  void zfree_no_tcache(void *ptr) {
+#ifdef ZMALLOC_USE_SLAB
+    if (ptr == nullptr) return;
+
+    void *realptr = (char*)ptr - PREFIX_SIZE;
+    size_t size = *((size_t*)realptr);
+    int cls = slab_size_class(size + PREFIX_SIZE);
+    if (cls == kSlabNoClass) {
+      zfree(ptr);
+      return;
+    }
+    slab_free_no_tcache(realptr, cls);
+    update_zmalloc_stat_free(slab_class_size(cls));
+#else
+    zfree(ptr);
+#endif
+  }
+
+  // Move the block at ptr if zmalloc_defrag_hint() says so. Return the new
+  // address, or nullptr if ptr was not moved. The content is copied with
+  // memcpy, so ptr must not hold objects that can't be moved that way.
+  void *zmalloc_defrag(void *ptr) {
+    if (ptr == nullptr || !zmalloc_defrag_hint(ptr)) return nullptr;
+
+    size_t size = *((size_t*)((char*)ptr - PREFIX_SIZE));
+    void *newptr = zmalloc_no_tcache(size);
+    memcpy(newptr, ptr, size);
+    zfree_no_tcache(ptr);
+    return newptr;
+  }
+
+  // Zero filled memory for large and long-lived arrays like hash tables.
+  // From kZmallocHugeSize on, the memory is mapped aligned to a huge page
+  // and the kernel is advised to back it with transparent huge pages, so
+  // random access over it doesn't keep missing the TLB. If THP is not
+  // available we still get plain pages. The size must be given to free.
+  void *zcalloc_huge(size_t size) {
+    if (size < kZmallocHugeSize) return zcalloc(size);
+
+    size_t len = (size + kZmallocHugeSize - 1) & ~(kZmallocHugeSize - 1);
+    void *p = mmap(nullptr, len + kZmallocHugeSize, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) zmalloc_oom_handler(size);
+
+    uintptr_t start = reinterpret_cast<uintptr_t>(p);
+    uintptr_t aligned = (start + kZmallocHugeSize - 1) & ~(kZmallocHugeSize - 1);
+    size_t head = aligned - start;
+    size_t tail = kZmallocHugeSize - head;
+    if (head) munmap(p, head);
+    if (tail) munmap(reinterpret_cast<void*>(aligned + len), tail);
+#ifdef MADV_HUGEPAGE
+    madvise(reinterpret_cast<void*>(aligned), len, MADV_HUGEPAGE);
+#endif
+    update_zmalloc_stat_alloc(len);
+    return reinterpret_cast<void*>(aligned);
+  }
+
+  void zfree_huge(void *ptr, size_t size) {
+    if (ptr == nullptr) return;
+    if (size < kZmallocHugeSize) {
+      zfree(ptr, size);
+      return;
+    }
+    size_t len = (size + kZmallocHugeSize - 1) & ~(kZmallocHugeSize - 1);
+    munmap(ptr, len);
+    update_zmalloc_stat_free(len);
+  }
+
+  // Return the bytes taken by ptr allocated by zcalloc_huge(size).
+  size_t zmalloc_huge_size(void *ptr, size_t size) {
+    if (ptr == nullptr) return 0;
+    if (size < kZmallocHugeSize) return zmalloc_size(ptr);
+    return (size + kZmallocHugeSize - 1) & ~(kZmallocHugeSize - 1);
+  }
+
   char *zstrdup(const char *s) {
     size_t len = strlen(s) + 1;
     char *ptr = (char*)zmalloc(len);
@@ -136,7 +487,11 @@ namespace mredis {
   }
   
   size_t zmalloc_used_memory() {
-    return used_memory.fetch_add(0);
+    size_t bytes = 0;
+    for (int i = 0; i < kUsedMemoryShards; ++i) {
+      bytes += used_memory[i].bytes.load(std::memory_order_relaxed);
+    }
+    return bytes;
   }
   
   void zmalloc_enable_thread_safeness() {
@@ -177,6 +532,58 @@ namespace mredis {
     return zmalloc_get_smap_bytes_by_field("Private_Dirty:");
   }
 
+  const char *zmalloc_lib_name() {
+    return kZmallocLib;
+  }
+
+  // Ask the allocator how much memory it handed out (allocated), how much
+  // is in pages holding live objects (active) and how much is mapped in
+  // (resident). Return false if the allocator can't tell.
+  bool zmalloc_get_allocator_info(size_t *allocated, size_t *active,
+                                  size_t *resident) {
+    *allocated = *active = *resident = 0;
+#if defined(USE_JEMALLOC)
+    // Stats are cached by jemalloc, bump the epoch to refresh them.
+    uint64_t epoch = 1;
+    size_t sz = sizeof(epoch);
+    je_mallctl("epoch", &epoch, &sz, &epoch, sz);
+    sz = sizeof(size_t);
+    je_mallctl("stats.allocated", allocated, &sz, NULL, 0);
+    je_mallctl("stats.active", active, &sz, NULL, 0);
+    je_mallctl("stats.resident", resident, &sz, NULL, 0);
+    return true;
+#elif defined(USE_TCMALLOC)
+    size_t heap = 0, unmapped = 0, pageheap_free = 0;
+    MallocExtension_GetNumericProperty("generic.current_allocated_bytes", allocated);
+    MallocExtension_GetNumericProperty("generic.heap_size", &heap);
+    MallocExtension_GetNumericProperty("tcmalloc.pageheap_unmapped_bytes", &unmapped);
+    MallocExtension_GetNumericProperty("tcmalloc.pageheap_free_bytes", &pageheap_free);
+    *resident = heap - unmapped;
+    *active = *resident - pageheap_free;
+    return true;
+#else
+    if (!libc_heap_info(allocated, active)) return false;
+#ifdef ZMALLOC_USE_SLAB
+    size_t slab_allocated, slab_active;
+    slab_get_stats(&slab_allocated, &slab_active);
+    *allocated += slab_allocated;
+    *active += slab_active;
+#endif
+    // libc doesn't report pages given back with madvise, so take active
+    // memory as resident.
+    *resident = *active;
+    return true;
+#endif
+  }
+
+  // How much memory the allocator wastes in partly used pages.
+  float zmalloc_get_allocator_frag_ratio() {
+    size_t allocated, active, resident;
+    if (!zmalloc_get_allocator_info(&allocated, &active, &resident)) return 0;
+    if (allocated == 0) return 0;
+    return (float)active / allocated;
+  }
+
   void zlibc_free(void *ptr) {
     free(ptr);
   }
@@ -1,11 +1,22 @@
 #ifndef MREDIS_SRC_ZMALLOC_H_
 #define MREDIS_SRC_ZMALLOC_H_
 
+#include <cstddef>
+
 namespace mredis {
     void *zmalloc(size_t size);
     void *zcalloc(size_t size);
     void *zrealloc(void *ptr, size_t size);
     void zfree(void *ptr);
+    void zfree(void *ptr, size_t size);
+    size_t zmalloc_size(void *ptr);
+    bool zmalloc_defrag_hint(void *ptr);
+    void *zmalloc_no_tcache(size_t size);
+    void zfree_no_tcache(void *ptr);
+    void *zmalloc_defrag(void *ptr);
+    void *zcalloc_huge(size_t size);
+    void zfree_huge(void *ptr, size_t size);
+    size_t zmalloc_huge_size(void *ptr, size_t size);
     char *zstrdup(const char *s);
     size_t zmalloc_used_memory(void);
     void zmalloc_enable_thread_safeness(void);
@@ -13,6 +24,10 @@ namespace mredis {
     size_t zmalloc_get_rss(void);
     size_t zmalloc_get_private_dirty(void);
     size_t zmalloc_get_smap_bytes_by_field(char *field);
+    const char *zmalloc_lib_name(void);
+    bool zmalloc_get_allocator_info(size_t *allocated, size_t *active,
+                                    size_t *resident);
+    float zmalloc_get_allocator_frag_ratio(void);
     void zlibc_free(void *ptr);
 }
 
@@ -0,0 +1,106 @@
+#include <set>
+#include <thread>
+#include <vector>
+
+#include "mredis/src/concurrent_dict.h"
+#include <gtest/gtest.h>
+
+namespace mredis {
+
+class ConcurrentDictTest : public ::testing::Test {
+ public:
+  ConcurrentDictTest(): dict_(std::hash<int>(), 10) {}
+ protected:
+  ConcurrentDictionary<int, int> dict_;
+};
+
+TEST_F(ConcurrentDictTest, InsertFetch) {
+  ASSERT_EQ(dict_.Shards(), 16u);
+  int max_count = 100000;
+  for (int i = 0; i < max_count; ++i) {
+    ASSERT_TRUE(dict_.Insert(i, i + 1));
+  }
+  ASSERT_FALSE(dict_.Insert(0, 0));
+  ASSERT_EQ(dict_.Size(), static_cast<size_t>(max_count));
+
+  int value = 0;
+  for (int i = 0; i < max_count; ++i) {
+    ASSERT_TRUE(dict_.Fetch(i, &value));
+    ASSERT_EQ(value, i + 1);
+  }
+  ASSERT_FALSE(dict_.Fetch(max_count, &value));
+
+  ASSERT_TRUE(dict_.Update(7, [](int& v) { v *= 2; }));
+  ASSERT_TRUE(dict_.Fetch(7, &value));
+  ASSERT_EQ(value, 16);
+  ASSERT_FALSE(dict_.Update(max_count, [](int& v) { v = 0; }));
+
+  dict_.RehashMilliseconds(100);
+  for (int i = 0; i < max_count; i += 2) {
+    ASSERT_TRUE(dict_.Erase(i));
+  }
+  ASSERT_FALSE(dict_.Erase(0));
+  ASSERT_EQ(dict_.Size(), static_cast<size_t>(max_count / 2));
+
+  static_assert(!std::is_default_constructible<ConcurrentDictionary<int, int>>::value, "");
+  ConcurrentDictionary<int, int, ZmallocAllocator, IntHasher> ints;
+  ASSERT_TRUE(ints.Insert(1, 2));
+  ASSERT_TRUE(ints.Fetch(1, &value));
+  ASSERT_EQ(value, 2);
+}
+
+TEST_F(ConcurrentDictTest, Scan) {
+  int max_count = 20000;
+  for (int i = 0; i < max_count; ++i) {
+    dict_.Insert(i, i);
+  }
+  // Keys present from start to end are returned at least once, even
+  // while shards grow.
+  std::set<int> seen;
+  size_t cursor = 0;
+  int next = max_count;
+  do {
+    cursor = dict_.Scan(cursor, [&seen](const int& key, int& value) {
+      ASSERT_EQ(key, value);
+      seen.insert(key);
+    });
+    if (next < max_count * 3) {
+      for (int i = 0; i < 10; ++i, ++next) dict_.Insert(next, next);
+    }
+  } while (cursor != 0);
+  for (int i = 0; i < max_count; ++i) {
+    ASSERT_TRUE(seen.count(i) == 1);
+  }
+}
+
+TEST_F(ConcurrentDictTest, Threads) {
+  const int kThreads = 4;
+  const int kKeys = 20000;
+  dict_.Insert(-1, 0);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; ++t) {
+    threads.push_back(std::thread([this, t, kKeys]() {
+      int value = 0;
+      for (int i = t * kKeys; i < (t + 1) * kKeys; ++i) {
+        dict_.Insert(i, i);
+        // Keys of the other threads may or may not be there yet.
+        if (dict_.Fetch(i + kKeys, &value)) {
+          EXPECT_EQ(value, i + kKeys);
+        }
+        dict_.Update(-1, [](int& v) { v++; });
+        if (i % 2 == 0) dict_.Erase(i);
+      }
+    }));
+  }
+  for (auto& thread : threads) thread.join();
+
+  int value = 0;
+  ASSERT_TRUE(dict_.Fetch(-1, &value));
+  ASSERT_EQ(value, kThreads * kKeys);
+  ASSERT_EQ(dict_.Size(), static_cast<size_t>(kThreads * kKeys / 2 + 1));
+  for (int i = 0; i < kThreads * kKeys; ++i) {
+    ASSERT_EQ(dict_.Fetch(i, &value), i % 2 == 1);
+  }
+}
+
+}
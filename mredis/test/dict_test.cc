@@ -1,4 +1,10 @@
 #include "mredis/src/dict.h"
+#include "mredis/src/string.h"
+#include "mredis/src/zmalloc.h"
+#include <algorithm>
+#include <set>
+#include <string>
+#include <vector>
 #include <gtest/gtest.h>
 
 namespace mredis {
@@ -60,4 +66,579 @@ TEST_F(DictTest, Iterate) {
   }
 }
 
+TEST_F(DictTest, FetchSome) {
+  int max_count = 1000;
+  for (int i = 0; i < max_count; ++i) {
+    dict_.Insert(i, i);
+  }
+  // Sample in the middle of a rehash as well.
+  for (int round = 0; round < 2; ++round) {
+    auto pairs = dict_.FetchSome(10);
+    ASSERT_EQ(pairs.size(), 10u);
+    std::set<int> keys;
+    for (auto& pair : pairs) {
+      ASSERT_EQ(*pair.first, *pair.second);
+      keys.insert(*pair.first);
+    }
+    ASSERT_EQ(keys.size(), 10u);
+    dict_.Expand(max_count * 4);
+  }
+  ASSERT_EQ(dict_.FetchSome(max_count * 2).size(), static_cast<size_t>(max_count));
+  ASSERT_TRUE(dict_.FetchRandom() != nullptr);
+}
+
+TEST_F(DictTest, FetchRandomFair) {
+  // Keys below half share buckets four by four, the others are alone.
+  int max_count = 1024;
+  Dictionary<int, int> dict([max_count](const int& key) {
+    return static_cast<size_t>(key < max_count / 2 ? key / 4 : key);
+  });
+  for (int i = 0; i < max_count; ++i) {
+    dict.Insert(i, i);
+  }
+  auto sample = [&dict, max_count]() {
+    int samples = max_count * 200;
+    std::vector<int> hits(max_count, 0);
+    for (int i = 0; i < samples; ++i) {
+      hits[*dict.FetchRandom()]++;
+    }
+    // Picking a random entry of a random bucket would give the shared
+    // half a fifth of the samples.
+    int shared = 0;
+    for (int i = 0; i < max_count / 2; ++i) shared += hits[i];
+    ASSERT_NEAR(static_cast<double>(shared) / samples, 0.5, 0.02);
+    // Chi-square with 1023 degrees of freedom, its mean plus six sigma.
+    double expected = static_cast<double>(samples) / max_count;
+    double chi2 = 0;
+    for (int count : hits) {
+      chi2 += (count - expected) * (count - expected) / expected;
+    }
+    ASSERT_LT(chi2, 1300);
+  };
+  sample();
+
+  // Again in the middle of a rehash, with part of the buckets moved. Every
+  // FetchRandom takes a rehash step, a safe iterator holds the rehash where
+  // it is.
+  ASSERT_TRUE(dict.Expand(max_count * 4));
+  for (int i = 0; i < max_count / 8; ++i) dict.Fetch(i);
+  {
+    auto it = dict.SafeBegin();
+    sample();
+    // Expand fails only because the rehash is still in progress.
+    ASSERT_FALSE(dict.Expand(max_count * 16));
+  }
+  while (dict.RehashMilliseconds(100) > 0) {}
+  ASSERT_TRUE(dict.Expand(max_count * 16));
+
+  // A chain longer than asked for isn't always sampled from its head.
+  Dictionary<int, int> chain([](const int&) { return static_cast<size_t>(0); });
+  for (int i = 0; i < 8; ++i) {
+    chain.Insert(i, i);
+  }
+  std::vector<int> hits(8, 0);
+  int rounds = 0;
+  while (rounds < 8000) {
+    // The walk may not reach the only bucket, that's allowed.
+    auto pairs = chain.FetchSome(4);
+    if (pairs.empty()) continue;
+    ASSERT_EQ(pairs.size(), 4u);
+    rounds++;
+    std::set<int> keys;
+    for (auto& pair : pairs) {
+      keys.insert(*pair.first);
+      hits[*pair.first]++;
+    }
+    ASSERT_EQ(keys.size(), 4u);
+  }
+  for (int count : hits) {
+    ASSERT_NEAR(count, 4000, 300);
+  }
+}
+
+TEST_F(DictTest, Defrag) {
+  std::hash<int> hash;
+  Dictionary<int, String> dict(hash);
+  int max_count = 100000;
+  for (int i = 0; i < max_count; ++i) {
+    dict.Insert(i, String(std::to_string(i).c_str()));
+  }
+  // Leave every span sparsely used.
+  for (int i = 0; i < max_count; ++i) {
+    if (i % 10 != 0) dict.Erase(i);
+  }
+
+  size_t allocated, active, resident;
+  zmalloc_get_allocator_info(&allocated, &active, &resident);
+  size_t active_before = active;
+  for (int pass = 0; pass < 5; ++pass) {
+    size_t cursor = 0;
+    do {
+      cursor = dict.Defrag(cursor, 1);
+    } while (cursor != 0);
+  }
+  zmalloc_get_allocator_info(&allocated, &active, &resident);
+  if (std::string(zmalloc_lib_name()) == "slab") {
+    ASSERT_LT(active, active_before);
+  }
+
+  ASSERT_EQ(dict.Size(), static_cast<size_t>(max_count / 10));
+  for (int i = 0; i < max_count; i += 10) {
+    ASSERT_EQ(*dict.Fetch(i), String(std::to_string(i).c_str()));
+  }
+}
+
+TEST_F(DictTest, MemoryUsage) {
+  size_t used = zmalloc_used_memory();
+  std::hash<int> hash;
+  Dictionary<int, String> dict(hash);
+  size_t empty = dict.MemoryUsage();
+  ASSERT_GE(empty, sizeof(dict));
+
+  int max_count = 10000;
+  for (int i = 0; i < max_count; ++i) {
+    dict.Insert(i, String("wzpfish"));
+  }
+  // Every byte of the dictionary is counted by zmalloc.
+  size_t exact = dict.MemoryUsage(0);
+  ASSERT_EQ(exact, empty + zmalloc_used_memory() - used);
+  size_t sampled = dict.MemoryUsage(100);
+  ASSERT_GT(sampled, exact / 2);
+  ASSERT_LT(sampled, exact * 2);
+
+  // Long values sit in the upper half of the buckets, samples from one run
+  // of buckets would see only one kind.
+  std::string long_value(200, 'x');
+  for (int i = max_count / 2; i < max_count; ++i) {
+    dict.Replace(i, String(long_value.c_str()));
+  }
+  exact = dict.MemoryUsage(0);
+  for (int round = 0; round < 10; ++round) {
+    sampled = dict.MemoryUsage(200);
+    ASSERT_GT(sampled, exact * 3 / 4);
+    ASSERT_LT(sampled, exact * 5 / 4);
+  }
+
+  // A sparse table still gives an estimate.
+  dict.Expand(max_count * 64);
+  while (dict.RehashMilliseconds(100) > 0) {}
+  ASSERT_GT(dict.MemoryUsage(5), empty);
+}
+
+namespace {
+  size_t counted_bytes = 0;
+
+  struct CountingAllocator : public ZmallocAllocator {
+    static void* Allocate(size_t size) {
+      counted_bytes += size;
+      return zmalloc(size);
+    }
+    static void Deallocate(void* ptr, size_t size) {
+      counted_bytes -= size;
+      zfree(ptr, size);
+    }
+    static void* AllocateTable(size_t size) {
+      counted_bytes += size;
+      return zcalloc_huge(size);
+    }
+    static void DeallocateTable(void* ptr, size_t size) {
+      if (ptr != nullptr) counted_bytes -= size;
+      zfree_huge(ptr, size);
+    }
+  };
+}
+
+TEST_F(DictTest, Allocator) {
+  {
+    std::hash<int> hash;
+    Dictionary<int, int, CountingAllocator> dict(hash);
+    for (int i = 0; i < 10000; ++i) {
+      dict.Insert(i, i);
+    }
+    ASSERT_GE(counted_bytes, dict.Capacity() * sizeof(void*));
+    for (int i = 0; i < 10000; i += 2) {
+      dict.Erase(i);
+    }
+    ASSERT_EQ(*dict.Fetch(1), 1);
+  }
+  ASSERT_EQ(counted_bytes, 0u);
+}
+
+namespace {
+  int key_compares = 0;
+
+  struct CountingKey {
+    int id;
+    bool operator==(const CountingKey& rhs) const {
+      key_compares++;
+      return id == rhs.id;
+    }
+  };
+}
+
+TEST_F(DictTest, CachedHash) {
+  int hash_calls = 0;
+  // Keys collide in the same bucket unless the table is huge.
+  Dictionary<CountingKey, int> dict([&hash_calls](const CountingKey& key) {
+    hash_calls++;
+    return static_cast<size_t>(key.id) << 20;
+  });
+  int max_count = 1000;
+  for (int i = 0; i < max_count; ++i) {
+    dict.Insert(CountingKey{i}, i);
+  }
+  // One call per insert, rehash reuses the cached hash.
+  ASSERT_EQ(hash_calls, max_count);
+
+  // Only the entry with the same hash is compared.
+  key_compares = 0;
+  for (int i = 0; i < max_count; ++i) {
+    ASSERT_EQ(*dict.Fetch(CountingKey{i}), i);
+  }
+  ASSERT_EQ(key_compares, max_count);
+  key_compares = 0;
+  ASSERT_EQ(dict.Fetch(CountingKey{max_count}), nullptr);
+  ASSERT_TRUE(dict.Erase(CountingKey{0}));
+  ASSERT_EQ(key_compares, 1);
+}
+
+TEST_F(DictTest, HashPolicy) {
+  Dictionary<std::string, int, ZmallocAllocator, MurmurHasher> dict;
+  int max_count = 10000;
+  for (int i = 0; i < max_count; ++i) {
+    ASSERT_TRUE(dict.Insert("key:" + std::to_string(i), i));
+  }
+  for (int i = 0; i < max_count; ++i) {
+    ASSERT_EQ(*dict.Fetch("key:" + std::to_string(i)), i);
+  }
+  ASSERT_TRUE(dict.Erase("key:0"));
+  ASSERT_EQ(dict.Fetch("key:0"), nullptr);
+
+  std::string key = "Hello";
+  ASSERT_EQ(MurmurHasher()(key), MurmurHash2(key.data(), key.size()));
+  ASSERT_EQ(CaseHasher()(key), CaseHasher()(std::string("hELLO")));
+  ASSERT_EQ(Murmur64Hasher()(key), Murmur64Hasher()(std::string("Hello")));
+  ASSERT_NE(Murmur64Hasher()(key), Murmur64Hasher()(std::string("Hellp")));
+
+  // A default std::function would throw on the first hash.
+  static_assert(!std::is_default_constructible<Dictionary<int, int>>::value, "");
+  static_assert(std::is_default_constructible<
+      Dictionary<int, int, ZmallocAllocator, IntHasher>>::value, "");
+}
+
+TEST_F(DictTest, EmbeddedKey) {
+  size_t used = zmalloc_used_memory();
+  {
+    Dictionary<String, int, ZmallocAllocator, MurmurHasher> dict;
+    int max_count = 10000;
+    for (int i = 0; i < max_count; ++i) {
+      ASSERT_TRUE(dict.Insert(String(("key:" + std::to_string(i)).c_str()), i));
+    }
+    ASSERT_EQ(*dict.Fetch(String("key:42")), 42);
+
+    // Short keys live in their entry, the entries and the table are all
+    // the dictionary allocates.
+    ASSERT_TRUE(dict.FetchRandom()->IsEmbedded());
+    ASSERT_EQ(ObjectMemoryUsage(*dict.FetchRandom()), 0u);
+    ASSERT_EQ(dict.MemoryUsage(0), sizeof(dict) + zmalloc_used_memory() - used);
+  }
+  ASSERT_EQ(zmalloc_used_memory(), used);
+}
+
+namespace {
+  int value_copies = 0;
+
+  struct CopyCounter {
+    CopyCounter() : n(0) {}
+    explicit CopyCounter(int v) : n(v) {}
+    CopyCounter(int a, int b) : n(a + b) {}
+    CopyCounter(const CopyCounter& other) : n(other.n) { value_copies++; }
+    CopyCounter(CopyCounter&& other) : n(other.n) {}
+    CopyCounter& operator=(const CopyCounter& other) {
+      n = other.n;
+      value_copies++;
+      return *this;
+    }
+    CopyCounter& operator=(CopyCounter&& other) {
+      n = other.n;
+      return *this;
+    }
+    int n;
+  };
+}
+
+TEST_F(DictTest, Emplace) {
+  std::hash<int> hash;
+  Dictionary<int, CopyCounter> dict(hash);
+  value_copies = 0;
+  ASSERT_TRUE(dict.Insert(1, CopyCounter(1)));
+  ASSERT_FALSE(dict.Insert(1, CopyCounter(2)));
+
+  // Built in place from the arguments, only if the key is new.
+  auto result = dict.TryEmplace(2, 1, 1);
+  ASSERT_TRUE(result.second);
+  ASSERT_EQ(result.first->n, 2);
+  result = dict.TryEmplace(2, 5);
+  ASSERT_FALSE(result.second);
+  ASSERT_EQ(result.first, dict.Fetch(2));
+  ASSERT_EQ(result.first->n, 2);
+
+  ASSERT_TRUE(dict.InsertOrAssign(3, CopyCounter(3)));
+  ASSERT_FALSE(dict.InsertOrAssign(3, CopyCounter(4)));
+  ASSERT_EQ(dict.Fetch(3)->n, 4);
+  ASSERT_TRUE(dict.Replace(4, CopyCounter(4)));
+  ASSERT_FALSE(dict.Replace(4, CopyCounter(5)));
+  ASSERT_EQ(dict.Fetch(4)->n, 5);
+  ASSERT_EQ(value_copies, 0);
+
+  // An lvalue is copied once.
+  CopyCounter value(6);
+  ASSERT_FALSE(dict.InsertOrAssign(4, value));
+  ASSERT_EQ(value_copies, 1);
+
+  // Moved keys are taken over, a key which exists is left alone.
+  Dictionary<String, int, ZmallocAllocator, MurmurHasher> strings;
+  String key("a key which is too long to be embedded");
+  const char* data = key.data();
+  ASSERT_TRUE(strings.Insert(std::move(key), 1));
+  ASSERT_EQ(strings.FetchRandom()->data(), data);
+  String again("a key which is too long to be embedded");
+  ASSERT_FALSE(strings.TryEmplace(std::move(again), 2).second);
+  ASSERT_EQ(again, String("a key which is too long to be embedded"));
+}
+
+TEST_F(DictTest, BulkLoad) {
+  for (int i = 0; i < 1000; ++i) {
+    dict_.Insert(i, i);
+  }
+  // Sized once, nothing is rehashed while loading.
+  int max_count = 100000;
+  DictBulkLoader<int, int, ZmallocAllocator, std::function<size_t(const int&)>> loader(&dict_, max_count);
+  size_t capacity = dict_.Capacity();
+  ASSERT_GE(capacity, static_cast<size_t>(max_count + 1000));
+  for (int i = 1000; i < 50000; ++i) {
+    loader.Add(i, i);
+  }
+  std::vector<std::pair<int, int>> items;
+  for (int i = 50000; i < max_count + 1000; ++i) {
+    items.push_back(std::make_pair(i, i));
+  }
+  loader.AddBatch(items.data(), items.size(), 4);
+  ASSERT_EQ(dict_.Capacity(), capacity);
+  ASSERT_EQ(dict_.Size(), static_cast<size_t>(max_count + 1000));
+  for (int i = 0; i < max_count + 1000; ++i) {
+    ASSERT_EQ(*dict_.Fetch(i), i);
+  }
+
+  // Still a usual dictionary afterwards.
+  ASSERT_FALSE(dict_.Insert(0, 0));
+  ASSERT_TRUE(dict_.Insert(max_count + 1000, 0));
+  ASSERT_TRUE(dict_.Erase(1));
+
+  // A new dictionary with no key expected still gets a table. More keys
+  // than expected make chains longer till the next Insert grows it.
+  std::hash<int> hash;
+  Dictionary<int, int> empty(hash);
+  DictBulkLoader<int, int, ZmallocAllocator, std::function<size_t(const int&)>> none(&empty, 0);
+  ASSERT_GT(empty.Capacity(), 0u);
+  size_t initial = empty.Capacity();
+  for (int i = 0; i < 100; ++i) {
+    none.Add(i, i);
+  }
+  ASSERT_EQ(empty.Capacity(), initial);
+  for (int i = 0; i < 100; ++i) {
+    ASSERT_EQ(*empty.Fetch(i), i);
+  }
+  ASSERT_TRUE(empty.Insert(100, 100));
+  ASSERT_GT(empty.Capacity(), initial);
+}
+
+TEST_F(DictTest, Scan) {
+  int max_count = 10000;
+  for (int i = 0; i < max_count; ++i) {
+    dict_.Insert(i, i);
+  }
+
+  // No change while scanning, every key once.
+  std::vector<int> seen(max_count * 3, 0);
+  size_t cursor = 0;
+  do {
+    cursor = dict_.Scan(cursor, [&seen](const int& key, int& value) {
+      seen[key]++;
+      value++;
+    });
+  } while (cursor != 0);
+  for (int i = 0; i < max_count; ++i) {
+    ASSERT_EQ(seen[i], 1);
+    ASSERT_EQ(*dict_.Fetch(i), i + 1);
+  }
+
+  // Grow to 3 times the size, then shrink back in the middle of a scan.
+  // Keys there all along are returned at least once.
+  std::fill(seen.begin(), seen.end(), 0);
+  int next = max_count;
+  int calls = 0;
+  cursor = 0;
+  do {
+    cursor = dict_.Scan(cursor, [&seen](const int& key, int&) {
+      seen[key]++;
+    });
+    calls++;
+    if (next < max_count * 3) {
+      for (int i = 0; i < 20; ++i, ++next) dict_.Insert(next, next);
+    }
+    else if (dict_.Size() > static_cast<size_t>(max_count)) {
+      for (int i = max_count; i < next; ++i) dict_.Erase(i);
+      dict_.Expand(dict_.Size());
+    }
+  } while (cursor != 0);
+  ASSERT_GT(calls, 1000);
+  for (int i = 0; i < max_count; ++i) {
+    ASSERT_GE(seen[i], 1);
+  }
+  ASSERT_EQ(dict_.Size(), static_cast<size_t>(max_count));
+}
+
+TEST_F(DictTest, RehashParallel) {
+  int max_count = 300000;
+  for (int i = 0; i < max_count; ++i) {
+    dict_.Insert(i, i);
+  }
+  while (dict_.RehashMilliseconds(100) > 0) {}
+  ASSERT_TRUE(dict_.Expand(max_count * 8));
+
+  // Keep using the dictionary between rounds.
+  int next = max_count;
+  size_t visited = 0;
+  while (true) {
+    size_t rounds = dict_.RehashParallel(0, 4);
+    if (rounds == 0) break;
+    visited += rounds;
+    ASSERT_EQ(*dict_.Fetch(next - 1), next - 1);
+    ASSERT_TRUE(dict_.Insert(next, next));
+    ASSERT_TRUE(dict_.Erase(next - max_count));
+    next++;
+  }
+  ASSERT_GT(visited, 0u);
+  ASSERT_EQ(dict_.Size(), static_cast<size_t>(max_count));
+  for (int i = next - max_count; i < next; ++i) {
+    ASSERT_EQ(*dict_.Fetch(i), i);
+  }
+
+  // Shrinking falls back to this thread.
+  DictResizePolicy policy;
+  policy.min_fill_percent = 0;
+  dict_.SetResizePolicy(policy);
+  for (int i = next - max_count; i < next - 1000; ++i) {
+    dict_.Erase(i);
+  }
+  ASSERT_TRUE(dict_.Expand(1000));
+  while (dict_.RehashParallel(100, 4) > 0) {}
+  for (int i = next - 1000; i < next; ++i) {
+    ASSERT_EQ(*dict_.Fetch(i), i);
+  }
+}
+
+TEST_F(DictTest, ResizePolicy) {
+  int max_count = 100000;
+  for (int i = 0; i < max_count; ++i) {
+    dict_.Insert(i, i);
+  }
+  while (dict_.RehashMilliseconds(100) > 0) {}
+  size_t large = dict_.Capacity();
+
+  // Erasing most keys gives the buckets back by itself.
+  for (int i = 100; i < max_count; ++i) {
+    ASSERT_TRUE(dict_.Erase(i));
+  }
+  while (dict_.RehashMilliseconds(100) > 0) {}
+  ASSERT_LE(dict_.Capacity(), large / 64);
+  for (int i = 0; i < 100; ++i) {
+    ASSERT_EQ(*dict_.Fetch(i), i);
+  }
+
+  // Disabled on this dictionary only, it grows at force_ratio.
+  std::hash<int> hash;
+  Dictionary<int, int> other(hash);
+  dict_.DisableResize();
+  ASSERT_FALSE(dict_.Shrink());
+  size_t small = dict_.Capacity();
+  for (int i = 100; i < static_cast<int>(small * 2); ++i) {
+    dict_.Insert(i, i);
+    other.Insert(i, i);
+  }
+  ASSERT_EQ(dict_.Capacity(), small);
+  ASSERT_GT(other.Capacity(), small);
+  dict_.EnableResize();
+
+  // A lower load factor and faster growth.
+  DictResizePolicy policy;
+  policy.max_load = 0.5;
+  policy.growth_factor = 8;
+  Dictionary<int, int> sparse(hash);
+  sparse.SetResizePolicy(policy);
+  for (int i = 0; i < 1000; ++i) {
+    sparse.Insert(i, i);
+  }
+  // 4, 16, 64, 256, 1024 then 4096 buckets, 2048 under the default load.
+  ASSERT_EQ(sparse.Capacity(), 4096u);
+
+  // Below 1 / growth_factor the table grows past used / max_load.
+  policy.max_load = 0.25;
+  policy.growth_factor = 2;
+  Dictionary<int, int> sparser(hash);
+  sparser.SetResizePolicy(policy);
+  for (int i = 0; i < 1000; ++i) {
+    sparser.Insert(i, i);
+    ASSERT_LE(sparser.Size() * 4, sparser.Capacity());
+  }
+  ASSERT_EQ(sparser.Capacity(), 4096u);
+
+  // Shrinking keeps the load under max_load too, 100 keys take 512
+  // buckets and one more insert doesn't grow them back.
+  for (int i = 100; i < 1000; ++i) {
+    ASSERT_TRUE(sparser.Erase(i));
+  }
+  while (sparser.RehashMilliseconds(100) > 0) {}
+  sparser.Shrink();
+  while (sparser.RehashMilliseconds(100) > 0) {}
+  ASSERT_EQ(sparser.Capacity(), 512u);
+  ASSERT_TRUE(sparser.Insert(1000, 1000));
+  ASSERT_EQ(sparser.Capacity(), 512u);
+}
+
+TEST_F(DictTest, MultiFetch) {
+  int* values[40];
+  std::vector<int> keys;
+  for (int i = 0; i < 40; ++i) keys.push_back(i);
+  dict_.MultiFetch(keys.data(), keys.size(), values);
+  for (int i = 0; i < 40; ++i) ASSERT_EQ(values[i], nullptr);
+
+  // Even keys only, and look up while the table is rehashing.
+  int max_count = 20000;
+  for (int i = 0; i < max_count; i += 2) {
+    dict_.Insert(i, i + 1);
+  }
+  while (dict_.RehashMilliseconds(100) > 0) {}
+  ASSERT_TRUE(dict_.Expand(max_count * 4));
+  for (int base = 0; base < max_count; base += 37) {
+    keys.clear();
+    for (int i = base; i < base + 37; ++i) keys.push_back(i);
+    dict_.MultiFetch(keys.data(), 37, values);
+    for (int i = 0; i < 37; ++i) {
+      if (keys[i] % 2 == 0 && keys[i] < max_count) {
+        ASSERT_EQ(values[i], dict_.Fetch(keys[i]));
+        ASSERT_EQ(*values[i], keys[i] + 1);
+      }
+      else {
+        ASSERT_EQ(values[i], nullptr);
+      }
+    }
+    // New keys go to the new table during rehash.
+    dict_.Insert(max_count * 2 + base, 0);
+  }
+  int key = max_count * 2;
+  dict_.MultiFetch(&key, 1, values);
+  ASSERT_NE(values[0], nullptr);
+}
 }
\ No newline at end of file
@@ -0,0 +1,142 @@
+#include <string>
+
+#include "mredis/src/evict.h"
+#include "mredis/src/string.h"
+#include "mredis/src/zmalloc.h"
+#include <gtest/gtest.h>
+
+namespace mredis {
+
+namespace {
+  struct Object {
+    String value;
+    uint32_t lru;
+  };
+
+  std::string Key(int i) {
+    return "key:" + std::to_string(i);
+  }
+}
+
+class EvictTest : public ::testing::Test {
+ public:
+  EvictTest(): dict_(hash_), expires_(hash_), evictor_(&dict_, &expires_) {}
+ protected:
+  // Fill count keys, return the bytes they take.
+  size_t Fill(int count) {
+    size_t used = zmalloc_used_memory();
+    for (int i = 0; i < count; ++i) {
+      Object object;
+      object.value = String("wzpfish");
+      object.lru = evictor_.InitialLRU();
+      dict_.Insert(Key(i), object);
+    }
+    return zmalloc_used_memory() - used;
+  }
+
+  std::hash<std::string> hash_;
+  Dictionary<std::string, Object> dict_;
+  Dictionary<std::string, long long> expires_;
+  Evictor<std::string, Object> evictor_;
+};
+
+TEST_F(EvictTest, NoEviction) {
+  Fill(100);
+  evictor_.SetMaxmemory(1);
+  ASSERT_FALSE(evictor_.PerformEvictions());
+  ASSERT_EQ(dict_.Size(), 100u);
+
+  evictor_.SetMaxmemory(0);
+  ASSERT_TRUE(evictor_.PerformEvictions());
+}
+
+TEST_F(EvictTest, AllKeysLRU) {
+  evictor_.SetPolicy(MaxmemoryPolicy::kAllKeysLRU);
+  int max_count = 2000;
+  size_t bytes = Fill(max_count);
+  // Odd keys were accessed 100 seconds ago.
+  uint32_t old = (LRUClock() - 100) & kLRUClockMax;
+  for (int i = 1; i < max_count; i += 2) {
+    dict_.Fetch(Key(i))->lru = old;
+  }
+
+  evictor_.SetMaxmemory(zmalloc_used_memory() - bytes / 4);
+  ASSERT_TRUE(evictor_.PerformEvictions());
+  ASSERT_LE(zmalloc_used_memory(), evictor_.Maxmemory());
+  ASSERT_GT(evictor_.Evicted(), 0u);
+
+  size_t evicted_old = 0;
+  for (int i = 1; i < max_count; i += 2) {
+    if (dict_.Fetch(Key(i)) == nullptr) evicted_old++;
+  }
+  ASSERT_GE(evicted_old * 10, evictor_.Evicted() * 9);
+}
+
+TEST_F(EvictTest, AllKeysLFU) {
+  evictor_.SetPolicy(MaxmemoryPolicy::kAllKeysLFU);
+  int max_count = 2000;
+  size_t bytes = Fill(max_count);
+  // Even keys are hot.
+  for (int i = 0; i < max_count; i += 2) {
+    Object* object = dict_.Fetch(Key(i));
+    object->lru = (object->lru & ~255u) | 100;
+  }
+
+  evictor_.SetMaxmemory(zmalloc_used_memory() - bytes / 4);
+  ASSERT_TRUE(evictor_.PerformEvictions());
+  size_t evicted_hot = 0;
+  for (int i = 0; i < max_count; i += 2) {
+    if (dict_.Fetch(Key(i)) == nullptr) evicted_hot++;
+  }
+  ASSERT_LE(evicted_hot * 10, evictor_.Evicted());
+
+  // The counter grows on access and never passes 255.
+  Object object;
+  object.lru = evictor_.InitialLRU();
+  for (int i = 0; i < 1000; ++i) evictor_.Touch(object);
+  ASSERT_GT(object.lru & 255, static_cast<uint32_t>(kLFUInitValue));
+  ASSERT_LE(object.lru & 255, 255u);
+}
+
+TEST_F(EvictTest, VolatileTTL) {
+  evictor_.SetPolicy(MaxmemoryPolicy::kVolatileTTL);
+  int max_count = 2000;
+  size_t bytes = Fill(max_count);
+  // Only keys below 1000 have a TTL, lower ones expire sooner.
+  for (int i = 0; i < 1000; ++i) {
+    expires_.Insert(Key(i), 1000000 + i);
+  }
+
+  evictor_.SetMaxmemory(zmalloc_used_memory() - bytes / 8);
+  ASSERT_TRUE(evictor_.PerformEvictions());
+  for (int i = 1000; i < max_count; ++i) {
+    ASSERT_TRUE(dict_.Fetch(Key(i)) != nullptr);
+  }
+  size_t evicted_soon = 0;
+  for (int i = 0; i < 500; ++i) {
+    if (dict_.Fetch(Key(i)) == nullptr) evicted_soon++;
+  }
+  ASSERT_GE(evicted_soon * 10, evictor_.Evicted() * 8);
+  ASSERT_EQ(expires_.Size() + evictor_.Evicted(), 1000u);
+
+  // Out of keys with a TTL.
+  evictor_.SetMaxmemory(1);
+  ASSERT_FALSE(evictor_.PerformEvictions());
+  ASSERT_EQ(expires_.Size(), 0u);
+  ASSERT_EQ(dict_.Size(), 1000u);
+}
+
+TEST_F(EvictTest, Random) {
+  evictor_.SetPolicy(MaxmemoryPolicy::kVolatileRandom);
+  size_t bytes = Fill(1000);
+  evictor_.SetMaxmemory(zmalloc_used_memory() - bytes / 2);
+  ASSERT_FALSE(evictor_.PerformEvictions());
+  ASSERT_EQ(dict_.Size(), 1000u);
+
+  evictor_.SetPolicy(MaxmemoryPolicy::kAllKeysRandom);
+  ASSERT_TRUE(evictor_.PerformEvictions());
+  ASSERT_LE(zmalloc_used_memory(), evictor_.Maxmemory());
+  ASSERT_LT(dict_.Size(), 1000u);
+}
+
+}
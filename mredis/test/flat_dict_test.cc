@@ -0,0 +1,202 @@
+#include <set>
+#include <string>
+#include <unordered_map>
+
+#include "mredis/src/flat_dict.h"
+#include "mredis/src/zmalloc.h"
+#include <gtest/gtest.h>
+
+namespace mredis {
+
+class FlatDictTest : public ::testing::Test {
+ public:
+  FlatDictTest(): dict_(std::hash<int>()) {}
+ protected:
+  FlatDictionary<int, int> dict_;
+};
+
+TEST_F(FlatDictTest, InsertFetch) {
+  int max_count = 100000;
+  for (int i = 0; i < max_count; ++i) {
+    ASSERT_TRUE(dict_.Insert(i, i * 2));
+    ASSERT_FALSE(dict_.Insert(i, i));
+  }
+  ASSERT_EQ(dict_.Size(), static_cast<size_t>(max_count));
+  for (int i = 0; i < max_count; ++i) {
+    ASSERT_EQ(*dict_.Fetch(i), i * 2);
+  }
+  ASSERT_TRUE(dict_.Fetch(max_count) == nullptr);
+}
+
+TEST_F(FlatDictTest, Iterate) {
+  int max_count = 10000;
+  for (int i = 0; i < max_count; ++i) {
+    dict_.Insert(i, i);
+  }
+  // Make sure we iterate while rehashing too.
+  dict_.Expand(max_count * 4);
+  int count = 0;
+  for (auto it = dict_.SafeBegin(); it != dict_.SafeEnd(); ++it) {
+    ASSERT_EQ(it->key, it->value);
+    count++;
+  }
+  ASSERT_EQ(count, max_count);
+}
+
+// Safe iterators pause rehashing, inserts must still find room without
+// moving the entry under the iterator or returning a key twice.
+TEST_F(FlatDictTest, InsertWhileIterating) {
+  int max_count = 1000;
+  for (int i = 0; i < max_count; ++i) {
+    dict_.Insert(i, i);
+  }
+  std::set<int> seen;
+  for (auto it = dict_.SafeBegin(); it != dict_.SafeEnd(); ++it) {
+    int key = it->key;
+    ASSERT_EQ(key % max_count, it->value % max_count);
+    ASSERT_TRUE(seen.insert(key).second);
+    if (key >= max_count) continue;
+    for (int i = 1; i <= 10; ++i) {
+      dict_.Insert(key + i * max_count, key + i * max_count);
+    }
+    ASSERT_EQ(it->key, key);
+  }
+  for (int i = 0; i < max_count; ++i) {
+    ASSERT_EQ(seen.count(i), 1u);
+  }
+  ASSERT_EQ(dict_.Size(), static_cast<size_t>(max_count * 11));
+  for (int i = 0; i < max_count * 11; ++i) {
+    ASSERT_EQ(*dict_.Fetch(i), i);
+  }
+  // The tables set aside are merged once the iterator is gone.
+  dict_.RehashMilliseconds(100);
+  ASSERT_EQ(dict_.Size(), static_cast<size_t>(max_count * 11));
+  ASSERT_EQ(*dict_.Fetch(max_count * 11 - 1), max_count * 11 - 1);
+
+  IntDictionary<int64_t> ints;
+  for (int64_t i = 0; i < max_count; ++i) {
+    ints.Insert(i, i);
+  }
+  std::set<int64_t> seen_ints;
+  for (auto it = ints.SafeBegin(); it != ints.SafeEnd(); ++it) {
+    ASSERT_TRUE(seen_ints.insert(it->key).second);
+    if (it->key < max_count) ints.Insert(it->key + max_count, it->key);
+  }
+  ASSERT_EQ(ints.Size(), static_cast<size_t>(max_count * 2));
+
+  // A moved from key would be empty.
+  FlatDictionary<std::string, int> strings(std::hash<std::string>{});
+  for (int i = 0; i < max_count; ++i) {
+    strings.Insert("key:" + std::to_string(i), i);
+  }
+  int count = 0;
+  for (auto it = strings.SafeBegin(); it != strings.SafeEnd(); ++it) {
+    std::string key = it->key;
+    if (it->value < max_count) strings.Insert(key + ":new", max_count);
+    ASSERT_EQ(it->key, key);
+    count++;
+  }
+  ASSERT_GE(count, max_count);
+  ASSERT_LE(count, max_count * 2);
+  ASSERT_EQ(strings.Size(), static_cast<size_t>(max_count * 2));
+}
+
+// Mixed operations checked against std::unordered_map, erasing leaves
+// tombstones which must not break probing.
+TEST_F(FlatDictTest, RandomOperations) {
+  std::unordered_map<int, int> expect;
+  std::srand(1);
+  for (int i = 0; i < 200000; ++i) {
+    int key = std::rand() % 5000;
+    switch (std::rand() % 3) {
+      case 0:
+        ASSERT_EQ(dict_.Insert(key, i), expect.emplace(key, i).second);
+        break;
+      case 1:
+        ASSERT_EQ(dict_.Erase(key), expect.erase(key) == 1);
+        break;
+      default: {
+        int* value = dict_.Fetch(key);
+        auto it = expect.find(key);
+        ASSERT_EQ(value != nullptr, it != expect.end());
+        if (value != nullptr) {
+          ASSERT_EQ(*value, it->second);
+        }
+      }
+    }
+    ASSERT_EQ(dict_.Size(), expect.size());
+  }
+  ASSERT_TRUE(dict_.Shrink() || dict_.Capacity() <= expect.size() * 2);
+  for (auto& pair : expect) {
+    ASSERT_EQ(*dict_.Fetch(pair.first), pair.second);
+  }
+}
+
+TEST_F(FlatDictTest, FetchRandom) {
+  ASSERT_TRUE(dict_.FetchRandom() == nullptr);
+  for (int i = 0; i < 1000; ++i) {
+    dict_.Insert(i, i);
+  }
+  for (int i = 0; i < 100; ++i) {
+    int* key = dict_.FetchRandom();
+    ASSERT_TRUE(key != nullptr);
+    ASSERT_TRUE(*key >= 0 && *key < 1000);
+  }
+  auto pairs = dict_.FetchSome(10);
+  ASSERT_EQ(pairs.size(), 10u);
+  for (auto& pair : pairs) {
+    ASSERT_EQ(*pair.first, *pair.second);
+  }
+}
+
+TEST_F(FlatDictTest, MemoryUsage) {
+  size_t used = zmalloc_used_memory();
+  {
+    std::hash<std::string> hash;
+    FlatDictionary<std::string, int> dict(hash);
+    for (int i = 0; i < 10000; ++i) {
+      dict.Insert(std::to_string(i), i);
+    }
+    ASSERT_EQ(dict.MemoryUsage(0), sizeof(dict) + zmalloc_used_memory() - used);
+    dict.Clear();
+    ASSERT_EQ(dict.Size(), 0u);
+    dict.Insert("wzpfish", 1);
+    ASSERT_EQ(*dict.Fetch("wzpfish"), 1);
+  }
+  ASSERT_EQ(zmalloc_used_memory(), used);
+}
+
+TEST(IntDictTest, InsertFetch) {
+  IntDictionary<int64_t> dict;
+  // Keys with a stride of 2^20, spread by IntHasher alone since FlatHash
+  // doesn't mix its hash again.
+  int64_t max_count = 100000;
+  for (int64_t i = 0; i < max_count; ++i) {
+    ASSERT_TRUE(dict.Insert(i << 20, i));
+    ASSERT_TRUE(dict.Insert(-i - 1, i));
+  }
+  ASSERT_EQ(dict.Size(), static_cast<size_t>(max_count * 2));
+  dict.RehashMilliseconds(100);
+  for (int64_t i = 0; i < max_count; ++i) {
+    ASSERT_EQ(*dict.Fetch(i << 20), i);
+    ASSERT_EQ(*dict.Fetch(-i - 1), i);
+  }
+  ASSERT_TRUE(dict.Fetch(1) == nullptr);
+
+  int64_t* key = dict.FetchRandom();
+  ASSERT_TRUE(key != nullptr);
+  ASSERT_EQ(*dict.Fetch(*key), *key < 0 ? -*key - 1 : *key >> 20);
+  ASSERT_EQ(dict.FetchSome(10).size(), 10u);
+  for (int64_t i = 0; i < max_count; ++i) {
+    ASSERT_TRUE(dict.Erase(i << 20));
+  }
+  ASSERT_EQ(dict.Size(), static_cast<size_t>(max_count));
+
+  static_assert(!std::is_default_constructible<FlatDictionary<int, int>>::value, "");
+
+  IntHasher hash;
+  ASSERT_NE(hash(1), hash(2));
+  ASSERT_NE(hash(1 << 20) & 0xFFFF, hash(2 << 20) & 0xFFFF);
+}
+
+}
@@ -0,0 +1,123 @@
+#include <string>
+#include <vector>
+
+#include "mredis/src/dict.h"
+#include "mredis/src/hash.h"
+#include <gtest/gtest.h>
+
+namespace mredis {
+
+TEST(HashTest, SipHashVectors) {
+  // Reference vectors of SipHash-2-4: key 00..0f, input 00, 01, ...
+  uint8_t key[kHashKeySize];
+  uint8_t input[64];
+  for (size_t i = 0; i < sizeof(key); ++i) key[i] = i;
+  for (size_t i = 0; i < sizeof(input); ++i) input[i] = i;
+  ASSERT_EQ(SipHash(input, 0, key), 0x726fdb47dd0e0e31ULL);
+  ASSERT_EQ(SipHash(input, 1, key), 0x74f839c593dc67fdULL);
+  ASSERT_EQ(SipHash(input, 15, key), 0xa129ca6149be45e5ULL);
+  ASSERT_NE(SipHash13(input, 15, key), SipHash(input, 15, key));
+
+  uint8_t other[kHashKeySize] = {1};
+  ASSERT_NE(SipHash(input, 15, other), SipHash(input, 15, key));
+}
+
+TEST(HashTest, WyHashVectors) {
+  ASSERT_EQ(WyHash("", 0, 0), 0x93228a4de0eec5a2ULL);
+  ASSERT_EQ(WyHash("a", 1, 1), 0xc5bac3db178713c4ULL);
+  ASSERT_EQ(WyHash("abc", 3, 2), 0xa97f2f7b1d9b3314ULL);
+}
+
+namespace {
+  // The sanity buffer of xxHash's own tests, bytes from a 64 bit LCG.
+  std::vector<uint8_t> Xxh3TestBuffer(size_t len) {
+    std::vector<uint8_t> buffer(len);
+    uint64_t gen = 2654435761ULL;
+    for (size_t i = 0; i < len; ++i) {
+      buffer[i] = static_cast<uint8_t>(gen >> 56);
+      gen *= 11400714785074694797ULL;
+    }
+    return buffer;
+  }
+}
+
+TEST(HashTest, Xxh3Vectors) {
+  // From xsum_sanity_check.c of xxHash 0.8.2, seed 0 and PRIME64. Every
+  // length class of XXH3 is covered, the long ones on each simd.
+  const uint64_t kPrime64 = 11400714785074694797ULL;
+  const struct {
+    size_t len;
+    uint64_t seed;
+    uint64_t hash;
+  } vectors[] = {
+    {0, 0, 0x2D06800538D394C2ULL}, {0, kPrime64, 0xA8A6B918B2F0364AULL},
+    {1, 0, 0xC44BDFF4074EECDBULL}, {1, kPrime64, 0x032BE332DD766EF8ULL},
+    {6, 0, 0x27B56A84CD2D7325ULL}, {6, kPrime64, 0x84589C116AB59AB9ULL},
+    {12, 0, 0xA713DAF0DFBB77E7ULL}, {12, kPrime64, 0xE7303E1B2336DE0EULL},
+    {24, 0, 0xA3FE70BF9D3510EBULL}, {24, kPrime64, 0x850E80FC35BDD690ULL},
+    {48, 0, 0x397DA259ECBA1F11ULL}, {48, kPrime64, 0xADC2CBAA44ACC616ULL},
+    {80, 0, 0xBCDEFBBB2C47C90AULL}, {80, kPrime64, 0xC6DD0CB699532E73ULL},
+    {195, 0, 0xCD94217EE362EC3AULL}, {195, kPrime64, 0xBA68003D370CB3D9ULL},
+    {403, 0, 0xCDEB804D65C6DEA4ULL}, {403, kPrime64, 0x6259F6ECFD6443FDULL},
+    {512, 0, 0x617E49599013CB6BULL}, {512, kPrime64, 0x3CE457DE14C27708ULL},
+    {2048, 0, 0xDD59E2C3A5F038E0ULL}, {2048, kPrime64, 0x66F81670669ABABCULL},
+    {2240, 0, 0x6E73A90539CF2948ULL}, {2240, kPrime64, 0x757BA8487D1B5247ULL},
+    {2367, 0, 0xCB37AEB9E5D361EDULL}, {2367, kPrime64, 0xD2DB3415B942B42AULL},
+  };
+  std::vector<uint8_t> buffer = Xxh3TestBuffer(4096);
+  for (auto& v : vectors) {
+    ASSERT_EQ(Xxh3Hash(buffer.data(), v.len, v.seed), v.hash) << v.len;
+    for (HashSimd simd : {HashSimd::kDefault, HashSimd::kAvx2}) {
+      if (!HashSimdSupported(simd)) continue;
+      ASSERT_EQ(Xxh3Hash(buffer.data(), v.len, v.seed, simd), v.hash) << v.len;
+    }
+  }
+  ASSERT_EQ(FastHash(buffer.data(), 2048, 0), 0xDD59E2C3A5F038E0ULL);
+}
+
+TEST(HashTest, Xxh3Simd) {
+  if (!HashSimdSupported(HashSimd::kAvx2)) return;
+  // Every stripe and block boundary around the first few blocks.
+  std::vector<uint8_t> buffer = Xxh3TestBuffer(8192);
+  for (size_t len = 0; len <= buffer.size(); len += len < 2048 ? 1 : 61) {
+    for (uint64_t seed : {0ULL, 42ULL, ~0ULL}) {
+      ASSERT_EQ(Xxh3Hash(buffer.data(), len, seed, HashSimd::kDefault),
+                Xxh3Hash(buffer.data(), len, seed, HashSimd::kAvx2)) << len;
+    }
+  }
+}
+
+TEST(HashTest, Avalanche) {
+  // Flipping one input bit flips about half of the output bits.
+  std::string key = "user:session:1234567890";
+  int flipped = 0;
+  int count = 0;
+  for (size_t i = 0; i < key.size() * 8; ++i) {
+    std::string other = key;
+    other[i / 8] ^= 1 << (i % 8);
+    flipped += __builtin_popcountll(SipHash13(key.data(), key.size(), HashKey())
+                                    ^ SipHash13(other.data(), other.size(), HashKey()));
+    flipped += __builtin_popcountll(FastHash(key.data(), key.size(), HashSeed())
+                                    ^ FastHash(other.data(), other.size(), HashSeed()));
+    count += 2;
+  }
+  ASSERT_GT(flipped, count * 28);
+  ASSERT_LT(flipped, count * 36);
+}
+
+TEST(HashTest, Hasher) {
+  Dictionary<std::string, int, ZmallocAllocator, SipHasher> sip;
+  Dictionary<std::string, int, ZmallocAllocator, FastHasher> fast;
+  for (int i = 0; i < 10000; ++i) {
+    std::string key = "key:" + std::to_string(i);
+    if (i % 100 == 0) key.append(1000, 'x');
+    ASSERT_TRUE(sip.Insert(key, i));
+    ASSERT_TRUE(fast.Insert(key, i));
+  }
+  ASSERT_EQ(*sip.Fetch("key:1"), 1);
+  ASSERT_EQ(*fast.Fetch("key:1"), 1);
+  ASSERT_EQ(*fast.Fetch("key:100" + std::string(1000, 'x')), 100);
+  ASSERT_EQ(sip.Fetch("key:100"), nullptr);
+}
+
+}
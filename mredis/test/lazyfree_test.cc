@@ -0,0 +1,53 @@
+#include "mredis/src/lazyfree.h"
+#include "mredis/src/skiplist.h"
+#include "mredis/src/zmalloc.h"
+#include <gtest/gtest.h>
+
+namespace mredis {
+
+TEST(LazyfreeTest, Erase) {
+  size_t used = zmalloc_used_memory();
+  size_t freed = LazyfreeFreedObjects();
+  {
+    std::hash<int> hash;
+    Dictionary<int, SkipList<int>> dict(hash);
+    dict.Insert(1, SkipList<int>());
+    dict.Insert(2, SkipList<int>());
+    for (int i = 0; i < 10000; ++i) {
+      dict.Fetch(1)->Insert(i, i);
+    }
+    dict.Fetch(2)->Insert(0, 0);
+
+    ASSERT_TRUE(LazyfreeErase(dict, 1));
+    ASSERT_TRUE(LazyfreeErase(dict, 2));
+    ASSERT_FALSE(LazyfreeErase(dict, 3));
+    ASSERT_TRUE(dict.Fetch(1) == nullptr);
+    ASSERT_EQ(dict.Size(), 0u);
+  }
+  LazyfreeWait();
+  ASSERT_EQ(LazyfreePendingObjects(), 0u);
+  // Only the large one is freed in the background.
+  ASSERT_EQ(LazyfreeFreedObjects(), freed + 1);
+  ASSERT_EQ(zmalloc_used_memory(), used);
+}
+
+TEST(LazyfreeTest, Clear) {
+  size_t used = zmalloc_used_memory();
+  {
+    std::hash<int> hash;
+    Dictionary<int, int> dict(hash);
+    for (int i = 0; i < 10000; ++i) {
+      dict.Insert(i, i);
+    }
+    LazyfreeClear(dict);
+    ASSERT_EQ(dict.Size(), 0u);
+
+    // Still usable after the entries are moved away.
+    dict.Insert(1, 1);
+    ASSERT_EQ(*dict.Fetch(1), 1);
+  }
+  LazyfreeWait();
+  ASSERT_EQ(zmalloc_used_memory(), used);
+}
+
+}
@@ -0,0 +1,109 @@
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "mredis/src/epoch.h"
+#include "mredis/src/lockfree_dict.h"
+#include <gtest/gtest.h>
+
+namespace mredis {
+
+TEST(EpochTest, Retire) {
+  EpochReclaim();
+  EpochReclaim();
+  std::atomic<bool> entered(false);
+  std::atomic<bool> leave(false);
+  std::thread reader([&entered, &leave]() {
+    EpochGuard guard;
+    entered = true;
+    while (!leave) std::this_thread::yield();
+  });
+  while (!entered) std::this_thread::yield();
+
+  // Not freed while a reader which may see it is inside a guard.
+  bool freed = false;
+  EpochRetire([&freed]() { freed = true; });
+  for (int i = 0; i < 10; ++i) EpochReclaim();
+  ASSERT_FALSE(freed);
+
+  leave = true;
+  reader.join();
+  for (int i = 0; i < 3; ++i) EpochReclaim();
+  ASSERT_TRUE(freed);
+  ASSERT_EQ(EpochPendingObjects(), 0u);
+}
+
+class LockFreeDictTest : public ::testing::Test {
+ public:
+  LockFreeDictTest(): dict_(std::hash<int>()) {}
+ protected:
+  LockFreeDictionary<int, int> dict_;
+};
+
+TEST_F(LockFreeDictTest, InsertFetch) {
+  int max_count = 100000;
+  for (int i = 0; i < max_count; ++i) {
+    ASSERT_TRUE(dict_.Insert(i, i + 1));
+  }
+  ASSERT_FALSE(dict_.Insert(0, 0));
+  ASSERT_EQ(dict_.Size(), static_cast<size_t>(max_count));
+
+  int value = 0;
+  for (int i = 0; i < max_count; ++i) {
+    ASSERT_TRUE(dict_.Fetch(i, &value));
+    ASSERT_EQ(value, i + 1);
+  }
+  ASSERT_FALSE(dict_.Fetch(max_count, &value));
+
+  ASSERT_FALSE(dict_.Replace(7, 70));
+  ASSERT_TRUE(dict_.Fetch(7, &value));
+  ASSERT_EQ(value, 70);
+  ASSERT_TRUE(dict_.Replace(max_count, 1));
+  ASSERT_EQ(dict_.Size(), static_cast<size_t>(max_count + 1));
+
+  dict_.RehashMilliseconds(100);
+  for (int i = 0; i <= max_count; i += 2) {
+    ASSERT_TRUE(dict_.Erase(i));
+  }
+  ASSERT_FALSE(dict_.Erase(0));
+  ASSERT_EQ(dict_.Size(), static_cast<size_t>(max_count / 2));
+  for (int i = 0; i < max_count; ++i) {
+    ASSERT_EQ(dict_.Fetch(i, &value), i % 2 == 1);
+  }
+  static_assert(!std::is_default_constructible<LockFreeDictionary<int, int>>::value, "");
+}
+
+TEST_F(LockFreeDictTest, ReadWhileWriting) {
+  const int kReaders = 4;
+  const int kKeys = 20000;
+  // Odd keys stay, readers must always find them with their value while
+  // the writer grows the table, replaces and erases around them.
+  for (int i = 1; i < kKeys; i += 2) dict_.Insert(i, i);
+
+  std::atomic<bool> stop(false);
+  std::atomic<int> misses(0);
+  std::vector<std::thread> readers;
+  for (int t = 0; t < kReaders; ++t) {
+    readers.push_back(std::thread([this, &stop, &misses, kKeys]() {
+      int value = 0;
+      while (!stop) {
+        for (int i = 1; i < kKeys; i += 2) {
+          if (!dict_.Fetch(i, &value) || (value != i && value != -i)) misses++;
+        }
+      }
+    }));
+  }
+
+  for (int round = 0; round < 3; ++round) {
+    for (int i = 0; i < kKeys * 4; i += 2) dict_.Insert(i, i);
+    for (int i = 1; i < kKeys; i += 2) dict_.Replace(i, round % 2 ? i : -i);
+    for (int i = 0; i < kKeys * 4; i += 2) dict_.Erase(i);
+  }
+  stop = true;
+  for (auto& reader : readers) reader.join();
+
+  ASSERT_EQ(misses.load(), 0);
+  ASSERT_EQ(dict_.Size(), static_cast<size_t>(kKeys / 2));
+}
+
+}
@@ -3,6 +3,7 @@
 
 #include "mredis/src/skiplist.h"
 #include "mredis/src/string.h"
+#include "mredis/src/zmalloc.h"
 #include <gtest/gtest.h>
 
 namespace mredis {
@@ -47,4 +48,48 @@ TEST(SkipListTest, IteratorTest) {
   }
 }
 
+TEST(SkipListTest, DefragTest) {
+  SkipList<String> list;
+  int max_count = 10000;
+  for (int i = 0; i < max_count; ++i) {
+    list.Insert(String(std::to_string(i).c_str()), i);
+  }
+  for (int i = 0; i < max_count; ++i) {
+    if (i % 10 != 0) list.Delete(String(std::to_string(i).c_str()), i);
+  }
+
+  for (int pass = 0; pass < 5; ++pass) {
+    size_t cursor = 0;
+    do {
+      cursor = list.Defrag(cursor, 1);
+    } while (cursor != 0);
+  }
+
+  ASSERT_EQ(list.Len(), static_cast<size_t>(max_count / 10));
+  int i = 0;
+  for (auto it = list.Begin(); it != list.End(); ++it, i += 10) {
+    ASSERT_EQ(it->key, String(std::to_string(i).c_str()));
+    ASSERT_EQ(list.GetRank(String(std::to_string(i).c_str()), i), static_cast<size_t>(i / 10 + 1));
+  }
+  ASSERT_EQ(i, max_count);
+}
+
+TEST(SkipListTest, MemoryUsageTest) {
+  size_t used = zmalloc_used_memory();
+  SkipList<String> list;
+  size_t empty = list.MemoryUsage();
+  ASSERT_GE(empty, sizeof(list));
+
+  int max_count = 10000;
+  for (int i = 0; i < max_count; ++i) {
+    list.Insert(String("wzpfish"), i);
+  }
+  // Every node is exactly visited, so it matches zmalloc accounting.
+  size_t exact = list.MemoryUsage(0);
+  ASSERT_EQ(exact, sizeof(list) + zmalloc_used_memory() - used);
+  size_t sampled = list.MemoryUsage(100);
+  ASSERT_GT(sampled, exact / 2);
+  ASSERT_LT(sampled, exact * 2);
+}
+
 }
\ No newline at end of file
@@ -115,4 +115,37 @@ TEST(StringTest, SplitTest) {
   ASSERT_TRUE(tokens.size() == 0);
 }
 
+TEST(StringTest, EmbedTest) {
+  // Short strings allocate nothing.
+  String s1("hello, wzpfish");
+  ASSERT_TRUE(s1.IsEmbedded());
+  ASSERT_EQ(s1.MemoryUsage(), 0u);
+  ASSERT_EQ(s1.AllocSize(), kStringEmbedSize);
+
+  // Growing past the object moves to the heap, shrinking moves back.
+  s1.Cat(", hello, wzpfish, hello");
+  ASSERT_FALSE(s1.IsEmbedded());
+  ASSERT_GT(s1.MemoryUsage(), 0u);
+  ASSERT_EQ(s1, String("hello, wzpfish, hello, wzpfish, hello"));
+  s1.Range(0, 13);
+  s1.RemoveFreeSpace();
+  ASSERT_TRUE(s1.IsEmbedded());
+  ASSERT_EQ(s1, String("hello, wzpfish"));
+
+  // Moves of both kinds leave the source empty and usable.
+  String s2(std::move(s1));
+  ASSERT_EQ(s2, String("hello, wzpfish"));
+  ASSERT_EQ(s1, String());
+  String s3("a string which is too long to be embedded");
+  s1 = std::move(s3);
+  ASSERT_FALSE(s1.IsEmbedded());
+  ASSERT_EQ(s1, String("a string which is too long to be embedded"));
+  ASSERT_EQ(s3, String());
+  s3.Cat("ok");
+  ASSERT_EQ(s3, String("ok"));
+
+  s2.Copy("a string which is too long to be embedded");
+  ASSERT_EQ(s2, s1);
+}
+
 }
\ No newline at end of file
@@ -0,0 +1,139 @@
+#include <cstdint>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include "mredis/src/zmalloc.h"
+#include "mredis/src/slab.h"
+#include <gtest/gtest.h>
+
+namespace mredis {
+
+TEST(ZmallocTest, SizeClassTest) {
+  size_t last_size = 0;
+  for (size_t size = 1; size <= kSlabMaxSize; ++size) {
+    int cls = slab_size_class(size);
+    ASSERT_NE(cls, kSlabNoClass);
+    ASSERT_GE(slab_class_size(cls), size);
+    // The previous class must be too small, else we waste memory.
+    if (cls > 0) {
+      ASSERT_LT(slab_class_size(cls - 1), size);
+    }
+    ASSERT_GE(slab_class_size(cls), last_size);
+    last_size = slab_class_size(cls);
+  }
+  ASSERT_EQ(last_size, kSlabMaxSize);
+  ASSERT_EQ(slab_size_class(kSlabMaxSize + 1), kSlabNoClass);
+}
+
+TEST(ZmallocTest, UsedMemoryTest) {
+  size_t used = zmalloc_used_memory();
+  std::vector<void*> ptrs;
+  for (size_t size = 0; size < 3 * kSlabMaxSize; size += 7) {
+    ptrs.push_back(zmalloc(size));
+    ptrs.push_back(zcalloc(size));
+  }
+  ASSERT_GT(zmalloc_used_memory(), used);
+  for (size_t i = 0; i < ptrs.size(); ++i) {
+    ptrs[i] = zrealloc(ptrs[i], i * 3);
+  }
+  for (void* ptr : ptrs) {
+    zfree(ptr);
+  }
+  ASSERT_EQ(zmalloc_used_memory(), used);
+}
+
+TEST(ZmallocTest, SizedFreeTest) {
+  size_t used = zmalloc_used_memory();
+  for (size_t size = 0; size < 3 * kSlabMaxSize; size += 13) {
+    void* ptr = zmalloc(size);
+    ASSERT_GE(zmalloc_size(ptr), size);
+    ASSERT_EQ(zmalloc_used_memory(), used + zmalloc_size(ptr));
+    zfree(ptr, size);
+    ASSERT_EQ(zmalloc_used_memory(), used);
+  }
+  // Shrunk to nothing like an empty Intset, then freed with size 0.
+  void* ptr = zrealloc(zmalloc(64), 0);
+  ASSERT_TRUE(ptr != nullptr);
+  zfree(ptr, 0);
+  ASSERT_EQ(zmalloc_used_memory(), used);
+}
+
+TEST(ZmallocTest, ReallocTest) {
+  char* p = static_cast<char*>(zmalloc(10));
+  std::memcpy(p, "wzpfish", 8);
+  // Grow in the same class, to another class and out of the slab.
+  for (size_t size : {12, 100, 1000, 10000, 20, 8}) {
+    p = static_cast<char*>(zrealloc(p, size));
+    ASSERT_EQ(std::strcmp(p, "wzpfish"), 0);
+  }
+  zfree(p);
+
+  char* zero = static_cast<char*>(zcalloc(64));
+  for (int i = 0; i < 64; ++i) ASSERT_EQ(zero[i], 0);
+  zfree(zero);
+}
+
+TEST(ZmallocTest, HugeTest) {
+  size_t used = zmalloc_used_memory();
+  for (size_t size : {1000, 4 * 1024 * 1024 + 1}) {
+    char* p = static_cast<char*>(zcalloc_huge(size));
+    ASSERT_GE(zmalloc_huge_size(p, size), size);
+    ASSERT_EQ(zmalloc_used_memory(), used + zmalloc_huge_size(p, size));
+    for (size_t i = 0; i < size; i += 997) ASSERT_EQ(p[i], 0);
+    std::memset(p, 'x', size);
+    zfree_huge(p, size);
+    ASSERT_EQ(zmalloc_used_memory(), used);
+  }
+  // Large arrays are aligned to huge pages.
+  void* p = zcalloc_huge(8 * 1024 * 1024);
+  ASSERT_EQ(reinterpret_cast<uintptr_t>(p) % (2 * 1024 * 1024), 0u);
+  zfree_huge(p, 8 * 1024 * 1024);
+}
+
+TEST(ZmallocTest, AllocatorInfoTest) {
+  ASSERT_TRUE(zmalloc_lib_name() != nullptr);
+
+  std::vector<void*> ptrs;
+  for (int i = 0; i < 1000; ++i) {
+    ptrs.push_back(zmalloc(32));
+  }
+  size_t allocated, active, resident;
+  ASSERT_TRUE(zmalloc_get_allocator_info(&allocated, &active, &resident));
+  ASSERT_GE(allocated, static_cast<size_t>(1000 * 32));
+  ASSERT_GE(active, allocated);
+  ASSERT_GE(resident, active);
+  ASSERT_GE(zmalloc_get_allocator_frag_ratio(), 1.0);
+  for (void* ptr : ptrs) {
+    zfree(ptr);
+  }
+}
+
+TEST(ZmallocTest, ThreadTest) {
+  zmalloc_enable_thread_safeness();
+  size_t used = zmalloc_used_memory();
+
+  // Objects are allocated in one thread and freed in another.
+  const int kThreads = 4;
+  const int kCount = 10000;
+  std::vector<std::vector<void*>> ptrs(kThreads);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; ++t) {
+    threads.emplace_back([&ptrs, t]() {
+      for (int i = 0; i < kCount; ++i) {
+        ptrs[t].push_back(zmalloc(24 + (i % 5) * 8));
+      }
+    });
+  }
+  for (auto& thread : threads) thread.join();
+  threads.clear();
+  for (int t = 0; t < kThreads; ++t) {
+    threads.emplace_back([&ptrs, t]() {
+      for (void* ptr : ptrs[(t + 1) % kThreads]) zfree(ptr);
+    });
+  }
+  for (auto& thread : threads) thread.join();
+  ASSERT_EQ(zmalloc_used_memory(), used);
+}
+
+}